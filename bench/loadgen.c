@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "shared.h"
+
+// Configuration, from the command line
+static const char *HOST = "127.0.0.1";
+static int PORT = 22034;
+static size_t CONNECTIONS = 8;
+static unsigned DURATION = 10;
+static double RATE = 0;
+static size_t PIPELINE = 1;
+static const char *COMMAND = "04#";
+static bool V1 = false;
+
+// Results of one connection
+typedef struct {
+  pthread_t thread;
+  // Latency of every response, in nanoseconds
+  uint64_t *latencies;
+  size_t count, cap;
+  size_t errors;
+  size_t bytes;
+} worker;
+
+// Time at which every connection stops sending
+static uint64_t deadline;
+
+static void usage(const char *);
+static uint64_t now(void);
+static void *run(void *);
+static int open_connection(void);
+static bool read_response(int, rx_buffer *, size_t *, bool *);
+static void record(worker *, uint64_t);
+static int compare(const void *, const void *);
+static double percentile(uint64_t *, size_t, double);
+
+// Load generator: opens connections to the server and sends commands on them,
+// either as fast as responses come back (closed loop) or at a fixed rate per
+// connection (open loop), then reports throughput and latency percentiles.
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:c:d:r:P:m:1")) != -1) {
+    switch (opt) {
+    case 'h':
+      HOST = optarg;
+      break;
+    case 'p':
+      PORT = atoi(optarg);
+      break;
+    case 'c':
+      CONNECTIONS = strtoull(optarg, NULL, 10);
+      break;
+    case 'd':
+      DURATION = atoi(optarg);
+      break;
+    case 'r':
+      RATE = atof(optarg);
+      break;
+    case 'P':
+      PIPELINE = strtoull(optarg, NULL, 10);
+      break;
+    case 'm':
+      COMMAND = optarg;
+      break;
+    case '1':
+      V1 = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (CONNECTIONS == 0 || PIPELINE == 0 || strlen(COMMAND) != 3) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  worker *workers = malloc_s(CONNECTIONS * sizeof(worker));
+  memset(workers, 0, CONNECTIONS * sizeof(worker));
+  uint64_t start = now();
+  deadline = start + (uint64_t)DURATION * 1000000000;
+
+  for (size_t i = 0; i < CONNECTIONS; i++) {
+    if (pthread_create(&workers[i].thread, NULL, run, &workers[i]) != 0) {
+      error("Could not start connection %zu", i);
+      return 1;
+    }
+  }
+
+  // Merge the results of every connection
+  size_t count = 0, errors = 0, bytes = 0;
+  for (size_t i = 0; i < CONNECTIONS; i++) {
+    pthread_join(workers[i].thread, NULL);
+    count += workers[i].count;
+    errors += workers[i].errors;
+    bytes += workers[i].bytes;
+  }
+  double elapsed = (now() - start) / 1e9;
+
+  uint64_t *latencies = malloc_s((count ? count : 1) * sizeof(uint64_t));
+  size_t n = 0;
+  for (size_t i = 0; i < CONNECTIONS; i++) {
+    memcpy(latencies + n, workers[i].latencies,
+           workers[i].count * sizeof(uint64_t));
+    n += workers[i].count;
+    free(workers[i].latencies);
+  }
+  qsort(latencies, count, sizeof(uint64_t), compare);
+
+  printf("connections %zu, pipeline %zu, %s\n", CONNECTIONS, PIPELINE,
+         RATE > 0 ? "open loop" : "closed loop");
+  printf("requests    %zu in %.2f s, %zu errors\n", count, elapsed, errors);
+  printf("throughput  %.1f req/s, %.2f MB/s\n", count / elapsed,
+         bytes / elapsed / 1e6);
+  printf("latency ms  p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+         percentile(latencies, count, 0.5), percentile(latencies, count, 0.99),
+         percentile(latencies, count, 0.999),
+         percentile(latencies, count, 1.0));
+
+  free(latencies);
+  free(workers);
+  return errors > 0;
+}
+
+// Print the command line options
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-h host] [-p port] [-c connections] [-d seconds] "
+          "[-r rate] [-P depth] [-m command] [-1]\n"
+          "  -h  address of the server, default 127.0.0.1\n"
+          "  -p  port of the server, default 22034\n"
+          "  -c  number of connections, default 8\n"
+          "  -d  duration of the run in seconds, default 10\n"
+          "  -r  requests per second per connection, default 0 (closed loop)\n"
+          "  -P  commands sent at once on a connection, default 1\n"
+          "  -m  command to send, default 04#\n"
+          "  -1  use protocol v1, where only responses with a Content-Length "
+          "can be told apart\n",
+          name);
+}
+
+// Nanoseconds on a monotonic clock
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Send commands on one connection until the deadline, recording the latency
+// of every response. In open loop, latency counts from when the command was
+// due rather than when it was sent, so a slow server cannot hide its backlog.
+static void *run(void *arg) {
+  worker *w = arg;
+  int fd = open_connection();
+  if (fd < 0) {
+    w->errors++;
+    return NULL;
+  }
+
+  rx_buffer rb;
+  rxbuf_init(&rb);
+
+  char *batch = malloc_s(3 * PIPELINE);
+  for (size_t i = 0; i < PIPELINE; i++) {
+    memcpy(batch + 3 * i, COMMAND, 3);
+  }
+
+  uint64_t interval = RATE > 0 ? 1e9 / RATE : 0;
+  uint64_t due = now();
+
+  while (now() < deadline) {
+    if (interval) {
+      uint64_t t = now();
+      if (t < due) {
+        usleep((due - t) / 1000);
+      }
+    } else {
+      due = now();
+    }
+
+    send_all(fd, batch, 3 * PIPELINE);
+
+    for (size_t i = 0; i < PIPELINE; i++) {
+      size_t len;
+      bool ok;
+      if (!read_response(fd, &rb, &len, &ok)) {
+        w->errors++;
+        goto done;
+      }
+
+      record(w, now() - due);
+      w->bytes += len;
+      w->errors += !ok;
+    }
+
+    due += interval;
+  }
+
+done:
+  rxbuf_free(&rb);
+  free(batch);
+  check(close(fd), "close");
+  return NULL;
+}
+
+// Connect to the server and, unless protocol v1 was requested, switch the
+// connection to v2. Returns the socket, or -1 on error.
+static int open_connection(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(PORT)};
+
+  if (inet_pton(AF_INET, HOST, &addr.sin_addr) != 1) {
+    error("Invalid address %s", HOST);
+    check(close(fd), "close");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perrno("Could not connect to %s:%d", HOST, PORT);
+    check(close(fd), "close");
+    return -1;
+  }
+
+  // Commands are small and should leave right away
+  int yes = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+
+  // A response that never comes counts as an error instead of a hang
+  struct timeval timeout = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (V1) {
+    return fd;
+  }
+
+  send_all(fd, V2_HANDSHAKE, strlen(V2_HANDSHAKE));
+
+  unsigned char header[V2_HEADER_LEN];
+  if (recv(fd, header, V2_HEADER_LEN, MSG_WAITALL) != V2_HEADER_LEN ||
+      header[0] != V2_VERSION) {
+    error("The server does not speak protocol v2, try -1");
+    check(close(fd), "close");
+    return -1;
+  }
+
+  return fd;
+}
+
+// Read one response into `rb` and drop it, setting its length in `len` and
+// whether it was a success in `ok`. Returns false if the connection failed or
+// the response could not be framed.
+static bool read_response(int fd, rx_buffer *rb, size_t *len, bool *ok) {
+  while (true) {
+    size_t total = 0;
+
+    if (!V1 && rb->len >= V2_HEADER_LEN) {
+      unsigned char *h = (unsigned char *)rb->data;
+      *len = (size_t)h[4] << 24 | h[5] << 16 | h[6] << 8 | h[7];
+      *ok = h[1] == V2_OK;
+      total = V2_HEADER_LEN + *len;
+    } else if (V1 && rb->len > 0) {
+      // A response framed by its Content-Length, and the newline after it
+      char *end = memmem(rb->data, rb->len, "\r\n\r\n", 4);
+      char *length = strcasestr(rb->data, "Content-Length:");
+
+      if (end && (!length || length > end)) {
+        error("Response without a Content-Length, it cannot be framed");
+        return false;
+      }
+      if (end) {
+        *len = end + 4 - rb->data + strtoull(length + 15, NULL, 10) + 1;
+        *ok = true;
+        total = *len;
+      }
+    }
+
+    if (total > 0 && rb->len >= total) {
+      rxbuf_consume(rb, total);
+      return true;
+    }
+
+    long bytes_rx = rxbuf_recv(rb, fd, 0);
+    if (bytes_rx <= 0) {
+      if (bytes_rx < 0) {
+        perrno("Could not receive response");
+      }
+      return false;
+    }
+  }
+}
+
+// Add a latency to the results of a connection
+static void record(worker *w, uint64_t latency) {
+  if (w->count == w->cap) {
+    w->cap = w->cap ? 2 * w->cap : 4096;
+    w->latencies = realloc_s(w->latencies, w->cap * sizeof(uint64_t));
+  }
+
+  w->latencies[w->count++] = latency;
+}
+
+// Order latencies for `qsort`
+static int compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Latency in milliseconds below which a fraction `p` of the `count` sorted
+// latencies fall
+static double percentile(uint64_t *sorted, size_t count, double p) {
+  if (count == 0) {
+    return 0;
+  }
+
+  size_t index = p * count;
+  if (index >= count) {
+    index = count - 1;
+  }
+
+  return sorted[index] / 1e6;
+}
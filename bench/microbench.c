@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "shared.h"
+
+// Payload sizes of the sweep
+#define MIN_SIZE 1024
+#define MAX_SIZE (64 * 1024 * 1024)
+// Each measurement moves about this many bytes, within the iteration bounds
+#define TARGET_BYTES (256 * 1024 * 1024)
+#define MIN_ITERATIONS 3
+#define MAX_ITERATIONS 100000
+
+// Calls made by the measuring thread, counted by the wrappers below. Helper
+// threads feeding or draining sockets are not counted.
+static __thread bool counting = false;
+static __thread size_t allocs = 0, syscalls = 0;
+// Nanoseconds taken by the calls of the last measurement, without its setup
+static uint64_t measure_start, measured;
+
+// Configuration, from the command line
+static bool JSON = false;
+static size_t MAX = MAX_SIZE;
+static const char *ONLY = NULL;
+static const char *SAVE_DIR = "/dev/shm";
+
+// A helper under test, run `iterations` times on `size` byte payloads
+typedef void (*bench_fn)(size_t size, size_t iterations);
+
+typedef struct {
+  const char *name;
+  bench_fn fn;
+} benchmark;
+
+// A socket and the number of bytes a helper thread moves through it
+typedef struct {
+  int fd;
+  size_t bytes;
+} pump;
+
+static void bench_send_all(size_t, size_t);
+static void bench_recv_all(size_t, size_t);
+static void bench_split_http_response(size_t, size_t);
+static void bench_make_error_message(size_t, size_t);
+static void bench_save_file(size_t, size_t);
+static void report(const char *, size_t, size_t, uint64_t, size_t, size_t,
+                   bool);
+static char *payload(size_t);
+static void *drain(void *);
+static void *feed(void *);
+static void measure_begin(void);
+static void measure_end(void);
+static uint64_t now(void);
+
+static const benchmark BENCHMARKS[] = {
+    {"send_all", bench_send_all},
+    {"recv_all", bench_recv_all},
+    {"split_http_response", bench_split_http_response},
+    {"make_error_message", bench_make_error_message},
+    {"save_file", bench_save_file},
+};
+
+// Measure the helpers of src/shared.c over socketpairs and tmpfs files, for
+// payloads from 1 KiB to 64 MiB, and print ns/op, bytes/s, allocations/op and
+// syscalls/op as CSV, or as JSON with -j
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "jm:b:d:")) != -1) {
+    switch (opt) {
+    case 'j':
+      JSON = true;
+      break;
+    case 'm':
+      MAX = strtoull(optarg, NULL, 10);
+      break;
+    case 'b':
+      ONLY = optarg;
+      break;
+    case 'd':
+      SAVE_DIR = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-j] [-m max_size] [-b benchmark] [-d dir]\n"
+              "  -j  print JSON instead of CSV\n"
+              "  -m  largest payload in bytes, default 64 MiB\n"
+              "  -b  only run this benchmark\n"
+              "  -d  directory for save_file, default /dev/shm\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (JSON) {
+    printf("[\n");
+  } else {
+    printf("benchmark,size,iterations,ns_per_op,bytes_per_sec,allocs_per_op,"
+           "syscalls_per_op\n");
+  }
+
+  bool first = true;
+  for (size_t b = 0; b < sizeof(BENCHMARKS) / sizeof(benchmark); b++) {
+    if (ONLY && strcmp(ONLY, BENCHMARKS[b].name) != 0) {
+      continue;
+    }
+
+    for (size_t size = MIN_SIZE; size <= MAX; size *= 4) {
+      size_t iterations = TARGET_BYTES / size;
+      if (iterations < MIN_ITERATIONS) {
+        iterations = MIN_ITERATIONS;
+      }
+      if (iterations > MAX_ITERATIONS) {
+        iterations = MAX_ITERATIONS;
+      }
+
+      allocs = syscalls = 0;
+      BENCHMARKS[b].fn(size, iterations);
+
+      report(BENCHMARKS[b].name, size, iterations, measured, allocs, syscalls,
+             first);
+      first = false;
+    }
+  }
+
+  if (JSON) {
+    printf("\n]\n");
+  }
+
+  return 0;
+}
+
+// Send `size` bytes over a socketpair, drained by another thread
+static void bench_send_all(size_t size, size_t iterations) {
+  int fds[2];
+  check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair");
+
+  pthread_t t;
+  pump p = {fds[1], size * iterations};
+  pthread_create(&t, NULL, drain, &p);
+
+  char *buf = payload(size);
+
+  measure_begin();
+  for (size_t i = 0; i < iterations; i++) {
+    send_all(fds[0], buf, size);
+  }
+  measure_end();
+
+  pthread_join(t, NULL);
+  free(buf);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Receive `size` bytes from a socketpair, fed by another thread
+static void bench_recv_all(size_t size, size_t iterations) {
+  int fds[2];
+  check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair");
+
+  pthread_t t;
+  pump p = {fds[1], size * iterations};
+  pthread_create(&t, NULL, feed, &p);
+
+  measure_begin();
+  for (size_t i = 0; i < iterations; i++) {
+    size_t len;
+    free(recv_all(fds[0], size, &len));
+  }
+  measure_end();
+
+  pthread_join(t, NULL);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Find the headers of a response whose content is `size` bytes
+static void bench_split_http_response(size_t size, size_t iterations) {
+  const char *head = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n";
+  size_t head_len = strlen(head);
+  char *buf = payload(head_len + size);
+  memcpy(buf, head, head_len);
+
+  measure_begin();
+  for (size_t i = 0; i < iterations; i++) {
+    size_t headers_len, content_offset;
+    split_http_response(buf, head_len + size, &headers_len, &content_offset);
+  }
+  measure_end();
+
+  free(buf);
+}
+
+// Format a message of `size` bytes
+static void bench_make_error_message(size_t size, size_t iterations) {
+  char *arg = payload(size);
+  arg[size - 1] = '\0';
+
+  measure_begin();
+  for (size_t i = 0; i < iterations; i++) {
+    free(make_error_message("Error: %s", arg));
+  }
+  measure_end();
+
+  free(arg);
+}
+
+// Save `size` bytes to a file in SAVE_DIR, which should be a tmpfs so the disk
+// is not measured
+static void bench_save_file(size_t size, size_t iterations) {
+  char *buf = payload(size);
+  char file_name[256];
+  snprintf(file_name, sizeof(file_name), "%s/microbench-%d.html", SAVE_DIR,
+           getpid());
+
+  measure_begin();
+  for (size_t i = 0; i < iterations; i++) {
+    save_file(buf, size, file_name);
+  }
+  measure_end();
+
+  unlink(file_name);
+  free(buf);
+}
+
+// Print the results of one measurement
+static void report(const char *name, size_t size, size_t iterations,
+                   uint64_t elapsed, size_t n_allocs, size_t n_syscalls,
+                   bool first) {
+  double ns_per_op = (double)elapsed / iterations;
+  double bytes_per_sec = (double)size * iterations / (elapsed / 1e9);
+  double allocs_per_op = (double)n_allocs / iterations;
+  double syscalls_per_op = (double)n_syscalls / iterations;
+
+  if (JSON) {
+    printf("%s  {\"benchmark\": \"%s\", \"size\": %zu, \"iterations\": %zu, "
+           "\"ns_per_op\": %.1f, \"bytes_per_sec\": %.0f, "
+           "\"allocs_per_op\": %.2f, \"syscalls_per_op\": %.2f}",
+           first ? "" : ",\n", name, size, iterations, ns_per_op,
+           bytes_per_sec, allocs_per_op, syscalls_per_op);
+  } else {
+    printf("%s,%zu,%zu,%.1f,%.0f,%.2f,%.2f\n", name, size, iterations,
+           ns_per_op, bytes_per_sec, allocs_per_op, syscalls_per_op);
+  }
+  fflush(stdout);
+}
+
+// Allocate `size` bytes of printable text
+static char *payload(size_t size) {
+  char *buf = malloc_s(size);
+  for (size_t i = 0; i < size; i++) {
+    buf[i] = 'a' + i % 26;
+  }
+
+  return buf;
+}
+
+// Read and throw away `p->bytes` bytes from `p->fd`
+static void *drain(void *arg) {
+  pump *p = arg;
+  size_t len = 1024 * 1024;
+  char *buf = malloc_s(len);
+
+  while (p->bytes > 0) {
+    long bytes_rx = recv(p->fd, buf, len < p->bytes ? len : p->bytes, 0);
+    if (bytes_rx <= 0) {
+      perrno("Could not drain the socket");
+      break;
+    }
+    p->bytes -= bytes_rx;
+  }
+
+  free(buf);
+  return NULL;
+}
+
+// Write `p->bytes` bytes to `p->fd`
+static void *feed(void *arg) {
+  pump *p = arg;
+  size_t len = 1024 * 1024;
+  char *buf = payload(len);
+
+  while (p->bytes > 0) {
+    long bytes_tx = send(p->fd, buf, len < p->bytes ? len : p->bytes, 0);
+    if (bytes_tx <= 0) {
+      perrno("Could not feed the socket");
+      break;
+    }
+    p->bytes -= bytes_tx;
+  }
+
+  free(buf);
+  return NULL;
+}
+
+// Start counting calls and timing them, once the setup of a benchmark is done
+static void measure_begin(void) {
+  counting = true;
+  measure_start = now();
+}
+
+// Stop counting calls and timing them, before the cleanup of a benchmark
+static void measure_end(void) {
+  measured = now() - measure_start;
+  counting = false;
+}
+
+// Nanoseconds on a monotonic clock
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Wrappers of the allocation functions and syscalls used by src/shared.c. The
+// linker sends calls to `f` to `__wrap_f`, which calls the real `__real_f`.
+
+#define COUNT(counter)                                                         \
+  if (counting) {                                                              \
+    counter++;                                                                 \
+  }
+
+void *__real_malloc(size_t);
+void *__real_realloc(void *, size_t);
+ssize_t __real_recv(int, void *, size_t, int);
+ssize_t __real_send(int, const void *, size_t, int);
+ssize_t __real_readv(int, const struct iovec *, int);
+ssize_t __real_writev(int, const struct iovec *, int);
+ssize_t __real_write(int, const void *, size_t);
+int __real_mkostemp(char *, int);
+int __real_fchmod(int, mode_t);
+int __real_close(int);
+int __real_rename(const char *, const char *);
+int __real_unlink(const char *);
+
+void *__wrap_malloc(size_t n) {
+  COUNT(allocs);
+  return __real_malloc(n);
+}
+
+void *__wrap_realloc(void *p, size_t n) {
+  COUNT(allocs);
+  return __real_realloc(p, n);
+}
+
+ssize_t __wrap_recv(int fd, void *buf, size_t n, int flags) {
+  COUNT(syscalls);
+  return __real_recv(fd, buf, n, flags);
+}
+
+ssize_t __wrap_send(int fd, const void *buf, size_t n, int flags) {
+  COUNT(syscalls);
+  return __real_send(fd, buf, n, flags);
+}
+
+ssize_t __wrap_readv(int fd, const struct iovec *iov, int count) {
+  COUNT(syscalls);
+  return __real_readv(fd, iov, count);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int count) {
+  COUNT(syscalls);
+  return __real_writev(fd, iov, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t n) {
+  COUNT(syscalls);
+  return __real_write(fd, buf, n);
+}
+
+int __wrap_mkostemp(char *template, int flags) {
+  COUNT(syscalls);
+  return __real_mkostemp(template, flags);
+}
+
+int __wrap_fchmod(int fd, mode_t mode) {
+  COUNT(syscalls);
+  return __real_fchmod(fd, mode);
+}
+
+int __wrap_close(int fd) {
+  COUNT(syscalls);
+  return __real_close(fd);
+}
+
+int __wrap_rename(const char *from, const char *to) {
+  COUNT(syscalls);
+  return __real_rename(from, to);
+}
+
+int __wrap_unlink(const char *path) {
+  COUNT(syscalls);
+  return __real_unlink(path);
+}
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "shared.h"
+
+// Most bytes of a request that are read before giving up on it
+#define REQUEST_MAX 8192
+
+// Configuration, from the command line
+static int PORT = 80;
+static size_t SIZE = 50000;
+static unsigned LATENCY_MS = 0;
+static size_t CHUNK = 0;
+static int MAX_AGE = -1;
+
+// Response body, the same for every request
+static char *BODY;
+
+static void usage(const char *);
+static void *serve(void *);
+static bool send_response(int);
+
+// Local HTTP origin for benchmarks, which answers every request with the same
+// page. The server uses it with LOCALHOST=1, which requests localhost:80.
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "p:s:l:c:m:")) != -1) {
+    switch (opt) {
+    case 'p':
+      PORT = atoi(optarg);
+      break;
+    case 's':
+      SIZE = strtoull(optarg, NULL, 10);
+      break;
+    case 'l':
+      LATENCY_MS = atoi(optarg);
+      break;
+    case 'c':
+      CHUNK = strtoull(optarg, NULL, 10);
+      break;
+    case 'm':
+      MAX_AGE = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  // A page of printable text, so saved files can be inspected
+  BODY = malloc_s(SIZE);
+  for (size_t i = 0; i < SIZE; i++) {
+    BODY[i] = 'a' + i % 26;
+  }
+
+  // The server resolves localhost to ::1 unless USE_IPV4=1, so listen on both
+  // families, IPv4 clients arriving as IPv4-mapped addresses
+  int listener = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int yes = 1, no = 0;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+  setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(int));
+
+  struct sockaddr_in6 addr = {.sin6_family = AF_INET6,
+                              .sin6_port = htons(PORT),
+                              .sin6_addr = in6addr_any};
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    perrno("Could not listen on port %d", PORT);
+    return 1;
+  }
+
+  printf("Serving %zu byte pages on [::]:%d, %u ms latency, %s\n", SIZE,
+         PORT, LATENCY_MS, CHUNK ? "chunked" : "Content-Length");
+
+  while (true) {
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      perrno("Could not accept connection");
+      continue;
+    }
+
+    // Responses are written in pieces, which must not wait for each other
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, serve, (void *)(intptr_t)fd) != 0) {
+      error("Could not start a thread for connection %d", fd);
+      check(close(fd), "close");
+      continue;
+    }
+    pthread_detach(t);
+  }
+
+  return 0;
+}
+
+// Print the command line options
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-p port] [-s size] [-l latency_ms] [-c chunk_size] "
+          "[-m max_age]\n"
+          "  -p  port to listen on, default 80\n"
+          "  -s  size of the page in bytes, default 50000\n"
+          "  -l  milliseconds to wait before each response, default 0\n"
+          "  -c  send the page chunked, in chunks of this size\n"
+          "  -m  send Cache-Control: max-age with this many seconds\n",
+          name);
+}
+
+// Answer the requests of one connection. HTTP/1.1 connections are kept open
+// unless the client asks otherwise, HTTP/1.0 ones are closed after a response.
+static void *serve(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char request[REQUEST_MAX + 1];
+  size_t len = 0;
+
+  while (true) {
+    char *end = memmem(request, len, "\r\n\r\n", 4);
+
+    if (end == NULL) {
+      if (len == REQUEST_MAX) {
+        error("Request too long");
+        break;
+      }
+
+      long bytes_rx = recv(fd, request + len, REQUEST_MAX - len, 0);
+      if (bytes_rx <= 0) {
+        break;
+      }
+      len += bytes_rx;
+      continue;
+    }
+
+    request[len] = '\0';
+    bool keep_alive = strstr(request, "HTTP/1.1") != NULL &&
+                      strcasestr(request, "Connection: close") == NULL;
+
+    if (LATENCY_MS > 0) {
+      usleep(LATENCY_MS * 1000);
+    }
+
+    if (!send_response(fd) || !keep_alive) {
+      break;
+    }
+
+    // Pipelined requests stay in the buffer
+    size_t used = end + 4 - request;
+    memmove(request, request + used, len - used);
+    len -= used;
+  }
+
+  check(close(fd), "close");
+  return NULL;
+}
+
+// Send the page, framed by its length or in chunks. Returns false if the
+// connection failed.
+static bool send_response(int fd) {
+  char head[256];
+  int head_len = snprintf(head, sizeof(head),
+                          "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n");
+
+  if (MAX_AGE >= 0) {
+    head_len += snprintf(head + head_len, sizeof(head) - head_len,
+                         "Cache-Control: max-age=%d\r\n", MAX_AGE);
+  }
+
+  if (CHUNK == 0) {
+    head_len += snprintf(head + head_len, sizeof(head) - head_len,
+                         "Content-Length: %zu\r\n\r\n", SIZE);
+    struct iovec iov[2] = {{head, head_len}, {BODY, SIZE}};
+    return writev_all(fd, iov, 2) == head_len + SIZE;
+  }
+
+  head_len += snprintf(head + head_len, sizeof(head) - head_len,
+                       "Transfer-Encoding: chunked\r\n\r\n");
+  if (writev_all(fd, &(struct iovec){head, head_len}, 1) != (size_t)head_len) {
+    return false;
+  }
+
+  for (size_t sent = 0; sent < SIZE; sent += CHUNK) {
+    size_t n = SIZE - sent < CHUNK ? SIZE - sent : CHUNK;
+    char size_line[32];
+    int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+
+    struct iovec iov[3] = {
+        {size_line, size_len}, {BODY + sent, n}, {"\r\n", 2}};
+    if (writev_all(fd, iov, 3) != size_len + n + 2) {
+      return false;
+    }
+  }
+
+  return writev_all(fd, &(struct iovec){"0\r\n\r\n", 5}, 1) == 5;
+}
@@ -0,0 +1,230 @@
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "metrics.h"
+#include "shared.h"
+
+// Shards of the rate limits, each with its own lock, and the buckets of each
+#define RATE_SHARDS 64
+#define RATE_SHARD_BUCKETS 64
+// Buckets a client may use, starting from the one its address hashes to
+#define RATE_PROBES 8
+
+// Token bucket limiting the commands of a client address
+typedef struct {
+  peer_addr peer;
+  bool used;
+  double tokens;
+  // When tokens were last added, in `monotonic_ms` milliseconds
+  uint64_t updated;
+} rate_bucket;
+
+typedef struct {
+  pthread_mutex_t lock;
+  rate_bucket buckets[RATE_SHARD_BUCKETS];
+} rate_shard;
+
+// Limits from the env vars, 0 for none
+static size_t MAX_CONNECTIONS = 0;
+static size_t MAX_INFLIGHT = 0;
+static double RATE_LIMIT = 0;
+static double RATE_BURST = 0;
+static pthread_once_t admission_once = PTHREAD_ONCE_INIT;
+
+static atomic_size_t connections = 0;
+static atomic_size_t inflight = 0;
+static rate_shard rate_shards[RATE_SHARDS];
+
+// What an overloaded server answers. Every busy response shares the buffer,
+// which keeps a reference of its own so it is never freed.
+static const char BUSY_MESSAGE[] = "Server busy!\n";
+static buffer BUSY_BUFFER = {(char *)BUSY_MESSAGE, sizeof(BUSY_MESSAGE) - 1, 1,
+                             true};
+
+static void admission_init(void);
+static bool take_slot(atomic_size_t *, size_t);
+static rate_bucket *find_bucket(rate_shard *, size_t, const peer_addr *,
+                                uint64_t);
+
+// Count a new connection, unless there are MAX_CONNECTIONS already. Returns
+// whether it may be served, in which case it has to be uncounted with
+// `admission_close_connection` once closed.
+bool admission_open_connection(void) {
+  pthread_once(&admission_once, admission_init);
+  return take_slot(&connections, MAX_CONNECTIONS);
+}
+
+// Uncount a connection that `admission_open_connection` let in
+void admission_close_connection(void) {
+  if (MAX_CONNECTIONS > 0) {
+    atomic_fetch_sub_explicit(&connections, 1, memory_order_relaxed);
+  }
+}
+
+// Turn away the new connection `client_fd`, telling the client the server is
+// busy if its socket has room for that right away, and close it
+void admission_reject(int client_fd) {
+  send(client_fd, BUSY_MESSAGE, sizeof(BUSY_MESSAGE) - 1,
+       MSG_DONTWAIT | MSG_NOSIGNAL);
+  check(close(client_fd), "close");
+}
+
+// Count a new upstream fetch, unless there are MAX_INFLIGHT already. Returns
+// whether it may start, in which case it has to be uncounted with
+// `admission_end_fetch` once done.
+bool admission_begin_fetch(void) {
+  pthread_once(&admission_once, admission_init);
+  return take_slot(&inflight, MAX_INFLIGHT);
+}
+
+// Uncount a fetch that `admission_begin_fetch` let start
+void admission_end_fetch(void) {
+  if (MAX_INFLIGHT > 0) {
+    atomic_fetch_sub_explicit(&inflight, 1, memory_order_relaxed);
+  }
+}
+
+// Get the address the client of `client_fd` connects from into `peer`
+void admission_peer(int client_fd, peer_addr *peer) {
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+
+  memset(peer, 0, sizeof(peer_addr));
+  if (getpeername(client_fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+    return;
+  }
+
+  if (addr.ss_family == AF_INET6) {
+    memcpy(peer->bytes, &((struct sockaddr_in6 *)&addr)->sin6_addr, 16);
+  } else if (addr.ss_family == AF_INET) {
+    peer->bytes[10] = peer->bytes[11] = 0xff;
+    memcpy(peer->bytes + 12, &((struct sockaddr_in *)&addr)->sin_addr, 4);
+  }
+}
+
+// Take a token from the bucket of `peer` for a command that fetches a page.
+// Buckets hold up to RATE_BURST tokens and gain RATE_LIMIT per second. Returns
+// whether there was one; always true without RATE_LIMIT.
+bool admission_allow(const peer_addr *peer) {
+  pthread_once(&admission_once, admission_init);
+  if (RATE_LIMIT == 0) {
+    return true;
+  }
+
+  // FNV-1a picks the shard and the first bucket to look at
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < sizeof(peer->bytes); i++) {
+    hash = (hash ^ peer->bytes[i]) * 1099511628211ULL;
+  }
+  rate_shard *shard = &rate_shards[hash % RATE_SHARDS];
+  size_t start = hash / RATE_SHARDS % RATE_SHARD_BUCKETS;
+  uint64_t now = monotonic_ms();
+
+  pthread_mutex_lock(&shard->lock);
+
+  rate_bucket *b = find_bucket(shard, start, peer, now);
+  b->tokens += (now - b->updated) * RATE_LIMIT / 1000;
+  if (b->tokens > RATE_BURST) {
+    b->tokens = RATE_BURST;
+  }
+  b->updated = now;
+
+  bool allowed = b->tokens >= 1;
+  if (allowed) {
+    b->tokens--;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  if (!allowed) {
+    metrics_count_error(ERR_BUSY);
+  }
+  return allowed;
+}
+
+// Response telling the client the server is too busy for its command, which
+// is released with `buffer_unref` like any other. Nothing is allocated.
+http_response busy_response(void) {
+  return (http_response){buffer_ref(&BUSY_BUFFER), 0, 0, 0};
+}
+
+// Whether `res` is the response of `busy_response`
+bool is_busy_response(http_response res) { return res.buf == &BUSY_BUFFER; }
+
+// Read the limits from the env vars MAX_CONNECTIONS, MAX_INFLIGHT, RATE_LIMIT
+// and RATE_BURST
+static void admission_init(void) {
+  if (getenv("MAX_CONNECTIONS") != NULL &&
+      atoi(getenv("MAX_CONNECTIONS")) > 0) {
+    MAX_CONNECTIONS = atoi(getenv("MAX_CONNECTIONS"));
+  }
+  if (getenv("MAX_INFLIGHT") != NULL && atoi(getenv("MAX_INFLIGHT")) > 0) {
+    MAX_INFLIGHT = atoi(getenv("MAX_INFLIGHT"));
+  }
+  if (getenv("RATE_LIMIT") != NULL && atof(getenv("RATE_LIMIT")) > 0) {
+    RATE_LIMIT = atof(getenv("RATE_LIMIT"));
+  }
+
+  // A second worth of commands by default, and at least one
+  RATE_BURST = RATE_LIMIT;
+  if (getenv("RATE_BURST") != NULL && atof(getenv("RATE_BURST")) > 0) {
+    RATE_BURST = atof(getenv("RATE_BURST"));
+  }
+  if (RATE_BURST < 1) {
+    RATE_BURST = 1;
+  }
+
+  for (size_t i = 0; i < RATE_SHARDS; i++) {
+    pthread_mutex_init(&rate_shards[i].lock, NULL);
+    memset(rate_shards[i].buckets, 0, sizeof(rate_shards[i].buckets));
+  }
+}
+
+// Count one more user of `count`, unless it already has `limit`, or always if
+// `limit` is 0. Returns whether it was counted. Never waits, so a saturated
+// server sheds work at once instead of queueing it.
+static bool take_slot(atomic_size_t *count, size_t limit) {
+  if (limit == 0) {
+    return true;
+  }
+
+  if (atomic_fetch_add_explicit(count, 1, memory_order_relaxed) >= limit) {
+    atomic_fetch_sub_explicit(count, 1, memory_order_relaxed);
+    metrics_count_error(ERR_BUSY);
+    return false;
+  }
+
+  return true;
+}
+
+// Find the bucket of `peer` among the RATE_PROBES buckets of `shard` from
+// `start`. A new client gets a full bucket, an unused one or else the one that
+// has been idle the longest, whose client is the least likely to be back
+// soon. The lock of the shard must be held.
+static rate_bucket *find_bucket(rate_shard *shard, size_t start,
+                                const peer_addr *peer, uint64_t now) {
+  rate_bucket *reuse = NULL;
+
+  for (size_t i = 0; i < RATE_PROBES; i++) {
+    rate_bucket *b = &shard->buckets[(start + i) % RATE_SHARD_BUCKETS];
+    if (b->used && memcmp(&b->peer, peer, sizeof(peer_addr)) == 0) {
+      return b;
+    }
+
+    // Prefer an unused bucket, then the stalest one
+    if (reuse == NULL || (reuse->used && !b->used) ||
+        (reuse->used && b->updated < reuse->updated)) {
+      reuse = b;
+    }
+  }
+
+  reuse->peer = *peer;
+  reuse->used = true;
+  reuse->tokens = RATE_BURST;
+  reuse->updated = now;
+  return reuse;
+}
@@ -0,0 +1,23 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+
+#include "shared.h"
+
+// Address a client connects from, IPv4 addresses mapped into IPv6
+typedef struct {
+  unsigned char bytes[16];
+} peer_addr;
+
+bool admission_open_connection(void);
+void admission_close_connection(void);
+void admission_reject(int);
+bool admission_begin_fetch(void);
+void admission_end_fetch(void);
+void admission_peer(int, peer_addr *);
+bool admission_allow(const peer_addr *);
+http_response busy_response(void);
+bool is_busy_response(http_response);
+
+#endif
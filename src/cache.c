@@ -0,0 +1,436 @@
+#include <pthread.h>
+#include <strings.h>
+
+#include "cache.h"
+#include "client.h"
+#include "config.h"
+#include "http.h"
+
+// Number of independently locked shards
+#define CACHE_SHARDS 8
+
+// A cached response, keyed by the id of its destination, so a response is
+// never served for the host that replaced its own in a reload
+typedef struct cache_entry {
+  uint64_t key;
+  http_response response;
+  // Monotonic time after which the response is stale
+  time_t expires;
+  // Neighbours in the LRU list of the shard, the most recently used first
+  struct cache_entry *prev, *next;
+} cache_entry;
+
+// A fetch in progress, which concurrent misses of the same key wait for
+typedef struct flight {
+  uint64_t key;
+  // Set once the fetch completed, owned by the flight until it is freed
+  http_response result;
+  bool done;
+  // Number of requests waiting for the result
+  size_t waiters;
+  struct flight *next;
+} flight;
+
+typedef struct {
+  pthread_mutex_t lock;
+  // Signalled when a flight of the shard completes
+  pthread_cond_t done;
+  cache_entry *head, *tail;
+  flight *flights;
+  // Bytes held by the cached responses
+  size_t used;
+} cache_shard;
+
+static bool CACHE = false;
+static size_t CACHE_MAX_BYTES = 64 * 1024 * 1024;
+static long CACHE_DEFAULT_TTL = 0;
+static cache_shard shards[CACHE_SHARDS];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_init(void);
+static cache_entry *find_entry(cache_shard *, uint64_t);
+static bool insert_entry(cache_shard *, uint64_t, http_response, long);
+static void remove_entry(cache_shard *, cache_entry *);
+static void unlink_entry(cache_shard *, cache_entry *);
+static void push_front(cache_shard *, cache_entry *);
+static long freshness(http_response);
+
+// Whether responses are cached, which is enabled by the env var CACHE=1
+bool cache_enabled(void) {
+  pthread_once(&cache_once, cache_init);
+  return CACHE;
+}
+
+// Get the response for destination `dest`, from the cache if it is fresh.
+// Otherwise one request fetches it with `client`, and concurrent requests for
+// the same destination wait for that fetch instead of starting their own.
+//
+// Every caller gets the same buffer, which it has to release with
+// `buffer_unref(res.buf)`. `hit` tells whether no fetch had to be started for
+// it.
+http_response cache_fetch(int dest, bool *hit) {
+  pthread_once(&cache_once, cache_init);
+
+  config_guard guard;
+  const config *cfg = config_acquire(&guard);
+  uint64_t key = (size_t)dest < cfg->dest_count ? cfg->dests[dest].id : 0;
+  config_release(&guard);
+
+  // Unknown destinations have nothing to cache
+  if (key == 0) {
+    *hit = false;
+    return client(dest);
+  }
+
+  cache_shard *shard = &shards[key % CACHE_SHARDS];
+
+  pthread_mutex_lock(&shard->lock);
+
+  cache_entry *entry = find_entry(shard, key);
+  if (entry && entry->expires > monotonic_time()) {
+    http_response response = entry->response;
+    buffer_ref(response.buf);
+
+    // Most recently used goes first
+    unlink_entry(shard, entry);
+    push_front(shard, entry);
+
+    pthread_mutex_unlock(&shard->lock);
+    debug("Cache hit for destination %d", dest);
+    *hit = true;
+    return response;
+  }
+
+  if (entry) {
+    remove_entry(shard, entry);
+  }
+
+  // Join the fetch of the same destination, if one is in progress
+  for (flight *f = shard->flights; f; f = f->next) {
+    if (f->key != key) {
+      continue;
+    }
+
+    f->waiters++;
+    while (!f->done) {
+      pthread_cond_wait(&shard->done, &shard->lock);
+    }
+
+    http_response response = f->result;
+    buffer_ref(response.buf);
+
+    // The last waiter frees the flight, which was already unlisted
+    if (--f->waiters == 0) {
+      buffer_unref(f->result.buf);
+      free(f);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    debug("Shared the fetch of destination %d", dest);
+    *hit = true;
+    return response;
+  }
+
+  // Start a fetch that later requests can join
+  flight *f = malloc_s(sizeof(flight));
+  f->key = key;
+  f->done = false;
+  f->waiters = 0;
+  f->next = shard->flights;
+  shard->flights = f;
+
+  pthread_mutex_unlock(&shard->lock);
+
+  http_response response = client(dest);
+  long ttl = freshness(response);
+
+  pthread_mutex_lock(&shard->lock);
+
+  if (ttl > 0) {
+    insert_entry(shard, key, response, ttl);
+  }
+
+  for (flight **p = &shard->flights; *p; p = &(*p)->next) {
+    if (*p == f) {
+      *p = f->next;
+      break;
+    }
+  }
+
+  f->done = true;
+  if (f->waiters > 0) {
+    f->result = response;
+    buffer_ref(response.buf);
+    pthread_cond_broadcast(&shard->done);
+  } else {
+    free(f);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  *hit = false;
+  return response;
+}
+
+// Collect the fresh responses of the current destinations into `items`, for a
+// snapshot. Returns how many there are. The caller has to free the hosts and
+// release the responses with `buffer_unref`, then free `items`.
+size_t cache_export(cache_item **items) {
+  *items = NULL;
+  if (!cache_enabled()) {
+    return 0;
+  }
+
+  config_guard guard;
+  const config *cfg = config_acquire(&guard);
+  *items = malloc_s((cfg->dest_count + 1) * sizeof(cache_item));
+  size_t count = 0;
+
+  for (size_t i = 0; i < cfg->dest_count; i++) {
+    uint64_t key = cfg->dests[i].id;
+    cache_shard *shard = &shards[key % CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    cache_entry *entry = find_entry(shard, key);
+    time_t now = monotonic_time();
+    if (entry && entry->expires > now) {
+      cache_item *item = &(*items)[count++];
+      item->host = strdup(cfg->dests[i].host);
+      item->response = entry->response;
+      buffer_ref(item->response.buf);
+      item->ttl = entry->expires - now;
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  config_release(&guard);
+  return count;
+}
+
+// Cache `response` of `host` for `ttl` seconds, unless a response of it is
+// cached already, as when loading a snapshot. Hosts that are no destination
+// any more are ignored. Returns whether the response was cached.
+bool cache_import(const char *host, http_response response, long ttl) {
+  if (!cache_enabled() || ttl <= 0) {
+    return false;
+  }
+
+  config_guard guard;
+  const config *cfg = config_acquire(&guard);
+  uint64_t key = 0;
+  for (size_t i = 0; i < cfg->dest_count && key == 0; i++) {
+    if (strcmp(cfg->dests[i].host, host) == 0) {
+      key = cfg->dests[i].id;
+    }
+  }
+  config_release(&guard);
+
+  if (key == 0) {
+    return false;
+  }
+
+  cache_shard *shard = &shards[key % CACHE_SHARDS];
+  pthread_mutex_lock(&shard->lock);
+  bool cached = find_entry(shard, key) == NULL;
+  if (cached) {
+    cached = insert_entry(shard, key, response, ttl);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return cached;
+}
+
+// Read the configuration from the environment
+static void cache_init(void) {
+  CACHE = getenv("CACHE") != NULL;
+
+  if (getenv("CACHE_MAX_BYTES") != NULL) {
+    CACHE_MAX_BYTES = strtoul(getenv("CACHE_MAX_BYTES"), NULL, 10);
+  }
+  if (getenv("CACHE_DEFAULT_TTL") != NULL) {
+    CACHE_DEFAULT_TTL = atol(getenv("CACHE_DEFAULT_TTL"));
+  }
+
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    pthread_cond_init(&shards[i].done, NULL);
+    shards[i].head = shards[i].tail = NULL;
+    shards[i].flights = NULL;
+    shards[i].used = 0;
+  }
+}
+
+// Find the entry of a key. A shard holds a few destinations at most, so the LRU
+// list is short enough to scan. The lock must be held.
+static cache_entry *find_entry(cache_shard *shard, uint64_t key) {
+  for (cache_entry *e = shard->head; e; e = e->next) {
+    if (e->key == key) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+// Cache a response for `ttl` seconds, evicting the least recently used entries
+// until it fits in the shard's share of the memory ceiling. The lock must be
+// held. Returns false if the response is too large to cache.
+static bool insert_entry(cache_shard *shard, uint64_t key,
+                         http_response response, long ttl) {
+  size_t limit = CACHE_MAX_BYTES / CACHE_SHARDS;
+  size_t size = response.buf->len + sizeof(cache_entry);
+
+  if (size > limit) {
+    debug("Response of destination id %lu is too large to cache", key);
+    return false;
+  }
+
+  cache_entry *old = find_entry(shard, key);
+  if (old) {
+    remove_entry(shard, old);
+  }
+
+  while (shard->used + size > limit && shard->tail) {
+    debug("Evicting destination id %lu from the cache", shard->tail->key);
+    remove_entry(shard, shard->tail);
+  }
+
+  cache_entry *entry = malloc_s(sizeof(cache_entry));
+  entry->key = key;
+  entry->response = response;
+  buffer_ref(response.buf);
+  entry->expires = monotonic_time() + ttl;
+
+  push_front(shard, entry);
+  shard->used += size;
+  return true;
+}
+
+// Drop an entry from the cache. The lock must be held.
+static void remove_entry(cache_shard *shard, cache_entry *entry) {
+  unlink_entry(shard, entry);
+  shard->used -= entry->response.buf->len + sizeof(cache_entry);
+
+  buffer_unref(entry->response.buf);
+  free(entry);
+}
+
+// Take an entry out of the LRU list
+static void unlink_entry(cache_shard *shard, cache_entry *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    shard->head = entry->next;
+  }
+
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    shard->tail = entry->prev;
+  }
+}
+
+// Put an entry at the front of the LRU list
+static void push_front(cache_shard *shard, cache_entry *entry) {
+  entry->prev = NULL;
+  entry->next = shard->head;
+
+  if (shard->head) {
+    shard->head->prev = entry;
+  } else {
+    shard->tail = entry;
+  }
+  shard->head = entry;
+}
+
+// Number of seconds a response may be served from the cache, following its
+// Cache-Control and Expires headers. Errors and responses that must not be
+// stored by a shared cache return 0.
+static long freshness(http_response response) {
+  http_head head;
+  if (response.headers_len == 0 ||
+      !parse_http_head(response.buf->data, response.buf->len, &head)) {
+    return 0;
+  }
+
+  // Statuses that are cacheable by default
+  switch (head.status) {
+  case 200:
+  case 203:
+  case 204:
+  case 300:
+  case 301:
+  case 404:
+  case 405:
+  case 410:
+  case 414:
+  case 501:
+    break;
+  default:
+    return 0;
+  }
+
+  const char *headers = response.buf->data;
+  size_t len = head.header_len;
+  const char *value;
+  size_t value_len;
+  long ttl = -1;
+
+  if (get_header(headers, len, "Cache-Control", &value, &value_len)) {
+    const char *end = value + value_len;
+
+    // Go through the comma-separated directives
+    for (const char *d = value; d < end;) {
+      while (d < end && (*d == ' ' || *d == ',')) {
+        d++;
+      }
+      const char *d_end = d;
+      while (d_end < end && *d_end != ',') {
+        d_end++;
+      }
+      size_t d_len = d_end - d;
+
+      if ((d_len == 8 && strncasecmp(d, "no-store", 8) == 0) ||
+          (d_len == 8 && strncasecmp(d, "no-cache", 8) == 0) ||
+          (d_len >= 7 && strncasecmp(d, "private", 7) == 0)) {
+        return 0;
+      }
+
+      // s-maxage is meant for shared caches and wins over max-age
+      if (d_len > 9 && strncasecmp(d, "s-maxage=", 9) == 0) {
+        ttl = atol(d + 9);
+      } else if (d_len > 8 && strncasecmp(d, "max-age=", 8) == 0 && ttl < 0) {
+        ttl = atol(d + 8);
+      }
+
+      d = d_end;
+    }
+  }
+
+  if (ttl < 0 && get_header(headers, len, "Expires", &value, &value_len)) {
+    time_t expires = parse_http_date(value, value_len);
+
+    // Relative to the origin's clock if it sent one
+    const char *date;
+    size_t date_len;
+    time_t now = time(NULL);
+    if (get_header(headers, len, "Date", &date, &date_len) &&
+        parse_http_date(date, date_len) > 0) {
+      now = parse_http_date(date, date_len);
+    }
+
+    // An invalid date means already expired
+    ttl = expires > now ? expires - now : 0;
+  }
+
+  if (ttl < 0) {
+    ttl = CACHE_DEFAULT_TTL;
+  }
+
+  // Time the response already spent in other caches
+  if (get_header(headers, len, "Age", &value, &value_len)) {
+    ttl -= atol(value);
+  }
+
+  return ttl > 0 ? ttl : 0;
+}
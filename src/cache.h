@@ -0,0 +1,21 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+
+#include "shared.h"
+
+// A fresh response of the cache, with the host it is for and the seconds it
+// stays fresh
+typedef struct {
+  char *host;
+  http_response response;
+  long ttl;
+} cache_item;
+
+bool cache_enabled(void);
+http_response cache_fetch(int, bool *);
+size_t cache_export(cache_item **);
+bool cache_import(const char *, http_response, long);
+
+#endif
@@ -1,186 +1,466 @@
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "admission.h"
 #include "client.h"
-#include "destinations.h"
+#include "config.h"
+#include "conn_pool.h"
+#include "dns_cache.h"
+#include "encoding.h"
+#include "eyeballs.h"
+#include "hedge.h"
+#include "http.h"
+#include "metrics.h"
+#include "resolver.h"
 #include "shared.h"
+#include "writer.h"
 
 int AF_FAMILY = AF_INET6;
 bool IPV4 = false;
 
-// Client that performs a HTTP 1.0 request to a pre-defined list of hostnames,
-// selected through `cmd`. Valid cmds range from 0 to 21 (inclusive).
-char *client(int cmd) {
+// Request sent to every remote, and the service it is sent to
+const char HTTP_REQUEST[] = "GET / HTTP/1.0\r\n\r\n";
+const char HTTP_SERVICE[] = "http";
+
+// Request sent instead when origins are asked for compressed responses
+static const char HTTP_REQUEST_COMPRESSED[] =
+    "GET / HTTP/1.0\r\n" ACCEPT_ENCODING "\r\n";
+
+// Request sent on pooled connections, which have to stay open afterwards. The
+// second placeholder is for the Accept-Encoding header, if any.
+static const char KEEPALIVE_REQUEST[] =
+    "GET / HTTP/1.1\r\nHost: %s\r\n%sConnection: keep-alive\r\n\r\n";
+
+// Size of the last response of each destination, to size the next buffer
+static atomic_size_t SIZE_HINTS[DEST_LIMIT];
+
+// Milliseconds a command may spend on its upstream request, from the start of
+// the name resolution to the end of the response
+static long REQUEST_TIMEOUT_MS = 5000;
+static pthread_once_t client_once = PTHREAD_ONCE_INIT;
+
+static void client_init(void);
+static char *fetch(int, const char *, uint64_t, size_t *, char **);
+static char *fetch_keepalive(int, uint64_t, const char *, uint64_t, size_t *,
+                             char **);
+static char *receive_error(void);
+static void set_socket_timeouts(int, uint64_t);
+
+// Client that performs a HTTP 1.0 request to one of the configured hostnames,
+// selected through `cmd`.
+//
+// With KEEPALIVE=1, HTTP 1.1 requests are sent on connections that are kept
+// open between commands instead.
+//
+// Past MAX_INFLIGHT concurrent fetches, the busy response comes back at once.
+//
+// Returns the response to send back, which the caller has to release with
+// `buffer_unref(res.buf)`.
+http_response client(int cmd) {
   debug("Starting client...\n");
+  uint64_t deadline = request_deadline();
 
+  if (!admission_begin_fetch()) {
+    return busy_response();
+  }
+
+  // Copy the hostname, so a reload cannot free it during the request
+  uint64_t id;
+  char *host = config_destination(cmd, &id);
+
+  // Short-circuit for unknown commands
+  if (host == NULL) {
+    admission_end_fetch();
+    return message_response(make_error_message("Command not implemented\n"));
+  }
+
+  size_t bytes_rx = 0;
+  char *error_resp = NULL;
+  char *buf =
+      conn_pool_enabled()
+          ? fetch_keepalive(cmd, id, host, deadline, &bytes_rx, &error_resp)
+          : fetch(cmd, host, deadline, &bytes_rx, &error_resp);
+  admission_end_fetch();
+
+  if (buf == NULL) {
+    free(host);
+    return message_response(error_resp);
+  }
+
+  debug("Message length: %zu", bytes_rx);
+  atomic_store_explicit(&SIZE_HINTS[cmd], bytes_rx, memory_order_relaxed);
+
+  http_response res = handle_http_response(host, buf, bytes_rx);
+  free(host);
+
+  return res;
+}
+
+// Milliseconds on the clock of `monotonic_ms` by which a command starting now
+// has to be answered, REQUEST_TIMEOUT_MS (default 5000) from now
+uint64_t request_deadline(void) {
+  pthread_once(&client_once, client_init);
+  return monotonic_ms() + REQUEST_TIMEOUT_MS;
+}
+
+// Log and count that the request to `host` ran out of time. Returns the
+// message for the client.
+char *deadline_error(const char *host) {
+  char *error_resp = make_error_message("Request to %s timed out!\n", host);
+  error("%s", error_resp);
+  metrics_count_error(ERR_TIMEOUT);
+  return error_resp;
+}
+
+// Read the configuration from the environment
+static void client_init(void) {
+  if (getenv("REQUEST_TIMEOUT_MS") != NULL) {
+    REQUEST_TIMEOUT_MS = atol(getenv("REQUEST_TIMEOUT_MS"));
+  }
+}
+
+// Send a HTTP 1.0 request to `host`, destination `dest`, on a new connection,
+// and receive the response by `deadline`. With hedging enabled, a slow first
+// attempt is raced by a second one.
+//
+// Returns the response, with its length in `bytes_rx`, or NULL with a message
+// for the client in `error_resp`.
+static char *fetch(int dest, const char *host, uint64_t deadline,
+                   size_t *bytes_rx, char **error_resp) {
   // Define request
-  const char *request = "GET / HTTP/1.0\r\n\r\n";
-  const char *service = "http";
+  const char *request =
+      encoding_enabled() ? HTTP_REQUEST_COMPRESSED : HTTP_REQUEST;
+  int sockfd;
+  uint64_t sent;
+
+  if (hedge_enabled()) {
+    sockfd = hedge_request(host, request, deadline, &sent, error_resp);
+    if (sockfd < 0) {
+      return NULL;
+    }
+  } else {
+    sockfd = connect_to_host(host, deadline, error_resp);
+    if (sockfd < 0) {
+      return NULL;
+    }
+
+    // Send HTTP request
+    int len_tx = strlen(request);
 
-  // For debugging purposes, use IPv4 websites
-  if (getenv("USE_IPV4")) {
-    AF_FAMILY = AF_INET;
-    IPV4 = true;
+    debug("Sending HTTP request '%s'...", request);
+    int bytes_tx = check(send(sockfd, request, len_tx, 0),
+                         "Sending HTTP request failed!");
+    if (bytes_tx > 0) {
+      metrics_count_tx(PEER_UPSTREAM, bytes_tx);
+    }
+    sent = metrics_now();
   }
 
-  // Short-circuit for unknown commands
-  if (cmd > DEST_MAX || cmd < 0) {
-    return make_error_message("Command not implemented\n");
+  // Receive response, its headers tell how long it is
+  bool reusable;
+  size_t size_hint =
+      atomic_load_explicit(&SIZE_HINTS[dest], memory_order_relaxed);
+  char *buf = recv_http_response(sockfd, size_hint, sent, deadline, bytes_rx,
+                                 &reusable);
+  bool timed_out = buf == NULL && errno == ETIMEDOUT;
+
+  // Close socket; we're done using it
+  check(close(sockfd), "Could not close buffer");
+
+  // If response was empty, return message
+  if (buf == NULL) {
+    *error_resp = timed_out ? deadline_error(host) : receive_error();
+    return NULL;
+  }
+
+  return buf;
+}
+
+// Send a HTTP 1.1 request to destination `dest`, whose id is `id`, on a pooled
+// connection, and receive exactly one response by `deadline`, leaving the
+// connection open for the next request if the remote allows it.
+//
+// Returns like `fetch`.
+static char *fetch_keepalive(int dest, uint64_t id, const char *host,
+                             uint64_t deadline, size_t *bytes_rx,
+                             char **error_resp) {
+  char request[256];
+  int len_tx = snprintf(request, sizeof(request), KEEPALIVE_REQUEST, host,
+                        encoding_enabled() ? ACCEPT_ENCODING : "");
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int sockfd;
+    int acquired = conn_pool_acquire(dest, id, &sockfd);
+
+    if (acquired < 0) {
+      *error_resp = make_error_message("Too many connections to %s!\n", host);
+      metrics_count_error(ERR_UPSTREAM);
+      return NULL;
+    }
+
+    if (acquired == 0) {
+      sockfd = connect_to_host(host, deadline, error_resp);
+      if (sockfd < 0) {
+        conn_pool_release(dest, id, -1, false);
+        return NULL;
+      }
+    }
+
+    debug("Sending HTTP request '%s'...", request);
+    if (send(sockfd, request, len_tx, MSG_NOSIGNAL) == len_tx) {
+      metrics_count_tx(PEER_UPSTREAM, len_tx);
+
+      bool reusable;
+      size_t size_hint =
+          atomic_load_explicit(&SIZE_HINTS[dest], memory_order_relaxed);
+      char *buf = recv_http_response(sockfd, size_hint, metrics_now(),
+                                     deadline, bytes_rx, &reusable);
+
+      if (buf != NULL) {
+        conn_pool_release(dest, id, sockfd, reusable);
+        return buf;
+      }
+    }
+
+    bool timed_out = errno == ETIMEDOUT;
+    conn_pool_release(dest, id, sockfd, false);
+
+    if (timed_out) {
+      *error_resp = deadline_error(host);
+      return NULL;
+    }
+
+    // A warm connection may have been closed by the remote just as the request
+    // was sent, which is worth one more try. A new one failing is final.
+    if (acquired == 0) {
+      break;
+    }
+    debug("Reused connection to %s failed, retrying", host);
   }
 
-  // 64 bytes should be enough
-  char *host = malloc_s(64 * sizeof(char));
-  memcpy(host, destinations[cmd], strlen(destinations[cmd]));
+  *error_resp = receive_error();
+  return NULL;
+}
+
+// Log and count that the response could not be received. Returns the message
+// for the client.
+static char *receive_error(void) {
+  char *error_resp = make_error_message("Received empty response\n");
+  perrno(error_resp);
+  metrics_count_error(ERR_UPSTREAM);
+  return error_resp;
+}
+
+// Open a TCP connection to `host` by `deadline`, a time from `monotonic_ms`.
+// The blocking calls made on the socket afterwards time out at the deadline
+// too, so we never wait forever.
+//
+// Returns the connected socket, or -1 with a message for the client in
+// `error_resp`.
+int connect_to_host(const char *host, uint64_t deadline, char **error_resp) {
+  const char *service = HTTP_SERVICE;
+
+  // Race both address families instead
+  if (eyeballs_enabled()) {
+    int sockfd = eyeballs_connect(host, service, deadline, error_resp);
+    if (sockfd >= 0) {
+      set_socket_timeouts(sockfd, deadline);
+    }
+    return sockfd;
+  }
 
   // Get IP address info
-  struct addrinfo *res = get_ip_addrinfo(host, service);
+  struct addrinfo *res = get_ip_addrinfo(host, service, deadline);
 
-  // If no IP address was found, return error
+  // If no IP address was found in time, return error
+  if (res == NULL && errno == ETIMEDOUT) {
+    *error_resp = deadline_error(host);
+    return -1;
+  }
   if (res == NULL) {
-    char *error_resp = make_error_message(
-        "Could not find IP%s address for %s!\n", IPV4 ? "v4" : "v6", host);
-    free(host);
-
-    perrno(error_resp);
-    return error_resp;
+    *error_resp = make_error_message("Could not find IP%s address for %s!\n",
+                                     IPV4 ? "v4" : "v6", host);
+    perrno(*error_resp);
+    metrics_count_error(ERR_DNS);
+    return -1;
   }
 
   // Print IP address of server
   char *addr_ip = get_ip_addrstr(res);
 
   // If no IP address was found, return error
-  if (res == NULL) {
-    char *error_resp = make_error_message(
+  if (addr_ip == NULL) {
+    *error_resp = make_error_message(
         "Could not determine IP%s string representation for %s!\n",
         IPV4 ? "v4" : "v6", host);
-    free(host);
-    freeaddrinfo(res);
-
-    return error_resp;
+    free_ip_addrinfo(res);
+    return -1;
   }
 
   debug("IP%s address of %s: %s", IPV4 ? "v4" : "v6", host, addr_ip);
   free(addr_ip);
 
-  // Now that we have an IP, create a socket
-  int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  // Now that we have an IP, create a socket. It only blocks once connected,
+  // so the connection can be given up on at the deadline.
+  int sockfd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+                      res->ai_protocol);
   if (sockfd < 0) {
-    free(host);
-    freeaddrinfo(res);
+    free_ip_addrinfo(res);
 
     // Construct and return custom error message
-    char *error_resp = make_error_message("Could not create socket!\n");
-    perrno(error_resp);
-    return error_resp;
+    *error_resp = make_error_message("Could not create socket!\n");
+    perrno(*error_resp);
+    metrics_count_error(ERR_CONNECT);
+    return -1;
   }
   debug("Socket created");
 
-  // Set timeouts for the socket, because we don't want to wait forever
-  struct timeval timeout;
-  timeout.tv_sec = 5;
-  timeout.tv_usec = 0;
-  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-  setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-
   // Connect to the remote over socket
+  uint64_t start = metrics_now();
   int connect_resp = connect(sockfd, res->ai_addr, res->ai_addrlen);
+  if (connect_resp < 0 && errno == EINPROGRESS) {
+    connect_resp = wait_until(sockfd, POLLOUT, deadline) > 0 ? 0 : -1;
+
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (connect_resp == 0 &&
+        getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 &&
+        err != 0) {
+      errno = err;
+      connect_resp = -1;
+    }
+  }
+  metrics_observe(PHASE_CONNECT, start);
   // servinfo is no longer needed, dispose
-  freeaddrinfo(res);
+  free_ip_addrinfo(res);
 
   // If connect failed, error and return message
   if (connect_resp < 0) {
-    char *error_resp = make_error_message("Could not connect to %s!\n", host);
-    free(host);
-    perrno(error_resp);
-    return error_resp;
+    if (errno == ETIMEDOUT && monotonic_ms() >= deadline) {
+      *error_resp = deadline_error(host);
+    } else {
+      *error_resp = make_error_message("Could not connect to %s!\n", host);
+      perrno(*error_resp);
+      metrics_count_error(ERR_CONNECT);
+    }
+    check(close(sockfd), "close");
+    return -1;
   };
 
   debug("Connection established");
 
-  // Send HTTP request
-  int len_tx = strlen(request);
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+  set_socket_timeouts(sockfd, deadline);
 
-  debug("Sending HTTP request '%s'...", request);
-  check(send(sockfd, request, len_tx, 0), "Sending HTTP request failed!");
-
-  // Receive response
-  // 0 num_bytes because we don't expect a fixed response size
-  long bytes_rx = 0;
-  char *buf = recv_all(sockfd, 0);
-
-  // If response was empty, return message
-  if (buf == NULL) {
-    char *error_resp = make_error_message("Received empty response\n");
-    free(host);
-    perrno(error_resp);
-    return error_resp;
-  }
+  return sockfd;
+}
 
-  // Get number of received bytes
-  bytes_rx = strlen(buf) + 1;
-  debug("Message length: %ld", bytes_rx);
+// Make the blocking calls on `sockfd` give up at `deadline`, for the callers
+// that do not wait for the socket themselves
+static void set_socket_timeouts(int sockfd, uint64_t deadline) {
+  uint64_t now = monotonic_ms();
+  // A timeout of zero would mean none at all
+  uint64_t left = deadline > now ? deadline - now : 1;
 
-  // Close socket; we're done using it
-  check(close(sockfd), "Could not close buffer");
+  struct timeval timeout = {left / 1000, left % 1000 * 1000};
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
 
-  // Copy buf before passing buf to split_http_response, which frees it
-  char *buf_copy = malloc_s(bytes_rx + 1);
-  memcpy(buf_copy, buf, bytes_rx);
-  // Ensure newline and NULL termination
-  buf_copy[bytes_rx - 1] = '\n';
-  buf_copy[bytes_rx] = '\0';
-
-  // Split response into headers and content
-  char **container = split_http_response(buf, bytes_rx);
-  // If there was no HTML, early return
-  if (container == NULL) {
+// Process a complete HTTP response `buf` of `bytes_rx` bytes received from
+// `host`: print its headers and save its content to `{host}.html`. Compressed
+// content is kept as it is in the response, see `encoding_prepare`.
+//
+// `buf` must have room for two more bytes, and is consumed: a newline is added
+// to it in place and it becomes the buffer of the returned response, whose
+// headers and content point into it.
+http_response handle_http_response(const char *host, char *buf,
+                                   size_t bytes_rx) {
+  // Newline, otherwise what we send leaks into the next request
+  buf[bytes_rx] = '\n';
+  buf[bytes_rx + 1] = '\0';
+
+  http_response res = {buffer_wrap(buf, bytes_rx + 1), 0, 0, 0};
+
+  // Find the headers and the content, without copying them
+  if (!split_http_response(buf, bytes_rx, &res.headers_len,
+                           &res.content_offset)) {
+    // If there was no HTML, early return
     error("Could not save file because there was no HTML");
-    free(host);
-    return buf_copy;
+    return res;
   }
-
-  // Get headers and content from container
-  char *headers = container[0];
-  char *content = container[1];
+  res.content_len = bytes_rx - res.content_offset;
 
   // Print headers
-  printf("\n%s\n", headers);
+  debug("\n%.*s\n", (int)res.headers_len, buf);
 
-  // Save content to `{host}.html`
-  char *filename = malloc_s(strlen(host) + 6); // ".html\0"
-  sprintf(filename, "%s.html", host);
+  encoding_prepare(&res);
 
-  save_file(content, strlen(content), filename);
+  // Save content to `{host}.html`, or to a compressed file if it is kept so
+  bool inflate;
+  char *filename = encoding_file_name(host, res.encoding, &inflate);
+  content_encoding save_as = inflate ? res.encoding : ENCODING_IDENTITY;
 
-  // We're done with host, the file, and the container
-  free(host);
-  free(filename);
-  free(headers);
-  free(content);
-  free(container);
+  if (writer_enabled()) {
+    // The writer thread owns the file name from now on
+    writer_submit(filename, res.buf, res.content_offset, res.content_len,
+                  save_as);
+  } else {
+    encoding_save(filename, buf + res.content_offset, res.content_len,
+                  save_as);
+
+    // We're done with the file
+    free(filename);
+  }
+
+  return res;
+}
 
-  // Return the temporary pointer and let the caller handle it
-  return buf_copy;
+// Select the address family used for remotes, once at startup. For debugging
+// purposes, IPv4 websites can be used by setting `USE_IPV4`.
+void set_ip_family(bool ipv4) {
+  AF_FAMILY = ipv4 ? AF_INET : AF_INET6;
+  IPV4 = ipv4;
 }
 
-// Get the addrinfo for a given hostname and service name
-struct addrinfo *get_ip_addrinfo(const char *name, const char *service) {
-  struct addrinfo hints, *res;
+// Get the addrinfo for a given hostname and service name, which has to be
+// released with `free_ip_addrinfo`. Results are cached by `dns_resolve`.
+//
+// A lookup the cache cannot answer runs on a thread of its own, and is given
+// up at `deadline`, a time from `monotonic_ms`, returning NULL with errno set
+// to ETIMEDOUT.
+struct addrinfo *get_ip_addrinfo(const char *name, const char *service,
+                                 uint64_t deadline) {
   int status;
+  uint64_t start = metrics_now();
+  struct addrinfo *res;
+
+  // Only a lookup that ran out of time sets errno
+  errno = 0;
+  if (!dns_cached(name, service, AF_FAMILY, &res, &status)) {
+    resolution *l = resolver_start(name, service, AF_FAMILY, -1);
+    bool done = resolver_wait(l, deadline);
+    if (done) {
+      res = resolver_take(l, &status);
+    }
+    resolver_release(l);
 
-  memset(&hints, 0, sizeof hints); // zero-init the struct
-  hints.ai_family = AF_FAMILY;     // we only want IPv6
-  hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
-  hints.ai_flags = 0;
+    if (!done) {
+      errno = ETIMEDOUT;
+      return NULL;
+    }
+  }
+  metrics_observe(PHASE_DNS, start);
 
-  // This may leak due to a bug in glibc and the way the DNS resolver is called,
-  // but is not an error
-  if ((status = getaddrinfo(name, "http", &hints, &res)) != 0) {
+  if (res == NULL) {
     error("getaddrinfo error: %s\n", gai_strerror(status));
-    freeaddrinfo(res);
     return NULL;
   }
 
@@ -1,3 +1,19 @@
-char *client(int);
-struct addrinfo *get_ip_addrinfo(const char *, const char *);
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared.h"
+
+extern int AF_FAMILY;
+extern bool IPV4;
+extern const char HTTP_REQUEST[];
+extern const char HTTP_SERVICE[];
+
+http_response client(int);
+uint64_t request_deadline(void);
+char *deadline_error(const char *);
+int connect_to_host(const char *, uint64_t, char **);
+http_response handle_http_response(const char *, char *, size_t);
+void set_ip_family(bool);
+struct addrinfo *get_ip_addrinfo(const char *, const char *, uint64_t);
 char *get_ip_addrstr(struct addrinfo *);
@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <strings.h>
+
+#include "client.h"
+#include "config.h"
+#include "destinations.h"
+#include "shared.h"
+
+// How long a reload sleeps between checks for readers of the old snapshot
+#define GRACE_POLL_NS (1000 * 1000)
+// Longest line of the config file
+#define CONFIG_LINE_MAX 512
+
+// Path of the config file, if any
+static char *CONFIG_FILE = NULL;
+// Options from the environment, which the config file overrides
+static bool ENV_ALL_COMMANDS = false, ENV_LOCALHOST = false;
+
+// Snapshot read by new requests
+static _Atomic(config *) current = NULL;
+// Readers of the snapshots, counted in one of two counters by the parity of
+// the epoch they started in. A reload moves new readers to the other counter
+// and waits for the old one to drain, so no reader can still hold the
+// replaced snapshot when it is freed.
+static atomic_uint epoch = 0;
+static atomic_uint readers[2];
+// Only one reload runs at a time
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+// Next destination id, given out under `reload_lock`
+static uint64_t next_id = 1;
+
+static config *config_load(const config *);
+static char *copy_string(const char *);
+static bool parse_bool(const char *, bool *);
+static void wait_for_readers(void);
+static void config_free(config *);
+
+// Load the configuration at startup, exiting if it is invalid. Options come
+// from the file named by the env var CONFIG_FILE, which falls back on the env
+// vars ALL_COMMANDS, LOCALHOST and USE_IPV4 and the built-in destinations.
+//
+// Unlike the other options, the address family is only read here, since
+// changing it would mix addresses of both families in the caches.
+void config_init(void) {
+  if (getenv("CONFIG_FILE") != NULL) {
+    CONFIG_FILE = getenv("CONFIG_FILE");
+  }
+  ENV_ALL_COMMANDS = getenv("ALL_COMMANDS") != NULL;
+  ENV_LOCALHOST = getenv("LOCALHOST") != NULL;
+  set_ip_family(getenv("USE_IPV4") != NULL);
+
+  config *cfg = config_load(NULL);
+  if (cfg == NULL) {
+    exit(1);
+  }
+
+  atomic_store(&current, cfg);
+}
+
+// Load the config file again and publish the result, unless it is invalid.
+// Readers are never blocked: requests that started before keep the previous
+// snapshot, which is freed once the last of them is done with it.
+//
+// Returns whether the new configuration is in use.
+bool config_reload(void) {
+  pthread_mutex_lock(&reload_lock);
+
+  config *old = atomic_load(&current);
+  config *cfg = config_load(old);
+  if (cfg == NULL) {
+    pthread_mutex_unlock(&reload_lock);
+    error("Keeping the previous configuration");
+    return false;
+  }
+
+  atomic_store(&current, cfg);
+  wait_for_readers();
+  config_free(old);
+
+  pthread_mutex_unlock(&reload_lock);
+
+  info("Reloaded the configuration, %zu destinations", cfg->dest_count);
+  return true;
+}
+
+// Get the current snapshot, which stays valid until `config_release` is
+// called with the same `guard`. Never blocks.
+const config *config_acquire(config_guard *guard) {
+  while (true) {
+    unsigned e = atomic_load(&epoch);
+    atomic_fetch_add(&readers[e & 1], 1);
+
+    // A reload moved to the next epoch in between, and may not have seen this
+    // reader. Count it in the new epoch instead.
+    if (atomic_load(&epoch) == e) {
+      guard->epoch = e;
+      return atomic_load(&current);
+    }
+
+    atomic_fetch_sub(&readers[e & 1], 1);
+  }
+}
+
+// Stop using the snapshot returned by `config_acquire`
+void config_release(config_guard *guard) {
+  atomic_fetch_sub(&readers[guard->epoch & 1], 1);
+}
+
+// Get a copy of the host name of destination `dest`, which has to be freed,
+// and its id in `id`. Returns NULL if there is no such destination.
+char *config_destination(int dest, uint64_t *id) {
+  config_guard guard;
+  const config *cfg = config_acquire(&guard);
+
+  char *host = NULL;
+  if (dest >= 0 && (size_t)dest < cfg->dest_count) {
+    host = copy_string(cfg->dests[dest].host);
+    *id = cfg->dests[dest].id;
+  }
+
+  config_release(&guard);
+  return host;
+}
+
+// Build a snapshot from the defaults and the config file. Destinations that
+// kept their host since `old` keep their id. Returns NULL, after logging why,
+// if the file cannot be read or is invalid.
+//
+// The file has one option per line, as a name and a value separated by
+// spaces, and lines starting with `#` are ignored:
+//
+//   destination <host>       (repeated, in command order, replaces the
+//                             built-in list)
+//   assigned_command <0-99>
+//   all_commands yes|no
+//   localhost yes|no
+static config *config_load(const config *old) {
+  config *cfg = malloc_s(sizeof(config));
+  memset(cfg, 0, sizeof(config));
+  cfg->assigned_command = DEFAULT_ASSIGNED_COMMAND;
+  cfg->all_commands = ENV_ALL_COMMANDS;
+  cfg->localhost = ENV_LOCALHOST;
+
+  FILE *f = NULL;
+  if (CONFIG_FILE) {
+    f = fopen(CONFIG_FILE, "r");
+    if (f == NULL) {
+      perrno("Could not open config file %s", CONFIG_FILE);
+      free(cfg);
+      return NULL;
+    }
+  }
+
+  char line[CONFIG_LINE_MAX];
+  bool ok = true;
+  for (size_t n = 1; f && ok && fgets(line, sizeof(line), f); n++) {
+    char name[64], value[CONFIG_LINE_MAX];
+    int fields = sscanf(line, " %63s %511s", name, value);
+
+    if (fields <= 0 || name[0] == '#') {
+      continue;
+    }
+
+    if (fields == 1) {
+      ok = false;
+    } else if (strcmp(name, "destination") == 0) {
+      if (cfg->dest_count == DEST_LIMIT) {
+        error("%s:%zu: more than %d destinations", CONFIG_FILE, n, DEST_LIMIT);
+        ok = false;
+        break;
+      }
+      cfg->dests[cfg->dest_count++].host = copy_string(value);
+    } else if (strcmp(name, "assigned_command") == 0) {
+      char *end;
+      long cmd = strtol(value, &end, 10);
+      ok = *end == '\0' && cmd >= 0 && cmd < DEST_LIMIT;
+      cfg->assigned_command = cmd;
+    } else if (strcmp(name, "all_commands") == 0) {
+      ok = parse_bool(value, &cfg->all_commands);
+    } else if (strcmp(name, "localhost") == 0) {
+      ok = parse_bool(value, &cfg->localhost);
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      error("%s:%zu: invalid option %s", CONFIG_FILE, n, name);
+    }
+  }
+
+  if (f) {
+    fclose(f);
+  }
+
+  // Without destinations in the file, the built-in ones are used
+  if (ok && cfg->dest_count == 0) {
+    for (size_t i = 0; i < DEFAULT_DEST_COUNT; i++) {
+      cfg->dests[i].host = copy_string(default_destinations[i]);
+    }
+    cfg->dest_count = DEFAULT_DEST_COUNT;
+  }
+
+  if (!ok) {
+    config_free(cfg);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < cfg->dest_count; i++) {
+    bool same = old && i < old->dest_count &&
+                strcmp(old->dests[i].host, cfg->dests[i].host) == 0;
+    cfg->dests[i].id = same ? old->dests[i].id : next_id++;
+  }
+
+  return cfg;
+}
+
+// Copy a string, including its null terminator
+static char *copy_string(const char *s) {
+  char *copy = malloc_s(strlen(s) + 1);
+  strcpy(copy, s);
+  return copy;
+}
+
+// Parse yes/no, true/false or 1/0 into `result`. Returns false if `value` is
+// none of those.
+static bool parse_bool(const char *value, bool *result) {
+  if (strcasecmp(value, "yes") == 0 || strcasecmp(value, "true") == 0 ||
+      strcmp(value, "1") == 0) {
+    *result = true;
+    return true;
+  }
+  if (strcasecmp(value, "no") == 0 || strcasecmp(value, "false") == 0 ||
+      strcmp(value, "0") == 0) {
+    *result = false;
+    return true;
+  }
+
+  return false;
+}
+
+// Wait until no reader can hold a snapshot published before the last one.
+// New readers are counted in the next epoch, so only the current readers are
+// waited for.
+static void wait_for_readers(void) {
+  unsigned e = atomic_fetch_add(&epoch, 1);
+  struct timespec poll = {0, GRACE_POLL_NS};
+
+  while (atomic_load(&readers[e & 1]) > 0) {
+    nanosleep(&poll, NULL);
+  }
+}
+
+// Free a snapshot and its host names
+static void config_free(config *cfg) {
+  for (size_t i = 0; i < cfg->dest_count; i++) {
+    free(cfg->dests[i].host);
+  }
+  free(cfg);
+}
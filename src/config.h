@@ -0,0 +1,43 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Commands carry two digits, so there can be no more destinations than this
+#define DEST_LIMIT 100
+// The command this server was assigned
+#define DEFAULT_ASSIGNED_COMMAND 4
+
+typedef struct {
+  char *host;
+  // Changes whenever a reload gives the index to another host, so responses
+  // and connections of the previous host are never used for the new one
+  uint64_t id;
+} destination;
+
+// Options that can change while the server runs. A snapshot is never modified
+// once published; a reload publishes a new one.
+typedef struct {
+  destination dests[DEST_LIMIT];
+  size_t dest_count;
+  // The only command answered unless `all_commands`
+  int assigned_command;
+  bool all_commands;
+  // Whether the assigned command requests localhost instead
+  bool localhost;
+} config;
+
+// Marks a reader of a snapshot, from `config_acquire` to `config_release`
+typedef struct {
+  unsigned epoch;
+} config_guard;
+
+void config_init(void);
+bool config_reload(void);
+const config *config_acquire(config_guard *);
+void config_release(config_guard *);
+char *config_destination(int, uint64_t *);
+
+#endif
@@ -0,0 +1,201 @@
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "conn_pool.h"
+#include "config.h"
+#include "shared.h"
+
+// Seconds to wait for a connection when a host is at its limit
+#define ACQUIRE_TIMEOUT 5
+
+// A connection waiting for its next request
+typedef struct idle_conn {
+  int fd;
+  // Monotonic time at which the connection was released
+  time_t idle_since;
+  struct idle_conn *next;
+} idle_conn;
+
+// Connections to one destination
+typedef struct {
+  pthread_mutex_t lock;
+  // Signalled when a connection is released
+  pthread_cond_t released;
+  // Idle connections, the most recently used first
+  idle_conn *idle;
+  // Number of open connections, idle or in use
+  size_t open;
+  // Destination id the idle connections are to
+  uint64_t id;
+} host_pool;
+
+static bool KEEPALIVE = false;
+static size_t KEEPALIVE_MAX_PER_HOST = 8;
+static time_t KEEPALIVE_IDLE_TIMEOUT = 30;
+static host_pool pools[DEST_LIMIT];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void conn_pool_init(void);
+static void evict_idle(host_pool *);
+static void close_idle(host_pool *);
+static bool is_healthy(int);
+
+// Whether upstream connections are kept open between requests, which is
+// enabled by the env var KEEPALIVE=1
+bool conn_pool_enabled(void) {
+  pthread_once(&pool_once, conn_pool_init);
+  return KEEPALIVE;
+}
+
+// Get a connection to destination `dest`, whose id is `id`. Idle connections
+// that timed out, that the remote closed, or that are to the host a reload
+// replaced are dropped on the way.
+//
+// Returns 1 with a warm connection in `fd`, or 0 if the caller has to open a
+// new connection, which counts towards the limit of the host right away.
+// Returns -1 if the host stayed at its limit for too long.
+int conn_pool_acquire(int dest, uint64_t id, int *fd) {
+  pthread_once(&pool_once, conn_pool_init);
+  host_pool *pool = &pools[dest];
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ACQUIRE_TIMEOUT;
+
+  pthread_mutex_lock(&pool->lock);
+
+  // The destination now names another host. Ids only grow, so a request that
+  // started before the reload gets a new connection instead of switching back.
+  if (id > pool->id) {
+    close_idle(pool);
+    pool->id = id;
+  }
+
+  while (true) {
+    evict_idle(pool);
+
+    while (pool->idle && id == pool->id) {
+      idle_conn *conn = pool->idle;
+      pool->idle = conn->next;
+
+      int conn_fd = conn->fd;
+      free(conn);
+
+      if (is_healthy(conn_fd)) {
+        pthread_mutex_unlock(&pool->lock);
+        debug("Reusing connection %d to destination %d", conn_fd, dest);
+        *fd = conn_fd;
+        return 1;
+      }
+
+      debug("Dropping closed connection %d to destination %d", conn_fd, dest);
+      check(close(conn_fd), "close");
+      pool->open--;
+    }
+
+    if (pool->open < KEEPALIVE_MAX_PER_HOST) {
+      pool->open++;
+      pthread_mutex_unlock(&pool->lock);
+      return 0;
+    }
+
+    // Wait for another request to release a connection
+    if (pthread_cond_timedwait(&pool->released, &pool->lock, &deadline) ==
+        ETIMEDOUT) {
+      pthread_mutex_unlock(&pool->lock);
+      error("Too many connections to destination %d", dest);
+      return -1;
+    }
+  }
+}
+
+// Give back a connection obtained through `conn_pool_acquire`. It is kept for
+// the next request if `reusable`, and closed otherwise. An `fd` of -1 gives
+// back the slot of a connection that could not be opened. Connections to a
+// host that was replaced since they were acquired are closed.
+void conn_pool_release(int dest, uint64_t id, int fd, bool reusable) {
+  host_pool *pool = &pools[dest];
+
+  pthread_mutex_lock(&pool->lock);
+
+  if (fd >= 0 && reusable && id == pool->id) {
+    idle_conn *conn = malloc_s(sizeof(idle_conn));
+    conn->fd = fd;
+    conn->idle_since = monotonic_time();
+    conn->next = pool->idle;
+    pool->idle = conn;
+  } else {
+    if (fd >= 0) {
+      check(close(fd), "close");
+    }
+    pool->open--;
+  }
+
+  pthread_cond_signal(&pool->released);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Read the configuration from the environment
+static void conn_pool_init(void) {
+  KEEPALIVE = getenv("KEEPALIVE") != NULL;
+
+  if (getenv("KEEPALIVE_MAX_PER_HOST") != NULL &&
+      atoi(getenv("KEEPALIVE_MAX_PER_HOST")) > 0) {
+    KEEPALIVE_MAX_PER_HOST = atoi(getenv("KEEPALIVE_MAX_PER_HOST"));
+  }
+  if (getenv("KEEPALIVE_IDLE_TIMEOUT") != NULL) {
+    KEEPALIVE_IDLE_TIMEOUT = atoi(getenv("KEEPALIVE_IDLE_TIMEOUT"));
+  }
+
+  for (size_t i = 0; i < DEST_LIMIT; i++) {
+    pthread_mutex_init(&pools[i].lock, NULL);
+    pthread_cond_init(&pools[i].released, NULL);
+    pools[i].idle = NULL;
+    pools[i].open = 0;
+    pools[i].id = 0;
+  }
+}
+
+// Close the connections that were idle for longer than the timeout. The lock
+// must be held.
+static void evict_idle(host_pool *pool) {
+  time_t now = monotonic_time();
+
+  for (idle_conn **p = &pool->idle; *p;) {
+    idle_conn *conn = *p;
+
+    if (now - conn->idle_since < KEEPALIVE_IDLE_TIMEOUT) {
+      p = &conn->next;
+      continue;
+    }
+
+    debug("Evicting idle connection %d", conn->fd);
+    check(close(conn->fd), "close");
+    pool->open--;
+
+    *p = conn->next;
+    free(conn);
+  }
+}
+
+// Close every idle connection. The lock must be held.
+static void close_idle(host_pool *pool) {
+  while (pool->idle) {
+    idle_conn *conn = pool->idle;
+    pool->idle = conn->next;
+
+    check(close(conn->fd), "close");
+    pool->open--;
+    free(conn);
+  }
+}
+
+// Check that an idle connection is still usable: the remote must not have
+// closed it nor sent anything, since no request is pending on it
+static bool is_healthy(int fd) {
+  char c;
+  long bytes_rx = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  return bytes_rx < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
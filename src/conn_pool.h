@@ -0,0 +1,11 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool conn_pool_enabled(void);
+int conn_pool_acquire(int, uint64_t, int *);
+void conn_pool_release(int, uint64_t, int, bool);
+
+#endif
@@ -2,25 +2,27 @@
 
 // Standard hostnames provided in the project overview file, with the addition
 // of localhost at index 0
-const char *destinations[DEST_MAX + 1] = {"localhost",
-                                          "www.bbc.co.uk",
-                                          "www.speedtest6.com",
-                                          "www.yahoo.com",
-                                          "he.net",
-                                          "www.youtube.com",
-                                          "axu.tm",
-                                          "www.google.com",
-                                          "www.ietf.org",
-                                          "www.viagenie.ca",
-                                          "www.facebook.com",
-                                          "www.gmail.com",
-                                          "cloudflare.com",
-                                          "ipv6-test.com",
-                                          "tum.de",
-                                          "www.itu.int",
-                                          "ipv6now.com.au",
-                                          "www.nanog.org",
-                                          "www.netflix.com",
-                                          "www.instagram.com",
-                                          "www.wikipedia.org",
-                                          "www.yandex.ru"};
+const char *default_destinations[DEFAULT_DEST_COUNT] = {
+    "localhost",
+    "www.bbc.co.uk",
+    "www.speedtest6.com",
+    "www.yahoo.com",
+    "he.net",
+    "www.youtube.com",
+    "axu.tm",
+    "www.google.com",
+    "www.ietf.org",
+    "www.viagenie.ca",
+    "www.facebook.com",
+    "www.gmail.com",
+    "cloudflare.com",
+    "ipv6-test.com",
+    "tum.de",
+    "www.itu.int",
+    "ipv6now.com.au",
+    "www.nanog.org",
+    "www.netflix.com",
+    "www.instagram.com",
+    "www.wikipedia.org",
+    "www.yandex.ru",
+};
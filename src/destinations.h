@@ -1,4 +1,4 @@
-// using const int does not work
-#define DEST_MAX 21
+// Number of built-in destinations, used when the config file has none
+#define DEFAULT_DEST_COUNT 22
 
-extern const char *destinations[DEST_MAX + 1];
+extern const char *default_destinations[DEFAULT_DEST_COUNT];
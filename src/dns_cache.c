@@ -0,0 +1,348 @@
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "dns_cache.h"
+#include "shared.h"
+
+// Number of hash buckets; the destinations are few, so chains stay short
+#define DNS_BUCKETS 64
+// How often the background thread looks for entries about to expire, in
+// seconds
+#define DNS_REFRESH_INTERVAL 1
+
+// What a result is resolved for
+typedef struct {
+  char *host;
+  char *service;
+  int family;
+} dns_key;
+
+// Result of resolving a (host, service, family) key
+typedef struct dns_entry {
+  char *host;
+  char *service;
+  int family;
+  // Copy of the resolved addresses, or NULL if resolving failed
+  struct addrinfo *res;
+  // getaddrinfo status, non-zero for negative entries
+  int status;
+  // Monotonic time after which the entry must be resolved again
+  time_t expires;
+  // Monotonic time of the last lookup, only entries in use are refreshed.
+  // Lookups only hold the read lock, so it is updated atomically.
+  atomic_long last_used;
+  struct dns_entry *next;
+} dns_entry;
+
+dns_cache_stats DNS_STATS;
+
+// Seconds positive and negative results are kept; a TTL of 0 disables caching
+static time_t DNS_TTL = 60, DNS_NEGATIVE_TTL = 5;
+static dns_entry *buckets[DNS_BUCKETS];
+static pthread_rwlock_t dns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t dns_once = PTHREAD_ONCE_INIT;
+
+static void dns_cache_init(void);
+static void *dns_refresher(void *);
+static dns_entry *find_entry(const char *, const char *, int);
+static void store_entry(const char *, const char *, int, struct addrinfo *,
+                        int, time_t);
+static struct addrinfo *copy_addrinfo(const struct addrinfo *);
+static unsigned long hash_key(const char *, int);
+
+// Resolve `host` for `service` in address family `family`, from the cache if
+// a fresh result is known. Failures are cached too, for a shorter time.
+//
+// Returns a copy of the addresses that the caller has to release with
+// `free_ip_addrinfo`, or NULL with the getaddrinfo error in `status`.
+struct addrinfo *dns_resolve(const char *host, const char *service, int family,
+                             int *status) {
+  struct addrinfo hints, *res = NULL;
+
+  if (dns_cached(host, service, family, &res, status)) {
+    return res;
+  }
+  if (DNS_TTL > 0) {
+    atomic_fetch_add_explicit(&DNS_STATS.misses, 1, memory_order_relaxed);
+  }
+
+  memset(&hints, 0, sizeof hints); // zero-init the struct
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
+  hints.ai_flags = 0;
+
+  // This may leak due to a bug in glibc and the way the DNS resolver is called,
+  // but is not an error
+  *status = getaddrinfo(host, service, &hints, &res);
+
+  struct addrinfo *copy = *status == 0 ? copy_addrinfo(res) : NULL;
+  if (*status == 0) {
+    freeaddrinfo(res);
+  }
+
+  // The cache keeps its own copy, the caller releases the returned one
+  if (DNS_TTL > 0) {
+    store_entry(host, service, family, copy_addrinfo(copy), *status,
+                *status == 0 ? DNS_TTL : DNS_NEGATIVE_TTL);
+  }
+
+  debug("DNS cache: %lu hits, %lu negative hits, %lu misses",
+        atomic_load(&DNS_STATS.hits), atomic_load(&DNS_STATS.negative_hits),
+        atomic_load(&DNS_STATS.misses));
+
+  return copy;
+}
+
+// Look up `host` in the cache only, never resolving it. Returns whether the
+// cache had a fresh answer, in which case `res` and `status` are set as
+// `dns_resolve` would return them.
+bool dns_cached(const char *host, const char *service, int family,
+                struct addrinfo **res, int *status) {
+  pthread_once(&dns_once, dns_cache_init);
+
+  if (DNS_TTL == 0) {
+    return false;
+  }
+
+  pthread_rwlock_rdlock(&dns_lock);
+
+  dns_entry *entry = find_entry(host, service, family);
+  bool fresh = entry && entry->expires > monotonic_time();
+  if (fresh) {
+    atomic_store_explicit(&entry->last_used, monotonic_time(),
+                          memory_order_relaxed);
+
+    *res = NULL;
+    if (entry->res) {
+      atomic_fetch_add_explicit(&DNS_STATS.hits, 1, memory_order_relaxed);
+      *res = copy_addrinfo(entry->res);
+    } else {
+      atomic_fetch_add_explicit(&DNS_STATS.negative_hits, 1,
+                                memory_order_relaxed);
+    }
+    *status = entry->status;
+  }
+
+  pthread_rwlock_unlock(&dns_lock);
+
+  if (fresh) {
+    debug("DNS cache hit for %s", host);
+  }
+  return fresh;
+}
+
+// Release addresses returned by `dns_resolve`
+void free_ip_addrinfo(struct addrinfo *res) { free(res); }
+
+// Collect the fresh positive results into `items`, for a snapshot. Returns
+// how many there are. The caller has to free the keys and release the
+// addresses with `free_ip_addrinfo`, then free `items`.
+size_t dns_export(dns_item **items) {
+  pthread_once(&dns_once, dns_cache_init);
+
+  pthread_rwlock_rdlock(&dns_lock);
+
+  size_t count = 0;
+  for (size_t i = 0; i < DNS_BUCKETS; i++) {
+    for (dns_entry *e = buckets[i]; e; e = e->next) {
+      count++;
+    }
+  }
+
+  *items = malloc_s((count + 1) * sizeof(dns_item));
+  size_t n = 0;
+  time_t now = monotonic_time();
+  for (size_t i = 0; i < DNS_BUCKETS; i++) {
+    for (dns_entry *e = buckets[i]; e; e = e->next) {
+      if (e->res && e->expires > now) {
+        (*items)[n++] = (dns_item){strdup(e->host), strdup(e->service),
+                                   e->family, copy_addrinfo(e->res),
+                                   e->expires - now};
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&dns_lock);
+  return n;
+}
+
+// Cache addresses `res` of `host` for `service` in `family` for `ttl`
+// seconds, as when loading a snapshot. They are copied.
+void dns_import(const char *host, const char *service, int family,
+                const struct addrinfo *res, long ttl) {
+  pthread_once(&dns_once, dns_cache_init);
+
+  if (DNS_TTL <= 0 || ttl <= 0) {
+    return;
+  }
+
+  store_entry(host, service, family, copy_addrinfo(res), 0,
+              ttl < DNS_TTL ? ttl : DNS_TTL);
+}
+
+// Read the TTLs from the environment and start the refresher
+static void dns_cache_init(void) {
+  if (getenv("DNS_TTL") != NULL) {
+    DNS_TTL = atoi(getenv("DNS_TTL"));
+  }
+  if (getenv("DNS_NEGATIVE_TTL") != NULL) {
+    DNS_NEGATIVE_TTL = atoi(getenv("DNS_NEGATIVE_TTL"));
+  }
+
+  if (DNS_TTL <= 0) {
+    debug("DNS cache disabled");
+    return;
+  }
+
+  pthread_t t;
+  if (pthread_create(&t, NULL, dns_refresher, NULL) != 0) {
+    error("Could not start the DNS refresher");
+    return;
+  }
+  pthread_detach(t);
+}
+
+// Resolve again the entries in use that are about to expire, so lookups keep
+// hitting the cache instead of waiting for the resolver
+static void *dns_refresher(void *arg) {
+  // Refresh during the last fifth of the TTL
+  time_t window = DNS_TTL / 5 > DNS_REFRESH_INTERVAL ? DNS_TTL / 5
+                                                     : DNS_REFRESH_INTERVAL;
+
+  while (true) {
+    sleep(DNS_REFRESH_INTERVAL);
+
+    for (size_t i = 0; i < DNS_BUCKETS; i++) {
+      // Collect the keys to refresh, then resolve without holding the lock
+      pthread_rwlock_rdlock(&dns_lock);
+      size_t count = 0;
+      for (dns_entry *e = buckets[i]; e; e = e->next) {
+        count++;
+      }
+
+      dns_key *due = malloc_s((count + 1) * sizeof(dns_key));
+      size_t n = 0;
+      time_t t = monotonic_time();
+      for (dns_entry *e = buckets[i]; e; e = e->next) {
+        if (e->res && e->expires - t <= window &&
+            t - atomic_load(&e->last_used) < DNS_TTL) {
+          due[n].host = strdup(e->host);
+          due[n].service = strdup(e->service);
+          due[n].family = e->family;
+          n++;
+        }
+      }
+      pthread_rwlock_unlock(&dns_lock);
+
+      for (size_t j = 0; j < n; j++) {
+        struct addrinfo hints, *res = NULL;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = due[j].family;
+        hints.ai_socktype = SOCK_STREAM;
+
+        // Keep serving the old result if the refresh fails, it is resolved
+        // again on the first lookup after it expires
+        if (getaddrinfo(due[j].host, due[j].service, &hints, &res) == 0) {
+          store_entry(due[j].host, due[j].service, due[j].family,
+                      copy_addrinfo(res), 0, DNS_TTL);
+          freeaddrinfo(res);
+          atomic_fetch_add_explicit(&DNS_STATS.refreshes, 1,
+                                    memory_order_relaxed);
+          debug("Refreshed DNS entry for %s", due[j].host);
+        }
+
+        free(due[j].host);
+        free(due[j].service);
+      }
+
+      free(due);
+    }
+  }
+
+  return NULL;
+}
+
+// Find the entry of a key. The lock must be held.
+static dns_entry *find_entry(const char *host, const char *service,
+                             int family) {
+  for (dns_entry *e = buckets[hash_key(host, family) % DNS_BUCKETS]; e;
+       e = e->next) {
+    if (e->family == family && strcmp(e->host, host) == 0 &&
+        strcmp(e->service, service) == 0) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+// Insert or replace the result of a key for `ttl` seconds, taking ownership
+// of `res`
+static void store_entry(const char *host, const char *service, int family,
+                        struct addrinfo *res, int status, time_t ttl) {
+  pthread_rwlock_wrlock(&dns_lock);
+
+  dns_entry *entry = find_entry(host, service, family);
+  if (entry == NULL) {
+    entry = malloc_s(sizeof(dns_entry));
+    entry->host = strdup(host);
+    entry->service = strdup(service);
+    entry->family = family;
+    entry->res = NULL;
+
+    unsigned long bucket = hash_key(host, family) % DNS_BUCKETS;
+    entry->next = buckets[bucket];
+    buckets[bucket] = entry;
+  }
+
+  free_ip_addrinfo(entry->res);
+  entry->res = res;
+  entry->status = status;
+  entry->expires = monotonic_time() + ttl;
+  atomic_store(&entry->last_used, monotonic_time());
+
+  pthread_rwlock_unlock(&dns_lock);
+}
+
+// Copy a list of addresses into a single allocation, which is released by
+// freeing the first element
+static struct addrinfo *copy_addrinfo(const struct addrinfo *res) {
+  size_t count = 0;
+  for (const struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+    count++;
+  }
+
+  if (count == 0) {
+    return NULL;
+  }
+
+  char *block = malloc_s(count * (sizeof(struct addrinfo) +
+                                  sizeof(struct sockaddr_storage)));
+  struct addrinfo *copy = (struct addrinfo *)block;
+  struct sockaddr_storage *addrs =
+      (struct sockaddr_storage *)(block + count * sizeof(struct addrinfo));
+
+  size_t i = 0;
+  for (const struct addrinfo *p = res; p != NULL; p = p->ai_next, i++) {
+    copy[i] = *p;
+    memcpy(&addrs[i], p->ai_addr, p->ai_addrlen);
+    copy[i].ai_addr = (struct sockaddr *)&addrs[i];
+    copy[i].ai_canonname = NULL;
+    copy[i].ai_next = i + 1 < count ? &copy[i + 1] : NULL;
+  }
+
+  return copy;
+}
+
+// djb2 hash of a host name and address family
+static unsigned long hash_key(const char *host, int family) {
+  unsigned long hash = 5381;
+
+  for (const char *c = host; *c; c++) {
+    hash = hash * 33 + (unsigned char)*c;
+  }
+
+  return hash * 33 + family;
+}
+
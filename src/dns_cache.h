@@ -0,0 +1,35 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Counters of the DNS cache, since the server started
+typedef struct {
+  atomic_ulong hits;
+  atomic_ulong negative_hits;
+  atomic_ulong misses;
+  atomic_ulong refreshes;
+} dns_cache_stats;
+
+// Resolved addresses of the cache, with their key and the seconds they stay
+// fresh
+typedef struct {
+  char *host;
+  char *service;
+  int family;
+  struct addrinfo *res;
+  long ttl;
+} dns_item;
+
+extern dns_cache_stats DNS_STATS;
+
+struct addrinfo *dns_resolve(const char *, const char *, int, int *);
+bool dns_cached(const char *, const char *, int, struct addrinfo **, int *);
+void free_ip_addrinfo(struct addrinfo *);
+size_t dns_export(dns_item **);
+void dns_import(const char *, const char *, int, const struct addrinfo *,
+                long);
+
+#endif
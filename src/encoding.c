@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "encoding.h"
+#include "http.h"
+#include "metrics.h"
+#include "shared.h"
+#include "store.h"
+
+// Bytes decompressed at a time, so memory use does not depend on the page
+#define INFLATE_CHUNK 16384
+// Most bytes content is decompressed to. Past that it is taken for a
+// decompression bomb and given up on, which also bounds the time spent on it.
+#define INFLATE_MAX (64 * 1024 * 1024)
+
+// Where decompressed bytes go
+typedef struct {
+  // Descriptor they are written to, or -1 to only count them
+  int fd;
+  // Bytes that may still be written, the rest is only counted
+  size_t limit;
+  size_t produced, written;
+} inflate_sink;
+
+static bool COMPRESSION = false;
+static bool SAVE_COMPRESSED = false;
+static pthread_once_t encoding_once = PTHREAD_ONCE_INIT;
+
+static void encoding_init(void);
+static content_encoding parse_encoding(const char *, size_t);
+static bool inflate_content(const char *, size_t, content_encoding,
+                            inflate_sink *);
+static bool inflate_with(const char *, size_t, int, inflate_sink *);
+static bool sink_write(inflate_sink *, const char *, size_t);
+static bool is_header(const char *, size_t, const char *);
+
+// Whether origins are asked for compressed responses, which is enabled by the
+// env var COMPRESSION=1. SAVE_COMPRESSED=1 also saves compressed pages to disk
+// as they are.
+bool encoding_enabled(void) {
+  pthread_once(&encoding_once, encoding_init);
+  return COMPRESSION;
+}
+
+// Find how the content of a response that was just received is compressed.
+// It is only decompressed once something needs it so, see `encoding_measure`.
+void encoding_prepare(http_response *res) {
+  res->encoding = parse_encoding(res->buf->data, res->headers_len);
+  res->plain_len = 0;
+}
+
+// Measure the content of the compressed response `res` once decompressed into
+// its `plain_len`, unless that was done already. Returns false if it cannot be
+// decompressed, or only to more than INFLATE_MAX bytes, in which case it has
+// to be sent as it is.
+bool encoding_measure(http_response *res) {
+  if (res->plain_len > 0) {
+    return true;
+  }
+
+  inflate_sink sink = {-1, 0, 0, 0};
+  if (!inflate_content(res->buf->data + res->content_offset, res->content_len,
+                       res->encoding, &sink)) {
+    error("Could not decompress a response, sending it as it is");
+    return false;
+  }
+
+  res->plain_len = sink.produced;
+  return true;
+}
+
+// Headers of a compressed response, measured with `encoding_measure`, as they
+// are once its content is decompressed: without Content-Encoding, and with the
+// decompressed length. Returns them allocated, up to and including the empty
+// line after them, with their length in `len`.
+char *encoding_plain_headers(const http_response *res, size_t *len) {
+  const char *data = res->buf->data;
+  const char *end = data + res->headers_len;
+  // Room for the one Content-Length and the final empty line
+  char *out = malloc_s(res->headers_len + 64);
+  size_t n = 0;
+
+  for (const char *line = data; line < end;) {
+    const char *line_end = memmem(line, end - line, "\r\n", 2);
+    if (!line_end) {
+      line_end = end;
+    }
+    size_t line_len = line_end - line;
+
+    // Every Content-Length the origin sent is replaced by a single one, right
+    // after the status line
+    if (!is_header(line, line_len, "Content-Length") &&
+        !is_header(line, line_len, "Content-Encoding")) {
+      memcpy(out + n, line, line_len);
+      memcpy(out + n + line_len, "\r\n", 2);
+      n += line_len + 2;
+    }
+    if (line == data) {
+      n += sprintf(out + n, "Content-Length: %zu\r\n", res->plain_len);
+    }
+
+    line = line_end + 2;
+  }
+
+  memcpy(out + n, "\r\n", 2);
+  *len = n + 2;
+  return out;
+}
+
+// Write the content of the compressed response `res` to `fd` decompressed,
+// one chunk at a time, stopping after `limit` bytes. Returns the number of
+// bytes written, which is less than expected if writing failed.
+size_t encoding_write_plain(int fd, const http_response *res, size_t limit) {
+  inflate_sink sink = {fd, limit, 0, 0};
+  inflate_content(res->buf->data + res->content_offset, res->content_len,
+                  res->encoding, &sink);
+
+  return sink.written;
+}
+
+// Name of the file the page of `host` is saved to, when its content is
+// compressed with `enc`. Compressed content is saved as it is with
+// SAVE_COMPRESSED=1, to `{host}.html.gz` or `{host}.html.zz`; otherwise
+// `inflate` is set, and it has to be decompressed into `{host}.html`.
+char *encoding_file_name(const char *host, content_encoding enc,
+                         bool *inflate) {
+  pthread_once(&encoding_once, encoding_init);
+
+  const char *suffix = ".html";
+  *inflate = false;
+
+  if (enc != ENCODING_IDENTITY && SAVE_COMPRESSED) {
+    suffix = enc == ENCODING_GZIP ? ".html.gz" : ".html.zz";
+  } else if (enc != ENCODING_IDENTITY) {
+    *inflate = true;
+  }
+
+  char *file_name = malloc_s(strlen(host) + strlen(suffix) + 1);
+  sprintf(file_name, "%s%s", host, suffix);
+  return file_name;
+}
+
+// Save `len` bytes of `data` to `file_name`, decompressing them first unless
+// `enc` is identity. Like `save_file`, the file is replaced at once. With
+// STORE_DIR set, the file is kept in the content-addressed store instead.
+void encoding_save(const char *file_name, const char *data, size_t len,
+                   content_encoding enc) {
+  if (store_enabled()) {
+    store_save(file_name, data, len, enc);
+    return;
+  }
+
+  if (enc == ENCODING_IDENTITY) {
+    save_file(data, len, file_name);
+    return;
+  }
+
+  char *temp_name;
+  int fd = open_temp_file(file_name, &temp_name);
+  if (fd < 0) {
+    return;
+  }
+
+  bool ok = encoding_inflate(fd, data, len, enc);
+  if (finish_temp_file(fd, temp_name, file_name, ok)) {
+    debug("Saved file to %s\n", file_name);
+  }
+}
+
+// Write `len` bytes of `data`, compressed with `enc`, decompressed to `fd`.
+// Returns whether all of it was. Pages are saved once per fetch, so this is
+// where the bytes compression kept off the wire from origins are counted.
+bool encoding_inflate(int fd, const char *data, size_t len,
+                      content_encoding enc) {
+  inflate_sink sink = {fd, SIZE_MAX, 0, 0};
+  if (!inflate_content(data, len, enc, &sink)) {
+    error("Could not decompress content to save");
+    return false;
+  }
+
+  if (sink.produced > len) {
+    metrics_count_saved(PEER_UPSTREAM, sink.produced - len);
+  }
+  return true;
+}
+
+// Read the configuration from the environment
+static void encoding_init(void) {
+  COMPRESSION = getenv("COMPRESSION") != NULL;
+  SAVE_COMPRESSED = getenv("SAVE_COMPRESSED") != NULL;
+}
+
+// Encoding named by the Content-Encoding header among `headers`. Encodings we
+// do not decompress are left to the client, like identity.
+static content_encoding parse_encoding(const char *headers, size_t len) {
+  const char *value;
+  size_t value_len;
+
+  if (!get_header(headers, len, "Content-Encoding", &value, &value_len)) {
+    return ENCODING_IDENTITY;
+  }
+  if ((value_len == 4 && strncasecmp(value, "gzip", 4) == 0) ||
+      (value_len == 6 && strncasecmp(value, "x-gzip", 6) == 0)) {
+    return ENCODING_GZIP;
+  }
+  if (value_len == 7 && strncasecmp(value, "deflate", 7) == 0) {
+    return ENCODING_DEFLATE;
+  }
+
+  return ENCODING_IDENTITY;
+}
+
+// Decompress `len` bytes of `data` into `sink`. Returns whether the whole
+// stream was decompressed and written.
+static bool inflate_content(const char *data, size_t len,
+                            content_encoding enc, inflate_sink *sink) {
+  if (enc == ENCODING_GZIP) {
+    return inflate_with(data, len, 16 + MAX_WBITS, sink);
+  }
+
+  // deflate is meant to be wrapped in zlib's format, but some servers send
+  // the raw stream instead
+  return inflate_with(data, len, MAX_WBITS, sink) ||
+         (sink->produced == 0 && inflate_with(data, len, -MAX_WBITS, sink));
+}
+
+// Decompress with zlib, whose `window_bits` select the format
+static bool inflate_with(const char *data, size_t len, int window_bits,
+                         inflate_sink *sink) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, window_bits) != Z_OK) {
+    error("Could not start decompressing");
+    return false;
+  }
+
+  zs.next_in = (Bytef *)data;
+  zs.avail_in = len;
+
+  char out[INFLATE_CHUNK];
+  int rc;
+  do {
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = sizeof(out);
+
+    // Fails with Z_BUF_ERROR if the content ends before the stream does
+    rc = inflate(&zs, Z_NO_FLUSH);
+    if (rc != Z_OK && rc != Z_STREAM_END) {
+      break;
+    }
+    if (!sink_write(sink, out, sizeof(out) - zs.avail_out)) {
+      rc = Z_ERRNO;
+      break;
+    }
+  } while (rc != Z_STREAM_END);
+
+  inflateEnd(&zs);
+  return rc == Z_STREAM_END;
+}
+
+// Hand `n` decompressed bytes to `sink`. Returns false if writing them failed,
+// or if there are more than INFLATE_MAX in all.
+static bool sink_write(inflate_sink *sink, const char *data, size_t n) {
+  sink->produced += n;
+  if (sink->produced > INFLATE_MAX) {
+    error("Content decompresses to more than %d bytes, giving up",
+          INFLATE_MAX);
+    return false;
+  }
+
+  if (sink->fd < 0) {
+    return true;
+  }
+
+  size_t left = sink->limit - sink->written;
+  if (n > left) {
+    n = left;
+  }
+
+  while (n > 0) {
+    long bytes = write(sink->fd, data, n);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      perrno("Could not write decompressed content");
+      return false;
+    }
+
+    data += bytes;
+    n -= bytes;
+    sink->written += bytes;
+  }
+
+  return true;
+}
+
+// Whether the header line `line` of `len` bytes is header `name`
+static bool is_header(const char *line, size_t len, const char *name) {
+  size_t name_len = strlen(name);
+  return len > name_len && line[name_len] == ':' &&
+         strncasecmp(line, name, name_len) == 0;
+}
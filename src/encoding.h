@@ -0,0 +1,21 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "shared.h"
+
+// Header line added to upstream requests when compression is enabled
+#define ACCEPT_ENCODING "Accept-Encoding: gzip, deflate\r\n"
+
+bool encoding_enabled(void);
+void encoding_prepare(http_response *);
+bool encoding_measure(http_response *);
+char *encoding_plain_headers(const http_response *, size_t *);
+size_t encoding_write_plain(int, const http_response *, size_t);
+char *encoding_file_name(const char *, content_encoding, bool *);
+void encoding_save(const char *, const char *, size_t, content_encoding);
+bool encoding_inflate(int, const char *, size_t, content_encoding);
+
+#endif
@@ -0,0 +1,433 @@
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "dns_cache.h"
+#include "eyeballs.h"
+#include "metrics.h"
+#include "shared.h"
+
+// How long to wait for the AAAA answer once the A answer is in, in ms
+#define RESOLUTION_DELAY_MS 50
+// How often a race that is waiting for a lookup checks on it, in ms
+#define LOOKUP_POLL_MS 10
+// Most addresses tried, and most connection attempts in flight at once
+#define MAX_CANDIDATES 16
+// Slots of the table of which family won for a host. Hosts that share a slot
+// share their preference, which only changes the order of the attempts.
+#define PREFERENCE_SLOTS 64
+
+// Index of each family in the arrays below
+enum { V6, V4 };
+
+// The AAAA and A lookups of a host, run by a thread each while the caller
+// races the addresses that already came in, unless the DNS cache answered
+// them. Freed by the last of the caller and those threads.
+typedef struct lookup lookup;
+
+typedef struct {
+  lookup *l;
+  int family;
+  struct addrinfo *res;
+  int status;
+  bool done;
+} lookup_task;
+
+struct lookup {
+  pthread_mutex_t lock;
+  // Signalled when a task is done
+  pthread_cond_t resolved;
+  int refs;
+  char *host;
+  const char *service;
+  lookup_task tasks[2];
+};
+
+// Addresses of one family that were not tried yet
+typedef struct {
+  struct sockaddr_storage addrs[MAX_CANDIDATES];
+  socklen_t lens[MAX_CANDIDATES];
+  size_t count, next;
+  // Whether the lookup results were taken already
+  bool taken;
+} candidates;
+
+// A non-blocking connect in flight
+typedef struct {
+  int fd;
+  int family;
+} attempt;
+
+static bool HAPPY_EYEBALLS = false;
+static long HAPPY_EYEBALLS_DELAY_MS = 250;
+static pthread_once_t eyeballs_once = PTHREAD_ONCE_INIT;
+// Family that last won the race for each host
+static atomic_int preferences[PREFERENCE_SLOTS];
+
+static void eyeballs_init(void);
+static lookup *start_lookups(const char *, const char *);
+static void *resolve(void *);
+static void release_lookup(lookup *);
+static bool take_results(lookup *, int, candidates *);
+static int start_attempt(candidates *, int, attempt *);
+static atomic_int *preference(const char *);
+
+// Whether connections race the addresses of both families, which is enabled
+// by the env var HAPPY_EYEBALLS=1
+bool eyeballs_enabled(void) {
+  pthread_once(&eyeballs_once, eyeballs_init);
+  return HAPPY_EYEBALLS;
+}
+
+// Connect to `host` as in Happy Eyeballs v2 (RFC 8305): its AAAA and A
+// records are resolved in parallel, and their addresses are tried alternating
+// between the families, starting with the one that won last time for the
+// host. A new attempt starts every HAPPY_EYEBALLS_DELAY_MS milliseconds
+// (default 250), or as soon as one fails, without abandoning the earlier ones.
+// The first to connect is kept. Both the lookups and the attempts are given
+// up at `deadline`, a time from `monotonic_ms`.
+//
+// Returns a connected blocking socket, or -1 with a message for the client in
+// `error_resp`.
+int eyeballs_connect(const char *host, const char *service, uint64_t deadline,
+                     char **error_resp) {
+  pthread_once(&eyeballs_once, eyeballs_init);
+
+  uint64_t start = metrics_now();
+  lookup *l = start_lookups(host, service);
+
+  atomic_int *pref = preference(host);
+  int first = atomic_load_explicit(pref, memory_order_relaxed);
+  if (first == 0) {
+    first = IPV4 ? AF_INET : AF_INET6;
+  }
+
+  candidates cands[2];
+  cands[V6].count = cands[V6].next = 0;
+  cands[V4].count = cands[V4].next = 0;
+  cands[V6].taken = cands[V4].taken = false;
+
+  // Wait for the AAAA answer, or for the A answer and a little longer, so the
+  // preferred family gets a chance to be tried first
+  pthread_mutex_lock(&l->lock);
+  uint64_t a_done = 0;
+  while (!l->tasks[V6].done && monotonic_ms() < deadline) {
+    uint64_t until = deadline;
+    if (l->tasks[V4].done) {
+      if (a_done == 0) {
+        a_done = monotonic_ms();
+      }
+      until = a_done + RESOLUTION_DELAY_MS;
+      if (monotonic_ms() >= until) {
+        break;
+      }
+    }
+
+    struct timespec ts = {until / 1000, until % 1000 * 1000000};
+    pthread_cond_timedwait(&l->resolved, &l->lock, &ts);
+  }
+  pthread_mutex_unlock(&l->lock);
+
+  bool resolved = false;
+  attempt attempts[MAX_CANDIDATES];
+  size_t in_flight = 0;
+  uint64_t next_start = 0;
+  int last_family = first == AF_INET ? AF_INET6 : AF_INET;
+  int sockfd = -1, won = 0;
+  uint64_t connect_start = 0;
+
+  while (sockfd < 0 && monotonic_ms() < deadline) {
+    bool pending = !take_results(l, V6, &cands[V6]);
+    pending = !take_results(l, V4, &cands[V4]) || pending;
+    size_t left = cands[V6].count - cands[V6].next + cands[V4].count -
+                  cands[V4].next;
+
+    if (!resolved && left > 0) {
+      resolved = true;
+      metrics_observe(PHASE_DNS, start);
+      connect_start = metrics_now();
+    }
+
+    // Start the next attempt when its turn came, alternating families
+    if (left > 0 && in_flight < MAX_CANDIDATES &&
+        monotonic_ms() >= next_start) {
+      int family = last_family == AF_INET ? AF_INET6 : AF_INET;
+      candidates *c = &cands[family == AF_INET ? V4 : V6];
+      if (c->next == c->count) {
+        family = last_family;
+        c = &cands[family == AF_INET ? V4 : V6];
+      }
+
+      attempt *a = &attempts[in_flight];
+      int status = start_attempt(c, family, a);
+      last_family = family;
+
+      if (status > 0) {
+        sockfd = a->fd;
+        won = family;
+        break;
+      }
+      if (status == 0) {
+        in_flight++;
+        next_start = monotonic_ms() + HAPPY_EYEBALLS_DELAY_MS;
+      }
+      continue;
+    }
+
+    if (in_flight == 0 && left == 0 && !pending) {
+      break;
+    }
+
+    // Sleep until an attempt completes, the next one is due, a lookup may
+    // have finished, or time is up. With every slot taken no attempt can
+    // start, so only the sockets in flight matter
+    uint64_t t = monotonic_ms();
+    uint64_t wake = deadline;
+    if (left > 0 && in_flight < MAX_CANDIDATES && next_start < wake) {
+      wake = next_start;
+    }
+    if (pending && t + LOOKUP_POLL_MS < wake) {
+      wake = t + LOOKUP_POLL_MS;
+    }
+
+    struct pollfd fds[MAX_CANDIDATES];
+    for (size_t i = 0; i < in_flight; i++) {
+      fds[i].fd = attempts[i].fd;
+      fds[i].events = POLLOUT;
+      fds[i].revents = 0;
+    }
+
+    if (poll(fds, in_flight, wake > t ? wake - t : 0) < 0 && errno != EINTR) {
+      perrno("poll");
+      break;
+    }
+
+    for (size_t i = 0; i < in_flight && sockfd < 0;) {
+      if (fds[i].revents == 0) {
+        i++;
+        continue;
+      }
+
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+      if (err == 0) {
+        sockfd = attempts[i].fd;
+        won = attempts[i].family;
+        attempts[i] = attempts[--in_flight];
+        break;
+      }
+
+      // This one failed, the next address need not wait its turn
+      debug("Connection attempt to %s failed: %s", host, strerror(err));
+      check(close(attempts[i].fd), "close");
+      attempts[i] = attempts[--in_flight];
+      fds[i] = fds[in_flight];
+      next_start = 0;
+    }
+  }
+
+  // The losers are abandoned
+  for (size_t i = 0; i < in_flight; i++) {
+    check(close(attempts[i].fd), "close");
+  }
+  release_lookup(l);
+
+  if (sockfd < 0 && monotonic_ms() >= deadline) {
+    *error_resp = deadline_error(host);
+    return -1;
+  }
+
+  if (!resolved) {
+    *error_resp = make_error_message("Could not find IP address for %s!\n",
+                                     host);
+    error("%s", *error_resp);
+    metrics_count_error(ERR_DNS);
+    return -1;
+  }
+
+  if (sockfd < 0) {
+    *error_resp = make_error_message("Could not connect to %s!\n", host);
+    error("%s", *error_resp);
+    metrics_count_error(ERR_CONNECT);
+    return -1;
+  }
+
+  metrics_observe(PHASE_CONNECT, connect_start);
+  debug("Connected to %s over IPv%d", host, won == AF_INET ? 4 : 6);
+  atomic_store_explicit(pref, won, memory_order_relaxed);
+
+  // The rest of the request blocks
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+
+  return sockfd;
+}
+
+// Read the configuration from the environment
+static void eyeballs_init(void) {
+  HAPPY_EYEBALLS = getenv("HAPPY_EYEBALLS") != NULL;
+
+  if (getenv("HAPPY_EYEBALLS_DELAY_MS") != NULL) {
+    HAPPY_EYEBALLS_DELAY_MS = atol(getenv("HAPPY_EYEBALLS_DELAY_MS"));
+  }
+}
+
+// Start resolving the AAAA and A records of `host`, each on a thread of its
+// own unless the DNS cache has it already
+static lookup *start_lookups(const char *host, const char *service) {
+  lookup *l = malloc_s(sizeof(lookup));
+  pthread_mutex_init(&l->lock, NULL);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&l->resolved, &attr);
+  pthread_condattr_destroy(&attr);
+
+  l->host = malloc_s(strlen(host) + 1);
+  strcpy(l->host, host);
+  l->service = service;
+
+  // The caller and the thread of each family the cache does not have, which
+  // are counted before any of them starts
+  l->refs = 1;
+  int families[2] = {[V6] = AF_INET6, [V4] = AF_INET};
+  for (int i = 0; i < 2; i++) {
+    lookup_task *task = &l->tasks[i];
+    task->l = l;
+    task->family = families[i];
+    task->res = NULL;
+    task->done =
+        dns_cached(host, service, task->family, &task->res, &task->status);
+    if (!task->done) {
+      l->refs++;
+    }
+  }
+
+  for (int i = 0; i < 2; i++) {
+    lookup_task *task = &l->tasks[i];
+    if (task->done) {
+      continue;
+    }
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, resolve, task) != 0) {
+      // Resolve it here instead
+      resolve(task);
+      continue;
+    }
+    pthread_detach(t);
+  }
+
+  return l;
+}
+
+// Resolve one family of a lookup
+static void *resolve(void *arg) {
+  lookup_task *task = arg;
+  lookup *l = task->l;
+
+  int status;
+  struct addrinfo *res =
+      dns_resolve(l->host, l->service, task->family, &status);
+
+  pthread_mutex_lock(&l->lock);
+  task->res = res;
+  task->status = status;
+  task->done = true;
+  pthread_cond_broadcast(&l->resolved);
+  pthread_mutex_unlock(&l->lock);
+
+  release_lookup(l);
+  return NULL;
+}
+
+// Drop a reference to a lookup, freeing it with the last one
+static void release_lookup(lookup *l) {
+  pthread_mutex_lock(&l->lock);
+  bool last = --l->refs == 0;
+  pthread_mutex_unlock(&l->lock);
+
+  if (!last) {
+    return;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (l->tasks[i].res) {
+      free_ip_addrinfo(l->tasks[i].res);
+    }
+  }
+  pthread_mutex_destroy(&l->lock);
+  pthread_cond_destroy(&l->resolved);
+  free(l->host);
+  free(l);
+}
+
+// Copy the addresses found by task `index` of a lookup into `c`, once it is
+// done. Returns whether it is done.
+static bool take_results(lookup *l, int index, candidates *c) {
+  if (c->taken) {
+    return true;
+  }
+
+  pthread_mutex_lock(&l->lock);
+
+  lookup_task *task = &l->tasks[index];
+  if (task->done) {
+    for (struct addrinfo *p = task->res; p && c->count < MAX_CANDIDATES;
+         p = p->ai_next) {
+      memcpy(&c->addrs[c->count], p->ai_addr, p->ai_addrlen);
+      c->lens[c->count++] = p->ai_addrlen;
+    }
+    c->taken = true;
+  }
+
+  pthread_mutex_unlock(&l->lock);
+  return c->taken;
+}
+
+// Start a non-blocking connect to the next address of `c`, which is of
+// `family`, and describe it in `a`. Returns 1 if it connected right away, 0 if
+// it is in progress, and -1 if it failed.
+static int start_attempt(candidates *c, int family, attempt *a) {
+  struct sockaddr_storage *addr = &c->addrs[c->next];
+  socklen_t len = c->lens[c->next];
+  debug("Trying IPv%d address %zu of %zu", family == AF_INET ? 4 : 6,
+        c->next + 1, c->count);
+  c->next++;
+
+  int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perrno("Could not create socket");
+    return -1;
+  }
+
+  a->fd = fd;
+  a->family = family;
+
+  if (connect(fd, (struct sockaddr *)addr, len) == 0) {
+    return 1;
+  }
+  if (errno == EINPROGRESS) {
+    return 0;
+  }
+
+  debug("Connection attempt failed right away: %s", strerror(errno));
+  check(close(fd), "close");
+  return -1;
+}
+
+// Slot of the table of preferred families for `host`
+static atomic_int *preference(const char *host) {
+  unsigned long hash = 5381;
+  for (const char *p = host; *p; p++) {
+    hash = hash * 33 + (unsigned char)*p;
+  }
+
+  return &preferences[hash % PREFERENCE_SLOTS];
+}
@@ -0,0 +1,10 @@
+#ifndef EYEBALLS_H
+#define EYEBALLS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool eyeballs_enabled(void);
+int eyeballs_connect(const char *, const char *, uint64_t, char **);
+
+#endif
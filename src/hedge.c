@@ -0,0 +1,275 @@
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "dns_cache.h"
+#include "eyeballs.h"
+#include "hedge.h"
+#include "metrics.h"
+#include "shared.h"
+
+// Observations of each phase needed before its percentile is trusted
+#define HEDGE_MIN_SAMPLES 100
+// Attempts per request: the first one and the hedge
+#define HEDGE_ATTEMPTS 2
+
+// An attempt at a request, on a connection of its own
+typedef struct {
+  int fd;
+  // Whether the request was sent, after which the attempt waits for an answer
+  bool sent;
+  // When the connection started, and when the request was sent, for the
+  // latency metrics
+  uint64_t connect_start, sent_at;
+} hedge_attempt;
+
+static double HEDGE_PERCENTILE = 0;
+static pthread_once_t hedge_once = PTHREAD_ONCE_INIT;
+
+static void hedge_init(void);
+static long hedge_delay(void);
+static void start_attempt(const struct sockaddr_storage *, socklen_t,
+                          hedge_attempt *);
+static int advance_attempt(hedge_attempt *, const char *, size_t);
+
+// Whether slow upstream requests are hedged, which is enabled by setting the
+// env var HEDGE_PERCENTILE, unless connections race both address families
+bool hedge_enabled(void) {
+  pthread_once(&hedge_once, hedge_init);
+  return HEDGE_PERCENTILE > 0;
+}
+
+// Send `request` to `host` on a new connection. If no answer started to
+// arrive by the HEDGE_PERCENTILE of the usual time to connect and get the
+// first byte, the request is sent again on a second connection, to the next
+// address of the host if it has one, and the first attempt to answer is kept.
+// A first attempt that fails is replaced right away. Everything is given up
+// at `deadline`, a time from `monotonic_ms`.
+//
+// Returns a blocking socket whose response can be read, and when the request
+// was sent on it in `sent`, or -1 with a message for the client in
+// `error_resp`.
+int hedge_request(const char *host, const char *request, uint64_t deadline,
+                  uint64_t *sent, char **error_resp) {
+  pthread_once(&hedge_once, hedge_init);
+
+  struct addrinfo *res = get_ip_addrinfo(host, HTTP_SERVICE, deadline);
+  if (res == NULL && errno == ETIMEDOUT) {
+    *error_resp = deadline_error(host);
+    return -1;
+  }
+  if (res == NULL) {
+    *error_resp = make_error_message("Could not find IP%s address for %s!\n",
+                                     IPV4 ? "v4" : "v6", host);
+    perrno(*error_resp);
+    metrics_count_error(ERR_DNS);
+    return -1;
+  }
+
+  struct sockaddr_storage addrs[HEDGE_ATTEMPTS];
+  socklen_t lens[HEDGE_ATTEMPTS];
+  size_t count = 0;
+  for (struct addrinfo *p = res; p && count < HEDGE_ATTEMPTS; p = p->ai_next) {
+    memcpy(&addrs[count], p->ai_addr, p->ai_addrlen);
+    lens[count++] = p->ai_addrlen;
+  }
+  free_ip_addrinfo(res);
+
+  if (monotonic_ms() >= deadline) {
+    *error_resp = deadline_error(host);
+    return -1;
+  }
+
+  size_t len = strlen(request);
+  long delay = hedge_delay();
+  uint64_t hedge_at = monotonic_ms() + delay;
+
+  hedge_attempt attempts[HEDGE_ATTEMPTS];
+  start_attempt(&addrs[0], lens[0], &attempts[0]);
+  size_t started = 1;
+  int winner = -1;
+  bool any_sent = false;
+
+  while (winner < 0) {
+    uint64_t now = monotonic_ms();
+    size_t live = 0;
+    for (size_t i = 0; i < started; i++) {
+      live += attempts[i].fd >= 0;
+    }
+
+    bool can_hedge = started < HEDGE_ATTEMPTS && delay >= 0;
+    if (can_hedge && (now >= hedge_at || live == 0)) {
+      debug("Hedging the request to %s", host);
+      start_attempt(&addrs[started % count], lens[started % count],
+                    &attempts[started]);
+      started++;
+      continue;
+    }
+
+    if (live == 0 || now >= deadline) {
+      break;
+    }
+
+    // Sleep until an attempt progresses, the hedge is due, or time is up
+    uint64_t wake = can_hedge && hedge_at < deadline ? hedge_at : deadline;
+    struct pollfd fds[HEDGE_ATTEMPTS];
+    for (size_t i = 0; i < started; i++) {
+      // Attempts that failed have a negative fd, which poll skips
+      fds[i].fd = attempts[i].fd;
+      fds[i].events = attempts[i].sent ? POLLIN : POLLOUT;
+      fds[i].revents = 0;
+    }
+
+    if (poll(fds, started, wake - now) < 0 && errno != EINTR) {
+      perrno("poll");
+      break;
+    }
+
+    for (size_t i = 0; i < started && winner < 0; i++) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+
+      int status = advance_attempt(&attempts[i], request, len);
+      any_sent = any_sent || attempts[i].sent;
+      if (status > 0) {
+        winner = i;
+      } else if (status < 0) {
+        debug("Attempt %zu at %s failed: %s", i + 1, host, strerror(errno));
+        check(close(attempts[i].fd), "close");
+        attempts[i].fd = -1;
+      }
+    }
+  }
+
+  // The slower attempt is cancelled by closing its connection
+  for (size_t i = 0; i < started; i++) {
+    if ((int)i != winner && attempts[i].fd >= 0) {
+      check(close(attempts[i].fd), "close");
+    }
+  }
+
+  if (started > 1) {
+    metrics_count_hedge(winner == 1);
+  }
+
+  if (winner < 0) {
+    if (monotonic_ms() >= deadline) {
+      *error_resp = deadline_error(host);
+    } else if (!any_sent) {
+      *error_resp = make_error_message("Could not connect to %s!\n", host);
+      error("%s", *error_resp);
+      metrics_count_error(ERR_CONNECT);
+    } else {
+      *error_resp = make_error_message("Received empty response\n");
+      error("%s", *error_resp);
+      metrics_count_error(ERR_UPSTREAM);
+    }
+    return -1;
+  }
+
+  // The rest of the response is read with blocking calls
+  int sockfd = attempts[winner].fd;
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+  *sent = attempts[winner].sent_at;
+
+  return sockfd;
+}
+
+// Read the configuration from the environment. HEDGE_PERCENTILE has to be
+// between 0 and 100, exclusive.
+static void hedge_init(void) {
+  if (getenv("HEDGE_PERCENTILE") == NULL) {
+    return;
+  }
+
+  HEDGE_PERCENTILE = atof(getenv("HEDGE_PERCENTILE"));
+  if (HEDGE_PERCENTILE <= 0 || HEDGE_PERCENTILE >= 100) {
+    error("HEDGE_PERCENTILE must be between 0 and 100, hedging is disabled");
+    HEDGE_PERCENTILE = 0;
+  }
+
+  // Attempts connect to the addresses of the configured family only, which
+  // would skip the race of the families without a word
+  if (HEDGE_PERCENTILE > 0 && eyeballs_enabled()) {
+    error("HEDGE_PERCENTILE cannot be used with HAPPY_EYEBALLS=1, hedging is "
+          "disabled");
+    HEDGE_PERCENTILE = 0;
+  }
+}
+
+// Milliseconds after which a request gets a second attempt: the percentile of
+// the time to connect plus that of the time to the first byte. Returns -1
+// until both were observed often enough to tell.
+static long hedge_delay(void) {
+  double q = HEDGE_PERCENTILE / 100;
+  unsigned long connects, first_bytes;
+  uint64_t us = metrics_percentile(PHASE_CONNECT, q, &connects) +
+                metrics_percentile(PHASE_FIRST_BYTE, q, &first_bytes);
+
+  if (connects < HEDGE_MIN_SAMPLES || first_bytes < HEDGE_MIN_SAMPLES) {
+    return -1;
+  }
+
+  return us / 1000 + 1;
+}
+
+// Start a non-blocking connect to `addr` in `a`. On failure, its fd is -1.
+static void start_attempt(const struct sockaddr_storage *addr, socklen_t len,
+                          hedge_attempt *a) {
+  a->sent = false;
+  a->connect_start = metrics_now();
+  a->fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                 0);
+  if (a->fd < 0) {
+    perrno("Could not create socket");
+    return;
+  }
+
+  if (connect(a->fd, (const struct sockaddr *)addr, len) < 0 &&
+      errno != EINPROGRESS) {
+    debug("Connection attempt failed right away: %s", strerror(errno));
+    check(close(a->fd), "close");
+    a->fd = -1;
+  }
+}
+
+// Advance an attempt that polled ready: send the request once connected, and
+// check that the answer started. Returns 1 once it did, 0 while waiting for
+// it, and -1 with errno set if the attempt failed.
+static int advance_attempt(hedge_attempt *a, const char *request,
+                           size_t len) {
+  if (a->sent) {
+    // Readable also when the remote closed the connection without an answer
+    char byte;
+    long peeked = recv(a->fd, &byte, 1, MSG_PEEK);
+    if (peeked == 0) {
+      errno = ECONNRESET;
+    }
+    return peeked > 0 ? 1 : -1;
+  }
+
+  int err = 0;
+  socklen_t err_len = sizeof(err);
+  getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  metrics_observe(PHASE_CONNECT, a->connect_start);
+
+  // A fresh connection has room for the whole request
+  debug("Sending HTTP request '%s'...", request);
+  if (send(a->fd, request, len, MSG_NOSIGNAL) != (long)len) {
+    return -1;
+  }
+  metrics_count_tx(PEER_UPSTREAM, len);
+
+  a->sent = true;
+  a->sent_at = metrics_now();
+  return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool hedge_enabled(void);
+int hedge_request(const char *, const char *, uint64_t, uint64_t *, char **);
+
+#endif
@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "http.h"
+#include "metrics.h"
+#include "shared.h"
+
+static bool parse_chunk_size(const char *, const char *, size_t *);
+
+// Return a pointer past the "\r\n\r\n" ending the headers in `buf`, or NULL if
+// the headers are not complete yet
+const char *find_header_end(const char *buf, size_t len) {
+  const char *end = memmem(buf, len, "\r\n\r\n", 4);
+  return end ? end + 4 : NULL;
+}
+
+// Find the value of header `name` in the first `len` bytes of `headers`,
+// ignoring case and surrounding whitespace. The value is not null-terminated.
+bool get_header(const char *headers, size_t len, const char *name,
+                const char **value, size_t *value_len) {
+  size_t name_len = strlen(name);
+  const char *end = headers + len;
+
+  // Skip the status line
+  const char *line = memmem(headers, len, "\r\n", 2);
+
+  while (line && line + 2 < end) {
+    line += 2;
+    const char *line_end = memmem(line, end - line, "\r\n", 2);
+    if (!line_end) {
+      line_end = end;
+    }
+
+    if ((size_t)(line_end - line) > name_len && line[name_len] == ':' &&
+        strncasecmp(line, name, name_len) == 0) {
+      const char *v = line + name_len + 1;
+      while (v < line_end && (*v == ' ' || *v == '\t')) {
+        v++;
+      }
+      const char *v_end = line_end;
+      while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) {
+        v_end--;
+      }
+
+      *value = v;
+      *value_len = v_end - v;
+      return true;
+    }
+
+    line = line_end < end ? line_end : NULL;
+  }
+
+  return false;
+}
+
+// Parse the status line and the headers that frame the body of a response.
+// Return false if the headers are not complete or are not HTTP.
+bool parse_http_head(const char *buf, size_t len, http_head *head) {
+  const char *end = find_header_end(buf, len);
+  if (!end || len < 12 || strncmp(buf, "HTTP/1.", 7) != 0) {
+    return false;
+  }
+
+  bool http_11 = buf[7] == '1';
+  head->status = atoi(buf + 9);
+  head->header_len = end - buf;
+  head->content_length = 0;
+
+  const char *value;
+  size_t value_len;
+
+  // HTTP/1.1 connections persist unless told otherwise, HTTP/1.0 ones do not
+  head->keep_alive = http_11;
+  if (get_header(buf, head->header_len, "Connection", &value, &value_len)) {
+    if (value_len == 5 && strncasecmp(value, "close", 5) == 0) {
+      head->keep_alive = false;
+    } else if (value_len == 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+      head->keep_alive = true;
+    }
+  }
+
+  if ((head->status >= 100 && head->status < 200) || head->status == 204 ||
+      head->status == 304) {
+    head->framing = BODY_NONE;
+  } else if (get_header(buf, head->header_len, "Transfer-Encoding", &value,
+                        &value_len) &&
+             value_len >= 7 &&
+             strncasecmp(value + value_len - 7, "chunked", 7) == 0) {
+    head->framing = BODY_CHUNKED;
+  } else if (get_header(buf, head->header_len, "Content-Length", &value,
+                        &value_len)) {
+    head->framing = BODY_LENGTH;
+
+    char *number_end;
+    errno = 0;
+    unsigned long long length = strtoull(value, &number_end, 10);
+    if (!isdigit((unsigned char)*value) || number_end != value + value_len ||
+        errno == ERANGE || length > SIZE_MAX / 2) {
+      head->framing = BODY_INVALID;
+      head->keep_alive = false;
+    }
+    head->content_length = length;
+  } else {
+    head->framing = BODY_UNTIL_CLOSE;
+    head->keep_alive = false;
+  }
+
+  return true;
+}
+
+// Parse an HTTP-date such as "Sun, 06 Nov 1994 08:49:37 GMT" of `len` bytes.
+// Return 0 if it is not a valid date.
+time_t parse_http_date(const char *value, size_t len) {
+  char date[64];
+  if (len >= sizeof(date)) {
+    return 0;
+  }
+  memcpy(date, value, len);
+  date[len] = '\0';
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (!strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+    return 0;
+  }
+
+  return timegm(&tm);
+}
+
+// Walk the chunks of a chunked body of `len` bytes, starting at offset `*pos`,
+// which is moved past every complete chunk. The body must be null-terminated.
+//
+// Return 1 once the last chunk and the trailers were seen, 0 if more bytes are
+// needed and -1 if the body is malformed.
+int scan_chunks(const char *body, size_t len, size_t *pos) {
+  while (true) {
+    const char *line_end = memmem(body + *pos, len - *pos, "\r\n", 2);
+    if (!line_end) {
+      return 0;
+    }
+
+    size_t size;
+    if (!parse_chunk_size(body + *pos, line_end, &size)) {
+      return -1;
+    }
+
+    size_t data = line_end + 2 - body;
+
+    // The last chunk is followed by optional trailers and an empty line
+    if (size == 0) {
+      const char *line = body + data;
+      while (true) {
+        const char *trailer_end = memmem(line, body + len - line, "\r\n", 2);
+        if (!trailer_end) {
+          return 0;
+        }
+        if (trailer_end == line) {
+          *pos = trailer_end + 2 - body;
+          return 1;
+        }
+        line = trailer_end + 2;
+      }
+    }
+
+    // Compared without adding to `data`, which a huge size would overflow
+    if (len - data < 2 || size > len - data - 2) {
+      return 0;
+    }
+
+    *pos = data + size + 2;
+  }
+}
+
+// Decode the chunked body of the complete response in `buf` in place, and drop
+// its Transfer-Encoding header, since what is left is the plain content.
+// Return the new length of the response.
+size_t dechunk_response(char *buf, size_t len, size_t header_len) {
+  const char *value;
+  size_t value_len;
+
+  // Remove the whole "Transfer-Encoding: ...\r\n" line from the headers
+  if (get_header(buf, header_len, "Transfer-Encoding", &value, &value_len)) {
+    char *line = (char *)value;
+    while (line > buf && line[-1] != '\n') {
+      line--;
+    }
+    char *next =
+        (char *)memmem(value, buf + header_len - value, "\r\n", 2) + 2;
+
+    memmove(line, next, len - (next - buf));
+    len -= next - line;
+    header_len -= next - line;
+  }
+
+  // Move the data of every chunk right after the previous one
+  char *out = buf + header_len;
+  size_t pos = header_len;
+
+  while (pos < len) {
+    const char *line_end = memmem(buf + pos, len - pos, "\r\n", 2);
+    size_t size;
+
+    if (!line_end || !parse_chunk_size(buf + pos, line_end, &size) ||
+        size == 0) {
+      break;
+    }
+
+    size_t data = line_end + 2 - buf;
+    if (len - data < 2 || size > len - data - 2) {
+      break;
+    }
+    memmove(out, buf + data, size);
+    out += size;
+    pos = data + size + 2;
+  }
+
+  *out = '\0';
+  return out - buf;
+}
+
+// Receive exactly one HTTP response on `sockfd`, using its headers to find
+// where it ends, so the connection can be used again afterwards. Chunked
+// bodies are decoded.
+//
+// The buffer is sized once from the Content-Length header when there is one,
+// up to HTTP_RESERVE_MAX, and from `size_hint`, the size of a previous
+// response, otherwise. Responses with an invalid Content-Length are rejected.
+//
+// `sent` is when the request was sent, from `metrics_now`, and the response
+// has to be complete by `deadline`, from `monotonic_ms`.
+//
+// Returns the null-terminated response and its length in `len`, with room for
+// one more byte, or NULL if the connection failed or closed before the
+// response was complete, with errno set to ETIMEDOUT if time ran out.
+// `reusable` tells whether another request can be sent on the connection.
+char *recv_http_response(int sockfd, size_t size_hint, uint64_t sent,
+                         uint64_t deadline, size_t *len, bool *reusable) {
+  rx_buffer rb;
+  rxbuf_init(&rb);
+  rxbuf_reserve(&rb, size_hint);
+
+  size_t chunk_pos = 0;
+  http_head head;
+  bool have_head = false;
+
+  uint64_t first_byte = 0;
+
+  *reusable = false;
+
+  while (true) {
+    // Check whether what was received so far is a complete response
+    if (!have_head && parse_http_head(rb.data, rb.len, &head)) {
+      have_head = true;
+      chunk_pos = head.header_len;
+
+      // Allocate for the whole body at once, and the newline added to it, up
+      // to HTTP_RESERVE_MAX
+      size_t body_rx = rb.len - head.header_len;
+      if (head.framing == BODY_LENGTH && head.content_length > body_rx) {
+        size_t missing = head.content_length - body_rx;
+        if (missing > HTTP_RESERVE_MAX) {
+          missing = HTTP_RESERVE_MAX;
+        }
+        rxbuf_reserve(&rb, missing + 1);
+      }
+    }
+
+    if (have_head) {
+      size_t body_rx = rb.len - head.header_len;
+      bool complete = false;
+
+      switch (head.framing) {
+      case BODY_NONE:
+        complete = true;
+        break;
+      case BODY_LENGTH:
+        complete = body_rx >= head.content_length;
+        break;
+      case BODY_CHUNKED: {
+        int scanned = scan_chunks(rb.data, rb.len, &chunk_pos);
+        if (scanned < 0) {
+          error("Malformed chunked response");
+          rxbuf_free(&rb);
+          return NULL;
+        }
+        complete = scanned == 1;
+        break;
+      }
+      case BODY_UNTIL_CLOSE:
+        break;
+      case BODY_INVALID:
+        error("Invalid Content-Length in response");
+        rxbuf_free(&rb);
+        return NULL;
+      }
+
+      if (complete) {
+        break;
+      }
+    }
+
+    long bytes_rx = -1;
+    if (wait_until(sockfd, POLLIN, deadline) > 0) {
+      bytes_rx = rxbuf_recv(&rb, sockfd, 0);
+    }
+
+    if (bytes_rx < 0) {
+      perrno("Could not receive HTTP response");
+      rxbuf_free(&rb);
+      return NULL;
+    }
+
+    debug("received %ld bytes", bytes_rx);
+    metrics_count_rx(PEER_UPSTREAM, bytes_rx);
+
+    if (bytes_rx > 0 && first_byte == 0) {
+      first_byte = metrics_now();
+      metrics_observe(PHASE_FIRST_BYTE, sent);
+    }
+
+    if (bytes_rx == 0) {
+      info("Remote has closed the connection on fd %d", sockfd);
+
+      // Only a body framed by the end of the connection may end here
+      if (have_head && head.framing == BODY_UNTIL_CLOSE) {
+        break;
+      }
+
+      rxbuf_free(&rb);
+      return NULL;
+    }
+  }
+
+  if (first_byte != 0) {
+    metrics_observe(PHASE_TRANSFER, first_byte);
+  }
+
+  // Leave room to append a newline and a null terminator in place
+  rxbuf_reserve(&rb, 1);
+
+  size_t total_rx = rb.len;
+  char *buf = rxbuf_detach(&rb);
+  *reusable = head.keep_alive;
+
+  if (head.framing == BODY_CHUNKED) {
+    if (chunk_pos != total_rx) {
+      *reusable = false;
+    }
+    total_rx = dechunk_response(buf, total_rx, head.header_len);
+  } else if (head.framing == BODY_LENGTH) {
+    // Anything past the body does not belong to a response we asked for, so
+    // the connection is out of sync
+    if (total_rx - head.header_len > head.content_length) {
+      total_rx = head.header_len + head.content_length;
+      buf[total_rx] = '\0';
+      *reusable = false;
+    }
+  }
+
+  *len = total_rx;
+
+  return buf;
+}
+
+// Parse the hexadecimal size of the chunk whose size line starts at `line` and
+// ends at `line_end`, where it may be followed by chunk extensions, which are
+// ignored. Returns false if the line does not start with a size, or the size
+// does not fit in a `size_t`.
+static bool parse_chunk_size(const char *line, const char *line_end,
+                             size_t *size) {
+  const char *p = line;
+  *size = 0;
+
+  for (; p < line_end && isxdigit((unsigned char)*p); p++) {
+    if (*size > SIZE_MAX >> 4) {
+      return false;
+    }
+    int digit = *p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10;
+    *size = *size << 4 | digit;
+  }
+
+  return p > line && (p == line_end || *p == ';' || *p == ' ' || *p == '\t');
+}
@@ -0,0 +1,47 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Most bytes reserved up front for a body from its Content-Length. Larger
+// bodies grow the buffer as they arrive, so a bogus length cannot exhaust
+// memory.
+#define HTTP_RESERVE_MAX (16 * 1024 * 1024)
+
+// How the end of a response body is found
+typedef enum {
+  // No body, e.g. 204 and 304 responses
+  BODY_NONE,
+  // Content-Length bytes follow the headers
+  BODY_LENGTH,
+  // Transfer-Encoding: chunked
+  BODY_CHUNKED,
+  // The body ends when the remote closes the connection
+  BODY_UNTIL_CLOSE,
+  // Content-Length is not a number, or too large to ever be received
+  BODY_INVALID,
+} body_framing;
+
+// What the headers of a response say about its body and connection
+typedef struct {
+  int status;
+  // Length of the headers, including the final "\r\n\r\n"
+  size_t header_len;
+  body_framing framing;
+  size_t content_length;
+  // Whether the connection can carry another request after this response
+  bool keep_alive;
+} http_head;
+
+const char *find_header_end(const char *, size_t);
+bool get_header(const char *, size_t, const char *, const char **, size_t *);
+bool parse_http_head(const char *, size_t, http_head *);
+time_t parse_http_date(const char *, size_t);
+int scan_chunks(const char *, size_t, size_t *);
+size_t dechunk_response(char *, size_t, size_t);
+char *recv_http_response(int, size_t, uint64_t, uint64_t, size_t *, bool *);
+
+#endif
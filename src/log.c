@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "log.h"
+#include "shared.h"
+
+// Messages a thread can have waiting for the drainer before new ones are
+// dropped
+#define LOG_RING_LEN 64
+// Longest message kept, longer ones are cut
+#define LOG_LINE_MAX 512
+// How long the drainer sleeps when there was nothing to write
+#define LOG_IDLE_NS (10 * 1000 * 1000)
+// Number of call sites error messages are rate limited for. Call sites whose
+// format strings hash to the same slot share their limit.
+#define LOG_RATE_SLOTS 64
+
+typedef struct {
+  log_level level;
+  unsigned len;
+  char text[LOG_LINE_MAX];
+} log_entry;
+
+// Messages of one thread, which only it writes and only the drainer reads
+typedef struct log_ring {
+  log_entry entries[LOG_RING_LEN];
+  // Next entry to read, written by the drainer
+  atomic_size_t head;
+  // Next entry to write, written by the owning thread
+  atomic_size_t tail;
+  // Set once the owning thread exited, so the drainer can free the ring
+  atomic_bool done;
+  struct log_ring *next;
+} log_ring;
+
+// Error messages logged by a call site in the current second
+typedef struct {
+  atomic_long second;
+  atomic_uint count;
+  atomic_uint suppressed;
+} log_rate;
+
+static log_level LOG_LEVEL = LOG_INFO;
+static unsigned LOG_ERROR_BURST = 10;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+// Rings of every thread that logged, newest first. Threads only ever push to
+// the front; everything else is done by the drainer.
+static _Atomic(log_ring *) rings = NULL;
+static __thread log_ring *own_ring = NULL;
+static pthread_key_t ring_key;
+// Held while draining, so there is only ever one reader of each ring
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+// Messages lost because a ring was full
+static atomic_size_t dropped = 0;
+static log_rate rates[LOG_RATE_SLOTS];
+
+static void log_init(void);
+static void log_vwrite(log_level, const char *, va_list, const char *);
+static log_ring *get_ring(void);
+static void ring_done(void *);
+static bool rate_allow(const char *, unsigned *);
+static void *drainer(void *);
+static bool drain(void);
+
+// Log a message at `level`. Formatting happens in the calling thread, which
+// then hands the message to a background thread without locking; if that
+// thread has fallen behind, the message is dropped rather than waited on.
+void log_write(log_level level, const char *restrict format, ...) {
+  va_list vargs;
+  va_start(vargs, format);
+  log_vwrite(level, format, vargs, NULL);
+  va_end(vargs);
+}
+
+// Log progress messages, such as connections and commands
+void info(const char *restrict format, ...) {
+  va_list vargs;
+  va_start(vargs, format);
+  log_vwrite(LOG_INFO, format, vargs, NULL);
+  va_end(vargs);
+}
+
+// Log error messages, which are printed to stderr with the prefix `ERROR: `
+void error(const char *restrict format, ...) {
+  va_list vargs;
+  va_start(vargs, format);
+  log_vwrite(LOG_ERROR, format, vargs, NULL);
+  va_end(vargs);
+}
+
+// Log the desired message followed by the errno and its explanation on a
+// newline
+void perrno(const char *restrict format, ...) {
+  // Formatting could change errno before it is printed
+  int err = errno;
+  char description[64], suffix[128];
+  snprintf(suffix, sizeof(suffix), "\nerrno %d: %s", err,
+           strerror_r(err, description, sizeof(description)));
+
+  va_list vargs;
+  va_start(vargs, format);
+  log_vwrite(LOG_ERROR, format, vargs, suffix);
+  va_end(vargs);
+
+  errno = err;
+}
+
+// Write every message logged so far. Called at exit, and safe to call from
+// any thread.
+void log_flush(void) {
+  pthread_mutex_lock(&drain_lock);
+  while (drain()) {
+  }
+  pthread_mutex_unlock(&drain_lock);
+
+  fflush(stdout);
+  fflush(stderr);
+}
+
+// Read the configuration and start the drainer. The level comes from the env
+// var LOG_LEVEL (debug, info or error, default info), or DEBUG for debug
+// messages, and at most LOG_ERROR_BURST (default 10, 0 for no limit) error
+// messages per second are printed from each call site.
+static void log_init(void) {
+  const char *level = getenv("LOG_LEVEL");
+  if (getenv("DEBUG") != NULL) {
+    LOG_LEVEL = LOG_DEBUG;
+  } else if (level && strcasecmp(level, "debug") == 0) {
+    LOG_LEVEL = LOG_DEBUG;
+  } else if (level && strcasecmp(level, "error") == 0) {
+    LOG_LEVEL = LOG_ERROR;
+  }
+
+  if (getenv("LOG_ERROR_BURST") != NULL) {
+    LOG_ERROR_BURST = atoi(getenv("LOG_ERROR_BURST"));
+  }
+
+  pthread_key_create(&ring_key, ring_done);
+  atexit(log_flush);
+
+  pthread_t t;
+  if (pthread_create(&t, NULL, drainer, NULL) != 0) {
+    fprintf(stderr, "ERROR: Could not start the logging thread\n");
+    exit(1);
+  }
+  pthread_detach(t);
+}
+
+// Format a message, with an optional `suffix`, into the calling thread's ring
+static void log_vwrite(log_level level, const char *format, va_list vargs,
+                       const char *suffix) {
+  pthread_once(&log_once, log_init);
+
+  if (level < LOG_LEVEL) {
+    return;
+  }
+
+  unsigned suppressed = 0;
+  if (level == LOG_ERROR && !rate_allow(format, &suppressed)) {
+    return;
+  }
+
+  log_ring *ring = get_ring();
+  if (ring == NULL) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head == LOG_RING_LEN) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  log_entry *entry = &ring->entries[tail % LOG_RING_LEN];
+  int len = vsnprintf(entry->text, LOG_LINE_MAX, format, vargs);
+  if (len < 0) {
+    len = 0;
+  }
+
+  if (suffix && len < LOG_LINE_MAX) {
+    len += snprintf(entry->text + len, LOG_LINE_MAX - len, "%s", suffix);
+  }
+  if (suppressed && len < LOG_LINE_MAX) {
+    len += snprintf(entry->text + len, LOG_LINE_MAX - len,
+                    " (%u similar messages suppressed)", suppressed);
+  }
+
+  entry->level = level;
+  entry->len = len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1;
+
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// The ring of the calling thread, allocated and published the first time the
+// thread logs. Returns NULL if there was no memory for it.
+static log_ring *get_ring(void) {
+  if (own_ring) {
+    return own_ring;
+  }
+
+  // malloc_s would log on failure, from inside the logger
+  log_ring *ring = malloc(sizeof(log_ring));
+  if (ring == NULL) {
+    return NULL;
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->done, false);
+
+  ring->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+  }
+
+  own_ring = ring;
+  pthread_setspecific(ring_key, ring);
+  return ring;
+}
+
+// Called when a thread that logged exits
+static void ring_done(void *ring) {
+  atomic_store_explicit(&((log_ring *)ring)->done, true, memory_order_release);
+}
+
+// Whether an error message with `format` is under the limit of its call site
+// for the current second. The first message of a new second also gets the
+// number of messages that were suppressed in `suppressed`.
+static bool rate_allow(const char *format, unsigned *suppressed) {
+  if (LOG_ERROR_BURST == 0) {
+    return true;
+  }
+
+  log_rate *rate = &rates[((uintptr_t)format >> 3) % LOG_RATE_SLOTS];
+  long now = monotonic_time();
+  long second = atomic_load_explicit(&rate->second, memory_order_relaxed);
+
+  if (second != now &&
+      atomic_compare_exchange_strong(&rate->second, &second, now)) {
+    atomic_store_explicit(&rate->count, 0, memory_order_relaxed);
+    *suppressed = atomic_exchange(&rate->suppressed, 0);
+  }
+
+  if (atomic_fetch_add_explicit(&rate->count, 1, memory_order_relaxed) >=
+      LOG_ERROR_BURST) {
+    atomic_fetch_add_explicit(&rate->suppressed, 1, memory_order_relaxed);
+    return false;
+  }
+
+  return true;
+}
+
+// Write the messages of every thread, sleeping while there are none
+static void *drainer(void *arg) {
+  struct timespec idle = {0, LOG_IDLE_NS};
+
+  while (true) {
+    pthread_mutex_lock(&drain_lock);
+    bool wrote = drain();
+    pthread_mutex_unlock(&drain_lock);
+
+    if (!wrote) {
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+// Write the waiting messages of every ring, debug and info messages to stdout
+// and errors to stderr, and free the rings of exited threads once they are
+// empty. Must be called with `drain_lock` held. Returns whether anything was
+// written.
+static bool drain(void) {
+  bool wrote = false;
+  log_ring *prev = NULL;
+  log_ring *ring = atomic_load(&rings);
+
+  while (ring) {
+    log_ring *next = ring->next;
+    // Read before the tail, so no message can be missed after it is set
+    bool done = atomic_load_explicit(&ring->done, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    for (; head != tail; head++) {
+      log_entry *entry = &ring->entries[head % LOG_RING_LEN];
+
+      switch (entry->level) {
+      case LOG_DEBUG:
+        // Orange colored output
+        fprintf(stdout, "\033[0;33m%.*s\033[0m\n", entry->len, entry->text);
+        break;
+      case LOG_INFO:
+        fprintf(stdout, "%.*s\n", entry->len, entry->text);
+        break;
+      case LOG_ERROR:
+        fprintf(stderr, "ERROR: %.*s\n", entry->len, entry->text);
+        break;
+      }
+      wrote = true;
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+
+    // Threads only change the front of the list, so rings after it can be
+    // unlinked without racing them
+    if (done && prev) {
+      prev->next = next;
+      free(ring);
+    } else {
+      prev = ring;
+    }
+    ring = next;
+  }
+
+  size_t lost = atomic_exchange(&dropped, 0);
+  if (lost) {
+    fprintf(stderr, "ERROR: %zu log messages were dropped\n", lost);
+    wrote = true;
+  }
+
+  if (wrote) {
+    fflush(stdout);
+  }
+
+  return wrote;
+}
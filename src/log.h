@@ -0,0 +1,28 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Severity of a message. Messages below LOG_LEVEL are dropped where they are
+// logged, before being formatted.
+typedef enum { LOG_DEBUG, LOG_INFO, LOG_ERROR } log_level;
+
+void log_write(log_level, const char *restrict, ...)
+    __attribute__((format(printf, 2, 3)));
+void info(const char *restrict, ...) __attribute__((format(printf, 1, 2)));
+void error(const char *restrict, ...) __attribute__((format(printf, 1, 2)));
+void perrno(const char *restrict, ...) __attribute__((format(printf, 1, 2)));
+void log_flush(void);
+
+// Building with NO_DEBUG_LOG removes debug messages entirely. The call is kept
+// behind a constant condition so its arguments are still checked.
+#ifdef NO_DEBUG_LOG
+#define debug(...)                                                             \
+  do {                                                                         \
+    if (0) {                                                                   \
+      log_write(LOG_DEBUG, __VA_ARGS__);                                       \
+    }                                                                          \
+  } while (0)
+#else
+#define debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#endif
+
+#endif
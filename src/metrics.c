@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "dns_cache.h"
+#include "metrics.h"
+#include "shared.h"
+
+// Latency histograms have 4 buckets per power of two of microseconds, so the
+// relative error of a bucket is at most 25%. The last bucket also holds
+// everything longer than about 33 seconds.
+#define HIST_SUB_BITS 2
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 96
+// Buckets are exported bounded by every power of two of microseconds from
+// 2^HIST_EXPORT_MIN (16 us) to 2^HIST_EXPORT_MAX (about 16.8 s), which are
+// bounds of the buckets above too
+#define HIST_EXPORT_MIN 4
+#define HIST_EXPORT_MAX 24
+
+// Milliseconds a scraper of the admin port has to send its request and take
+// the response, so a stalled one cannot keep the others waiting
+#define ADMIN_TIMEOUT_MS 2000
+
+// Latencies in microseconds, counted in log-linear buckets
+typedef struct {
+  atomic_ulong counts[HIST_BUCKETS];
+  atomic_ulong count;
+  atomic_ulong sum_us;
+} histogram;
+
+// Every counter of the server. Updates are relaxed atomic additions, so the
+// hot path never takes a lock.
+static struct {
+  histogram phases[PHASE_COUNT];
+  atomic_ulong errors[ERR_COUNT];
+  atomic_ulong commands;
+  // Second attempts started by hedging, and how many of them answered first
+  atomic_ulong hedges, hedge_wins;
+  atomic_ulong connections;
+  atomic_long active_connections;
+  atomic_ulong rx[2], tx[2];
+  // Bytes that compression kept off the wire from origins and to clients
+  atomic_ulong saved[2];
+} metrics;
+
+static const char *PHASE_NAMES[PHASE_COUNT] = {"dns", "connect", "first_byte",
+                                               "transfer", "total"};
+static const char *ERROR_NAMES[ERR_COUNT] = {
+    "dns",       "connect",         "upstream",
+    "client_io", "not_implemented", "bad_request", "timeout", "busy"};
+static const char *PEER_NAMES[2] = {"client", "upstream"};
+
+static size_t bucket_index(uint64_t);
+static uint64_t bucket_upper(size_t);
+static void render_histogram(FILE *, metrics_phase);
+static void *admin_server(void *);
+
+// Nanoseconds on a monotonic clock, to be passed to `metrics_observe` when the
+// phase ends
+uint64_t metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Record that `phase` lasted from `start`, taken with `metrics_now`, until now
+void metrics_observe(metrics_phase phase, uint64_t start) {
+  uint64_t us = (metrics_now() - start) / 1000;
+  histogram *h = &metrics.phases[phase];
+
+  atomic_fetch_add_explicit(&h->counts[bucket_index(us)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+}
+
+// Count an error of kind `kind`
+void metrics_count_error(metrics_error_kind kind) {
+  atomic_fetch_add_explicit(&metrics.errors[kind], 1, memory_order_relaxed);
+}
+
+// Count a command received from a client
+void metrics_count_command(void) {
+  atomic_fetch_add_explicit(&metrics.commands, 1, memory_order_relaxed);
+}
+
+// Count a hedged upstream request, and whether the second attempt `won`
+void metrics_count_hedge(bool won) {
+  atomic_fetch_add_explicit(&metrics.hedges, 1, memory_order_relaxed);
+  if (won) {
+    atomic_fetch_add_explicit(&metrics.hedge_wins, 1, memory_order_relaxed);
+  }
+}
+
+// Count `n` bytes received from `peer`
+void metrics_count_rx(metrics_peer peer, size_t n) {
+  atomic_fetch_add_explicit(&metrics.rx[peer], n, memory_order_relaxed);
+}
+
+// Count `n` bytes sent to `peer`
+void metrics_count_tx(metrics_peer peer, size_t n) {
+  atomic_fetch_add_explicit(&metrics.tx[peer], n, memory_order_relaxed);
+}
+
+// Count `n` bytes that compression saved on the way from or to `peer`
+void metrics_count_saved(metrics_peer peer, size_t n) {
+  atomic_fetch_add_explicit(&metrics.saved[peer], n, memory_order_relaxed);
+}
+
+// Count a connection accepted from a client
+void metrics_connection_opened(void) {
+  atomic_fetch_add_explicit(&metrics.connections, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&metrics.active_connections, 1,
+                            memory_order_relaxed);
+}
+
+// Count a client connection that was closed
+void metrics_connection_closed(void) {
+  atomic_fetch_sub_explicit(&metrics.active_connections, 1,
+                            memory_order_relaxed);
+}
+
+// Latency in microseconds under which a fraction `q` of the observations of
+// `phase` fall, rounded up to the end of its bucket. The number of
+// observations is put in `count`, as the result means little without enough
+// of them.
+uint64_t metrics_percentile(metrics_phase phase, double q,
+                            unsigned long *count) {
+  histogram *h = &metrics.phases[phase];
+  unsigned long counts[HIST_BUCKETS], total = 0;
+
+  for (size_t i = 0; i < HIST_BUCKETS; i++) {
+    counts[i] = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    total += counts[i];
+  }
+
+  *count = total;
+  unsigned long rank = q * total, seen = 0;
+  for (size_t i = 0; i < HIST_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen > rank) {
+      return bucket_upper(i);
+    }
+  }
+
+  return 0;
+}
+
+// Render every metric in the Prometheus text format. Returns the allocated
+// text, with its length in `len`.
+char *metrics_render(size_t *len) {
+  char *text = NULL;
+  FILE *out = open_memstream(&text, len);
+  if (out == NULL) {
+    perrno("Could not render metrics");
+    *len = 0;
+    return make_error_message("");
+  }
+
+  fprintf(out,
+          "# HELP ip_project_request_duration_seconds Latency of commands "
+          "and of the phases of upstream requests.\n"
+          "# TYPE ip_project_request_duration_seconds histogram\n");
+  for (int phase = 0; phase < PHASE_COUNT; phase++) {
+    render_histogram(out, phase);
+  }
+
+  fprintf(out,
+          "# HELP ip_project_commands_total Commands received from clients.\n"
+          "# TYPE ip_project_commands_total counter\n"
+          "ip_project_commands_total %lu\n",
+          atomic_load(&metrics.commands));
+
+  fprintf(out,
+          "# HELP ip_project_hedged_requests_total Upstream requests that "
+          "started a second attempt.\n"
+          "# TYPE ip_project_hedged_requests_total counter\n"
+          "ip_project_hedged_requests_total %lu\n"
+          "# HELP ip_project_hedge_wins_total Hedged requests answered "
+          "first by the second attempt.\n"
+          "# TYPE ip_project_hedge_wins_total counter\n"
+          "ip_project_hedge_wins_total %lu\n",
+          atomic_load(&metrics.hedges), atomic_load(&metrics.hedge_wins));
+
+  fprintf(out,
+          "# HELP ip_project_connections_total Connections accepted.\n"
+          "# TYPE ip_project_connections_total counter\n"
+          "ip_project_connections_total %lu\n"
+          "# HELP ip_project_connections_active Open client connections.\n"
+          "# TYPE ip_project_connections_active gauge\n"
+          "ip_project_connections_active %ld\n",
+          atomic_load(&metrics.connections),
+          atomic_load(&metrics.active_connections));
+
+  fprintf(out, "# HELP ip_project_bytes_total Bytes received and sent.\n"
+               "# TYPE ip_project_bytes_total counter\n");
+  for (int peer = 0; peer < 2; peer++) {
+    fprintf(out,
+            "ip_project_bytes_total{peer=\"%s\",direction=\"rx\"} %lu\n"
+            "ip_project_bytes_total{peer=\"%s\",direction=\"tx\"} %lu\n",
+            PEER_NAMES[peer], atomic_load(&metrics.rx[peer]),
+            PEER_NAMES[peer], atomic_load(&metrics.tx[peer]));
+  }
+
+  fprintf(out, "# HELP ip_project_compression_saved_bytes_total Bytes not "
+               "transferred thanks to compressed responses.\n"
+               "# TYPE ip_project_compression_saved_bytes_total counter\n");
+  for (int peer = 0; peer < 2; peer++) {
+    fprintf(out,
+            "ip_project_compression_saved_bytes_total{peer=\"%s\"} %lu\n",
+            PEER_NAMES[peer], atomic_load(&metrics.saved[peer]));
+  }
+
+  fprintf(out, "# HELP ip_project_errors_total Errors by kind.\n"
+               "# TYPE ip_project_errors_total counter\n");
+  for (int kind = 0; kind < ERR_COUNT; kind++) {
+    fprintf(out, "ip_project_errors_total{kind=\"%s\"} %lu\n",
+            ERROR_NAMES[kind], atomic_load(&metrics.errors[kind]));
+  }
+
+  fprintf(out,
+          "# HELP ip_project_dns_cache_total Lookups of the DNS cache.\n"
+          "# TYPE ip_project_dns_cache_total counter\n"
+          "ip_project_dns_cache_total{result=\"hit\"} %lu\n"
+          "ip_project_dns_cache_total{result=\"negative_hit\"} %lu\n"
+          "ip_project_dns_cache_total{result=\"miss\"} %lu\n"
+          "ip_project_dns_cache_total{result=\"refresh\"} %lu\n",
+          atomic_load(&DNS_STATS.hits), atomic_load(&DNS_STATS.negative_hits),
+          atomic_load(&DNS_STATS.misses), atomic_load(&DNS_STATS.refreshes));
+
+  if (fclose(out) == EOF) {
+    perrno("Could not render metrics");
+  }
+
+  return text;
+}
+
+// If env var METRICS_PORT is set, serve the metrics over HTTP on that port of
+// the loopback interface, from a thread of its own
+void metrics_start_admin(void) {
+  if (getenv("METRICS_PORT") == NULL) {
+    return;
+  }
+
+  int port = atoi(getenv("METRICS_PORT"));
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    perrno("Could not create the metrics socket");
+    return;
+  }
+
+  int yes = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 10) < 0) {
+    perrno("Could not listen for metrics on port %d", port);
+    check(close(listener), "close");
+    return;
+  }
+
+  pthread_t t;
+  if (pthread_create(&t, NULL, admin_server, (void *)(intptr_t)listener) != 0) {
+    error("Could not start the metrics server");
+    check(close(listener), "close");
+    return;
+  }
+  pthread_detach(t);
+
+  info("Serving metrics on 127.0.0.1:%d", port);
+}
+
+// Answer every connection to the admin port with the metrics, whatever it
+// asked for, then close it
+static void *admin_server(void *arg) {
+  int listener = (int)(intptr_t)arg;
+
+  while (true) {
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      perrno("Could not accept metrics connection");
+      continue;
+    }
+
+    struct timeval timeout = {ADMIN_TIMEOUT_MS / 1000,
+                              ADMIN_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // The request itself does not matter, only that it arrived, or that it
+    // did not in time
+    char request[1024];
+    if (recv(fd, request, sizeof(request), 0) < 0) {
+      perrno("Could not receive metrics request");
+    }
+
+    size_t len;
+    char *body = metrics_render(&len);
+    char head[128];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n\r\n",
+                            len);
+
+    struct iovec iov[2] = {{head, head_len}, {body, len}};
+    writev_all(fd, iov, 2);
+
+    free(body);
+    check(close(fd), "close");
+  }
+
+  return NULL;
+}
+
+// Bucket of a latency of `us` microseconds. Values below HIST_SUB_BUCKETS get
+// a bucket each, larger ones are split by their highest bit, and then by the
+// HIST_SUB_BITS bits below it.
+static size_t bucket_index(uint64_t us) {
+  if (us < HIST_SUB_BUCKETS) {
+    return us;
+  }
+
+  int exponent = 63 - __builtin_clzll(us);
+  size_t sub = (us >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+  size_t index = (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+
+  return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+// Largest latency in microseconds that falls in bucket `index`
+static uint64_t bucket_upper(size_t index) {
+  if (index < HIST_SUB_BUCKETS) {
+    return index;
+  }
+
+  int exponent = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+  uint64_t sub = index % HIST_SUB_BUCKETS;
+  uint64_t width = 1ULL << (exponent - HIST_SUB_BITS);
+
+  return ((HIST_SUB_BUCKETS + sub) << (exponent - HIST_SUB_BITS)) + width - 1;
+}
+
+// Render the histogram of `phase`. Every scrape lists the same buckets, even
+// empty ones, so rates and quantiles can be computed across scrapes.
+static void render_histogram(FILE *out, metrics_phase phase) {
+  histogram *h = &metrics.phases[phase];
+  const char *name = PHASE_NAMES[phase];
+  unsigned long cumulative = 0;
+  size_t i = 0;
+
+  // Latencies are counted in whole microseconds, rounded down, so those below
+  // the bound are exactly the buckets whose values all are
+  for (int exponent = HIST_EXPORT_MIN; exponent <= HIST_EXPORT_MAX;
+       exponent++) {
+    uint64_t bound = 1ULL << exponent;
+    for (; i < HIST_BUCKETS - 1 && bucket_upper(i) < bound; i++) {
+      cumulative += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    }
+
+    fprintf(out,
+            "ip_project_request_duration_seconds_bucket{phase=\"%s\","
+            "le=\"%.6f\"} %lu\n",
+            name, bound / 1e6, cumulative);
+  }
+
+  // The rest, and the open-ended last bucket, are covered by +Inf
+  for (; i < HIST_BUCKETS; i++) {
+    cumulative += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+  }
+
+  unsigned long count = atomic_load(&h->count);
+  // Observations may land between the loads, the total must not be smaller
+  if (count < cumulative) {
+    count = cumulative;
+  }
+
+  fprintf(out,
+          "ip_project_request_duration_seconds_bucket{phase=\"%s\","
+          "le=\"+Inf\"} %lu\n"
+          "ip_project_request_duration_seconds_sum{phase=\"%s\"} %g\n"
+          "ip_project_request_duration_seconds_count{phase=\"%s\"} %lu\n",
+          name, count, name, atomic_load(&h->sum_us) / 1e6, name, count);
+}
@@ -0,0 +1,50 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Phases of a command whose latency is measured. The first four are the steps
+// of an upstream request, the last one is the whole command.
+typedef enum {
+  PHASE_DNS,
+  PHASE_CONNECT,
+  PHASE_FIRST_BYTE,
+  PHASE_TRANSFER,
+  PHASE_TOTAL,
+  PHASE_COUNT,
+} metrics_phase;
+
+// Kinds of errors that are counted
+typedef enum {
+  ERR_DNS,
+  ERR_CONNECT,
+  ERR_UPSTREAM,
+  ERR_CLIENT_IO,
+  ERR_NOT_IMPLEMENTED,
+  ERR_BAD_REQUEST,
+  ERR_TIMEOUT,
+  // Commands and connections turned away by admission control
+  ERR_BUSY,
+  ERR_COUNT,
+} metrics_error_kind;
+
+// The other end of counted bytes
+typedef enum { PEER_CLIENT, PEER_UPSTREAM } metrics_peer;
+
+uint64_t metrics_now(void);
+void metrics_observe(metrics_phase, uint64_t);
+void metrics_count_error(metrics_error_kind);
+void metrics_count_command(void);
+void metrics_count_hedge(bool);
+void metrics_count_rx(metrics_peer, size_t);
+void metrics_count_tx(metrics_peer, size_t);
+void metrics_count_saved(metrics_peer, size_t);
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+char *metrics_render(size_t *);
+uint64_t metrics_percentile(metrics_phase, double, unsigned long *);
+void metrics_start_admin(void);
+
+#endif
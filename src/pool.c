@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "shared.h"
+
+static void queue_init(task_queue *, size_t);
+static bool queue_push(task_queue *, task);
+static bool queue_pop(task_queue *, task *);
+static void enqueue(thread_pool *, task_fn, void *);
+static void *worker(void *);
+static void run_latched(void *);
+
+// Counts down the tasks of a `pool_run_all` call that are still running
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  size_t pending;
+} task_latch;
+
+// Task of a `pool_run_all` call, which counts down its latch when finished
+typedef struct {
+  task_fn fn;
+  void *arg;
+  task_latch *latch;
+} latched_task;
+
+// Arguments of a worker thread
+typedef struct {
+  thread_pool *pool;
+  size_t index;
+} worker_arg;
+
+// Create a pool of `n_workers` threads, which can hold `capacity` queued tasks
+// per worker before submitting blocks
+thread_pool *pool_create(size_t n_workers, size_t capacity) {
+  thread_pool *pool = malloc_s(sizeof(thread_pool));
+
+  // Queue positions wrap around with a mask, so round up to a power of two
+  size_t cells = 2;
+  while (cells < capacity) {
+    cells *= 2;
+  }
+
+  pool->n_workers = n_workers;
+  pool->workers = malloc_s(n_workers * sizeof(pthread_t));
+  pool->queues = malloc_s(n_workers * sizeof(task_queue));
+  atomic_init(&pool->next_queue, 0);
+
+  sem_init(&pool->items, 0, 0);
+  sem_init(&pool->slots, 0, n_workers * cells);
+
+  for (size_t i = 0; i < n_workers; i++) {
+    queue_init(&pool->queues[i], cells);
+  }
+
+  for (size_t i = 0; i < n_workers; i++) {
+    worker_arg *arg = malloc_s(sizeof(worker_arg));
+    arg->pool = pool;
+    arg->index = i;
+
+    if (pthread_create(&pool->workers[i], NULL, worker, arg) != 0) {
+      perrno("Could not create worker %zu", i);
+      abort();
+    }
+  }
+
+  debug("Started %zu workers with %zu queued tasks each", n_workers, cells);
+
+  return pool;
+}
+
+// Queue `fn(arg)` to be run by a worker. Blocks while every queue is full, so
+// bursts wait for the workers instead of piling up.
+void pool_submit(thread_pool *pool, task_fn fn, void *arg) {
+  while (sem_wait(&pool->slots) < 0 && errno == EINTR) {
+  }
+
+  enqueue(pool, fn, arg);
+}
+
+// Queue `fn(arg)` like `pool_submit`, on the queue of worker `index` unless it
+// is full. The task stays on that worker unless another one runs out of work.
+void pool_submit_to(thread_pool *pool, size_t index, task_fn fn, void *arg) {
+  while (sem_wait(&pool->slots) < 0 && errno == EINTR) {
+  }
+
+  if (queue_push(&pool->queues[index % pool->n_workers], (task){fn, arg})) {
+    sem_post(&pool->items);
+  } else {
+    enqueue(pool, fn, arg);
+  }
+}
+
+// Queue `fn(arg)` like `pool_submit`, unless every queue is full, in which case
+// return false immediately
+bool pool_try_submit(thread_pool *pool, task_fn fn, void *arg) {
+  if (sem_trywait(&pool->slots) < 0) {
+    return false;
+  }
+
+  enqueue(pool, fn, arg);
+  return true;
+}
+
+// Queue `fn(arg)` like `pool_submit_to`, unless every queue is full, in which
+// case return false immediately
+bool pool_try_submit_to(thread_pool *pool, size_t index, task_fn fn,
+                        void *arg) {
+  if (sem_trywait(&pool->slots) < 0) {
+    return false;
+  }
+
+  if (queue_push(&pool->queues[index % pool->n_workers], (task){fn, arg})) {
+    sem_post(&pool->items);
+  } else {
+    enqueue(pool, fn, arg);
+  }
+  return true;
+}
+
+// Run `fn` on each of the `n` arguments in `args` concurrently, and return once
+// all of them finished. The first one runs on the calling thread, which also
+// runs the others itself when the pool has no free slot, so this never waits
+// for room in the queues.
+void pool_run_all(thread_pool *pool, task_fn fn, void **args, size_t n) {
+  if (n == 0) {
+    return;
+  }
+
+  task_latch latch = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                      n - 1};
+  latched_task *tasks = malloc_s(n * sizeof(latched_task));
+
+  for (size_t i = 1; i < n; i++) {
+    tasks[i] = (latched_task){fn, args[i], &latch};
+
+    if (!pool_try_submit(pool, run_latched, &tasks[i])) {
+      run_latched(&tasks[i]);
+    }
+  }
+
+  fn(args[0]);
+
+  pthread_mutex_lock(&latch.lock);
+  while (latch.pending > 0) {
+    pthread_cond_wait(&latch.done, &latch.lock);
+  }
+  pthread_mutex_unlock(&latch.lock);
+
+  pthread_cond_destroy(&latch.done);
+  pthread_mutex_destroy(&latch.lock);
+  free(tasks);
+}
+
+// Number of workers to use by default: one per online core
+size_t pool_default_size(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? cores : 1;
+}
+
+// Pin each worker to a core of its own, worker `i` to the same core as
+// `pin_thread(t, i)` would
+void pool_pin_workers(thread_pool *pool) {
+  for (size_t i = 0; i < pool->n_workers; i++) {
+    pin_thread(pool->workers[i], i);
+  }
+}
+
+// Restrict thread `t` to core `pool_cpu(index)`. Threads it creates afterwards
+// inherit that. Returns whether it worked.
+bool pin_thread(pthread_t t, size_t index) {
+  int cpu = pool_cpu(index);
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  int err = pthread_setaffinity_np(t, sizeof(set), &set);
+  if (err != 0) {
+    errno = err;
+    perrno("Could not pin a thread to core %d", cpu);
+    return false;
+  }
+
+  return true;
+}
+
+// The `index`-th of the cores the process may run on, wrapping around
+int pool_cpu(size_t index) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    perrno("Could not get the allowed cores");
+    return 0;
+  }
+
+  size_t seen = 0, target = index % CPU_COUNT(&allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && seen++ == target) {
+      return cpu;
+    }
+  }
+
+  return 0;
+}
+
+// Queue a task once a free slot was taken from `pool->slots`
+static void enqueue(thread_pool *pool, task_fn fn, void *arg) {
+  task t = {fn, arg};
+  size_t start = atomic_fetch_add_explicit(&pool->next_queue, 1,
+                                           memory_order_relaxed);
+
+  // A free slot is guaranteed to exist, but a queue may briefly look full
+  // while another producer finishes writing to it
+  for (size_t i = start;; i++) {
+    if (queue_push(&pool->queues[i % pool->n_workers], t)) {
+      break;
+    }
+    if ((i - start + 1) % pool->n_workers == 0) {
+      sched_yield();
+    }
+  }
+
+  sem_post(&pool->items);
+}
+
+// Run tasks from the worker's own queue, or steal them from the other queues
+// when it is empty
+static void *worker(void *varg) {
+  worker_arg *arg = varg;
+  thread_pool *pool = arg->pool;
+  size_t index = arg->index;
+  free(arg);
+
+  while (true) {
+    while (sem_wait(&pool->items) < 0 && errno == EINTR) {
+    }
+
+    // A task is guaranteed to be queued, but a queue may briefly look empty
+    // while another consumer finishes reading from it
+    task t;
+    for (size_t i = index;; i++) {
+      if (queue_pop(&pool->queues[i % pool->n_workers], &t)) {
+        break;
+      }
+      if ((i - index + 1) % pool->n_workers == 0) {
+        sched_yield();
+      }
+    }
+
+    sem_post(&pool->slots);
+    t.fn(t.arg);
+  }
+
+  return NULL;
+}
+
+// Run a task of `pool_run_all`, then wake its caller if it was the last one
+static void run_latched(void *arg) {
+  latched_task *t = arg;
+  t->fn(t->arg);
+
+  pthread_mutex_lock(&t->latch->lock);
+  if (--t->latch->pending == 0) {
+    pthread_cond_signal(&t->latch->done);
+  }
+  pthread_mutex_unlock(&t->latch->lock);
+}
+
+// Initialise a queue of `cells` slots, which must be a power of two
+static void queue_init(task_queue *q, size_t cells) {
+  q->cells = malloc_s(cells * sizeof(task_cell));
+  q->mask = cells - 1;
+
+  for (size_t i = 0; i < cells; i++) {
+    atomic_init(&q->cells[i].seq, i);
+  }
+
+  atomic_init(&q->enqueue_pos, 0);
+  atomic_init(&q->dequeue_pos, 0);
+}
+
+// Add a task at the end of the queue. Return false if the queue is full.
+static bool queue_push(task_queue *q, task t) {
+  size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+  while (true) {
+    task_cell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      // The slot is free, claim it by moving the position forward
+      if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->t = t;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      // The slot still holds a task from the previous lap
+      return false;
+    } else {
+      pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+// Remove the task at the front of the queue. Return false if it is empty.
+static bool queue_pop(task_queue *q, task *t) {
+  size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+
+  while (true) {
+    task_cell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+    if (diff == 0) {
+      // The slot holds a task, claim it by moving the position forward
+      if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        *t = cell->t;
+        atomic_store_explicit(&cell->seq, pos + q->mask + 1,
+                              memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      // The slot was not written yet
+      return false;
+    } else {
+      pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    }
+  }
+}
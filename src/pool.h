@@ -0,0 +1,56 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Function run by a worker, with the argument it was submitted with
+typedef void (*task_fn)(void *);
+
+typedef struct {
+  task_fn fn;
+  void *arg;
+} task;
+
+// Slot of a task_queue. `seq` tells producers and consumers whose turn it is.
+typedef struct {
+  atomic_size_t seq;
+  task t;
+} task_cell;
+
+// Bounded multi-producer multi-consumer ring of tasks. The positions are kept
+// on separate cache lines so producers and consumers do not contend.
+typedef struct {
+  task_cell *cells;
+  size_t mask;
+  _Alignas(64) atomic_size_t enqueue_pos;
+  _Alignas(64) atomic_size_t dequeue_pos;
+} task_queue;
+
+// Fixed set of workers, each owning a queue, that steal from each other's
+// queues when their own is empty
+typedef struct {
+  size_t n_workers;
+  pthread_t *workers;
+  task_queue *queues;
+  // Number of queued tasks, and number of free slots across all queues
+  sem_t items, slots;
+  // Queue the next task is submitted to
+  atomic_size_t next_queue;
+} thread_pool;
+
+thread_pool *pool_create(size_t, size_t);
+void pool_submit(thread_pool *, task_fn, void *);
+void pool_submit_to(thread_pool *, size_t, task_fn, void *);
+bool pool_try_submit(thread_pool *, task_fn, void *);
+bool pool_try_submit_to(thread_pool *, size_t, task_fn, void *);
+void pool_run_all(thread_pool *, task_fn, void **, size_t);
+size_t pool_default_size(void);
+void pool_pin_workers(thread_pool *);
+bool pin_thread(pthread_t, size_t);
+int pool_cpu(size_t);
+
+#endif
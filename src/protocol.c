@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+
+static int parse_dest(const char *);
+
+// Whether the 3-byte command `frame` is the v2 handshake
+bool is_v2_handshake(const char *frame) {
+  return memcmp(frame, V2_HANDSHAKE, strlen(V2_HANDSHAKE)) == 0;
+}
+
+// Whether the 3-byte command `frame` asks for the metrics
+bool is_stats_command(const char *frame) {
+  return memcmp(frame, STATS_COMMAND, strlen(STATS_COMMAND)) == 0;
+}
+
+// Whether the 3-byte command `frame` asks for compressed responses
+bool is_compression_command(const char *frame) {
+  return memcmp(frame, COMPRESSION_COMMAND, strlen(COMPRESSION_COMMAND)) == 0;
+}
+
+// Whether the 3-byte command `frame` is in the form "xy#", where x and y are
+// digits
+bool is_valid_command(const char *frame) {
+  return frame[0] >= '0' && frame[0] <= '9' && frame[1] >= '0' &&
+         frame[1] <= '9' && frame[2] == '#';
+}
+
+// Length of the batch command at the start of the `len` bytes of `data`, up
+// to and including its '#'. Returns 0 if the rest of it did not arrive yet,
+// and BATCH_FRAME_MAX if it is too long to be one.
+size_t batch_frame_len(const char *data, size_t len) {
+  size_t limit = len < BATCH_FRAME_MAX ? len : BATCH_FRAME_MAX;
+  const char *end = memchr(data, '#', limit);
+
+  if (end) {
+    return end - data + 1;
+  }
+  return len < BATCH_FRAME_MAX ? 0 : BATCH_FRAME_MAX;
+}
+
+// Parse the batch command `frame` of `len` bytes, "B" followed by a
+// comma-separated list of two-digit destinations "xy" and ranges "xy-zw",
+// or by "*" for every destination, then "#". Sets `selected` for each named
+// destination, or `all` for "*". Returns whether the command is valid.
+bool parse_batch_command(const char *frame, size_t len, bool *selected,
+                         bool *all) {
+  memset(selected, 0, BATCH_DESTS * sizeof(bool));
+  *all = len == 3 && memcmp(frame, "B*#", 3) == 0;
+  if (*all) {
+    return true;
+  }
+
+  if (len < 4 || frame[0] != BATCH_PREFIX || frame[len - 1] != '#') {
+    return false;
+  }
+
+  const char *p = frame + 1, *end = frame + len - 1;
+  for (;;) {
+    int first = end - p >= 2 ? parse_dest(p) : -1, last = first;
+    p += 2;
+
+    if (first >= 0 && p < end && *p == '-') {
+      last = end - p >= 3 ? parse_dest(p + 1) : -1;
+      p += 3;
+    }
+    if (first < 0 || last < first) {
+      return false;
+    }
+
+    for (int i = first; i <= last; i++) {
+      selected[i] = true;
+    }
+
+    if (p == end) {
+      return true;
+    }
+    if (*p++ != ',') {
+      return false;
+    }
+  }
+}
+
+// The destination the two digits at `p` name, or -1 if they are not digits
+static int parse_dest(const char *p) {
+  if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9') {
+    return -1;
+  }
+  return (p[0] - '0') * 10 + p[1] - '0';
+}
+
+// Write the v2 header of a response with a body of `len` bytes to `header`,
+// which must have room for V2_HEADER_LEN bytes:
+//
+//   byte 0     version, always 2
+//   byte 1     status
+//   byte 2     flags
+//   byte 3     tag: the destination a response to a batch command is for,
+//              0 otherwise
+//   bytes 4-7  length of the body, unsigned big-endian
+//
+// Bodies longer than the length can describe are truncated and flagged as
+// such. Returns the number of body bytes to send after the header.
+size_t v2_header(unsigned char *header, v2_status status, unsigned char flags,
+                 unsigned char tag, size_t len) {
+  if (len > UINT32_MAX) {
+    len = UINT32_MAX;
+    flags |= V2_FLAG_TRUNCATED;
+  }
+
+  header[0] = V2_VERSION;
+  header[1] = status;
+  header[2] = flags;
+  header[3] = tag;
+  header[4] = len >> 24;
+  header[5] = len >> 16;
+  header[6] = len >> 8;
+  header[7] = len;
+
+  return len;
+}
@@ -0,0 +1,51 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Command a client sends to get the metrics of the server
+#define STATS_COMMAND "ST#"
+// Command a client sends to switch its connection to protocol v2
+#define V2_HANDSHAKE "V2#"
+// Command a client sends to get compressed responses as the origin sent them
+#define COMPRESSION_COMMAND "GZ#"
+// Commands a client sends to fetch several destinations at once start with
+// this, and end with '#' within BATCH_FRAME_MAX bytes
+#define BATCH_PREFIX 'B'
+#define BATCH_FRAME_MAX 256
+// Destinations a batch can name, those of two-digit commands
+#define BATCH_DESTS 100
+#define V2_VERSION 2
+// Length of the header in front of every v2 response
+#define V2_HEADER_LEN 8
+
+// Outcome of a command, sent in the header of v2 responses
+typedef enum {
+  V2_OK = 0,
+  V2_NOT_IMPLEMENTED = 1,
+  V2_UPSTREAM_ERROR = 2,
+  V2_BUSY = 3,
+  V2_BAD_REQUEST = 4,
+} v2_status;
+
+// Flags of v2 responses
+// The response was served from the cache
+#define V2_FLAG_CACHE_HIT 0x1
+// The body was cut to fit the 32-bit length
+#define V2_FLAG_TRUNCATED 0x2
+// The body is compressed
+#define V2_FLAG_COMPRESSED 0x4
+// The empty response that ends the responses to a batch command
+#define V2_FLAG_BATCH_END 0x8
+
+bool is_v2_handshake(const char *);
+bool is_stats_command(const char *);
+bool is_compression_command(const char *);
+bool is_valid_command(const char *);
+size_t batch_frame_len(const char *, size_t);
+bool parse_batch_command(const char *, size_t, bool *, bool *);
+size_t v2_header(unsigned char *, v2_status, unsigned char, unsigned char,
+                 size_t);
+
+#endif
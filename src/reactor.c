@@ -0,0 +1,789 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "client.h"
+#include "config.h"
+#include "dns_cache.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "resolver.h"
+#include "server.h"
+#include "shared.h"
+
+// Maximum number of events handled per call to epoll_wait
+#define MAX_EVENTS 256
+// Length of a command, in the form "xy#"
+#define CMD_LEN 3
+// Size of the buffer holding pipelined commands that were not handled yet
+#define CMD_BUF_LEN 512
+
+// Kind of file descriptor an epoll event refers to
+typedef enum { EP_LISTENER, EP_CLIENT, EP_UPSTREAM, EP_RESOLVER } endpoint_kind;
+
+// Common header of everything registered with epoll. The event data points to
+// it, so it must be the first member of the structs that embed it.
+typedef struct endpoint {
+  endpoint_kind kind;
+  int fd;
+  // Closed endpoints are kept until the end of the current batch of events,
+  // because a later event of the batch may still point to them
+  bool closed;
+  struct endpoint *next_closed;
+} endpoint;
+
+// States of a client connection
+typedef enum {
+  // Waiting for a complete "xy#" command
+  CLIENT_READING,
+  // Waiting for the upstream request started by the current command
+  CLIENT_FETCHING,
+  // Sending the response to the current command
+  CLIENT_WRITING,
+} client_state;
+
+// States of an upstream request
+typedef enum {
+  // Waiting for the addresses of the host, resolved off the loop
+  UPSTREAM_RESOLVING,
+  UPSTREAM_CONNECTING,
+  UPSTREAM_SENDING,
+  UPSTREAM_RECEIVING,
+} upstream_state;
+
+typedef struct upstream upstream;
+
+// A connection accepted from a client
+typedef struct {
+  endpoint ep;
+  // Handle of the connection in the registry
+  conn_id id;
+  // Where the client connects from, for its rate limit
+  peer_addr peer;
+  client_state state;
+  // Commands received but not handled yet
+  char cmd_buf[CMD_BUF_LEN];
+  size_t cmd_len;
+  // Response being sent
+  buffer *out;
+  size_t out_sent;
+  // Upstream request of the current command, if any
+  upstream *up;
+} client_conn;
+
+// An HTTP request made on behalf of a client
+struct upstream {
+  endpoint ep;
+  upstream_state state;
+  client_conn *owner;
+  // Copy of the host name, owned by the request
+  char *host;
+  // Resolution of the host while it runs, of which the request holds a
+  // reference
+  resolution *lookup;
+  // Number of bytes of the request sent so far
+  size_t req_sent;
+  // Response received so far
+  rx_buffer rx;
+  // Time after which the request fails, from `monotonic_ms`
+  uint64_t deadline;
+  // When the request started, and when its current phase started, for the
+  // latency metrics
+  uint64_t started, phase_start;
+  // Neighbours in the list of pending requests, which is ordered by deadline
+  upstream *prev, *next;
+};
+
+// State of the event loop
+typedef struct {
+  int epfd;
+  endpoint listener;
+  // Pipe the resolutions of destinations are handed back through, once done
+  endpoint resolved;
+  int resolved_wr;
+  // Pending upstream requests, the oldest deadline first
+  upstream *head, *tail;
+  // Endpoints to free once the current batch of events is handled
+  endpoint *closed;
+} reactor;
+
+static void accept_clients(reactor *);
+static bool client_progress(reactor *, client_conn *);
+static size_t client_frame_len(const client_conn *);
+static void client_start_command(reactor *, client_conn *, size_t);
+static void client_respond(reactor *, client_conn *, buffer *);
+static void client_respond_message(reactor *, client_conn *, char *);
+static void client_close(reactor *, client_conn *);
+static void upstream_start(reactor *, client_conn *, int);
+static void upstream_connect(reactor *, upstream *, struct addrinfo *, int);
+static void take_resolutions(reactor *);
+static void upstream_progress(reactor *, upstream *);
+static void upstream_fail(reactor *, upstream *, char *);
+static void upstream_abort(reactor *, upstream *, char *);
+static void upstream_close(reactor *, upstream *);
+static void timer_push(reactor *, upstream *);
+static void timer_remove(reactor *, upstream *);
+static void expire_upstreams(reactor *);
+static void retire(reactor *, endpoint *);
+
+// Serve all connections on the listening socket `listener` from a single
+// thread, using edge-triggered epoll. Every client connection and the upstream
+// request it is waiting for are state machines advanced by readiness events,
+// so no call ever blocks. Destinations missing from the DNS cache are resolved
+// on threads, which hand their results back through a pipe.
+int run_reactor(int listener) {
+  reactor r = {0};
+
+  r.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r.epfd < 0) {
+    perrno("Could not create epoll instance");
+    return 1;
+  }
+
+  r.listener.kind = EP_LISTENER;
+  r.listener.fd = listener;
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLET,
+                           .data.ptr = &r.listener};
+  if (epoll_ctl(r.epfd, EPOLL_CTL_ADD, listener, &ev) < 0) {
+    perrno("Could not watch the listening socket");
+    return 1;
+  }
+
+  // Resolver threads may block writing to the pipe, the loop never does
+  int resolved[2];
+  if (pipe2(resolved, O_CLOEXEC) < 0) {
+    perrno("Could not create the resolver pipe");
+    return 1;
+  }
+  fcntl(resolved[0], F_SETFL, fcntl(resolved[0], F_GETFL) | O_NONBLOCK);
+  r.resolved.kind = EP_RESOLVER;
+  r.resolved.fd = resolved[0];
+  r.resolved_wr = resolved[1];
+
+  ev = (struct epoll_event){.events = EPOLLIN | EPOLLET,
+                            .data.ptr = &r.resolved};
+  if (epoll_ctl(r.epfd, EPOLL_CTL_ADD, resolved[0], &ev) < 0) {
+    perrno("Could not watch the resolver pipe");
+    return 1;
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+
+  while (true) {
+    // Sleep until the next event, or until the oldest request times out
+    int timeout = -1;
+    if (r.head) {
+      uint64_t now = monotonic_ms();
+      timeout = r.head->deadline > now ? r.head->deadline - now : 0;
+    }
+
+    int n = epoll_wait(r.epfd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perrno("epoll_wait");
+      return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+      endpoint *ep = events[i].data.ptr;
+      uint32_t flags = events[i].events;
+
+      if (ep->closed) {
+        continue;
+      }
+
+      switch (ep->kind) {
+      case EP_LISTENER:
+        accept_clients(&r);
+        break;
+      case EP_CLIENT: {
+        client_conn *c = (client_conn *)ep;
+        // Both directions are closed, nothing can be sent back
+        if (flags & (EPOLLHUP | EPOLLERR)) {
+          client_close(&r, c);
+        } else {
+          client_progress(&r, c);
+        }
+        break;
+      }
+      case EP_UPSTREAM:
+        upstream_progress(&r, (upstream *)ep);
+        break;
+      case EP_RESOLVER:
+        take_resolutions(&r);
+        break;
+      }
+    }
+
+    expire_upstreams(&r);
+
+    // Nothing can refer to the closed endpoints anymore
+    while (r.closed) {
+      endpoint *next = r.closed->next_closed;
+      free(r.closed);
+      r.closed = next;
+    }
+  }
+
+  return 0;
+}
+
+// Accept every pending connection
+static void accept_clients(reactor *r) {
+  struct sockaddr_storage remote_addr;
+  socklen_t addr_size = sizeof(remote_addr);
+
+  // The listener was shut down to drain, only the open connections are left
+  if (atomic_load(&DRAINING)) {
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->listener.fd, NULL);
+    return;
+  }
+
+  while (true) {
+    int client_fd = accept4(r->listener.fd, (struct sockaddr *)&remote_addr,
+                            &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perrno("Could not accept connection");
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    if (!admission_open_connection()) {
+      admission_reject(client_fd);
+      continue;
+    }
+
+    // Register the connection, so it can be drained on shutdown
+    conn_id id = registry_add(&CONNECTIONS, client_fd);
+    metrics_connection_opened();
+
+    // Get string representation of the client's IP, of either family
+    char remote_ip[INET6_ADDRSTRLEN];
+
+    if (!inet_ntop(remote_addr.ss_family,
+                   get_in_addr((struct sockaddr *)&remote_addr), remote_ip,
+                   sizeof(remote_ip))) {
+      error("Failed to get string representation of remote address");
+    }
+
+    info("New connection from %s on socket %d", remote_ip, client_fd);
+
+    client_conn *c = malloc_s(sizeof(client_conn));
+    memset(c, 0, sizeof(client_conn));
+    c->ep.kind = EP_CLIENT;
+    c->ep.fd = client_fd;
+    c->id = id;
+    admission_peer(client_fd, &c->peer);
+    c->state = CLIENT_READING;
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c};
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+      perrno("Could not watch socket %d", client_fd);
+      client_close(r, c);
+    }
+  }
+}
+
+// Advance a client through its states for as long as that does not block.
+// Return false if the client was closed.
+static bool client_progress(reactor *r, client_conn *c) {
+  while (true) {
+    switch (c->state) {
+    case CLIENT_FETCHING:
+      // Resumed by the upstream request
+      return true;
+
+    case CLIENT_READING: {
+      // A request that fails right away advances the client from within,
+      // which may close it, so it must not be touched again then
+      size_t frame_len = client_frame_len(c);
+      if (frame_len > 0) {
+        client_start_command(r, c, frame_len);
+        if (c->ep.closed) {
+          return false;
+        }
+        continue;
+      }
+
+      ssize_t bytes_rx = recv(c->ep.fd, c->cmd_buf + c->cmd_len,
+                              CMD_BUF_LEN - c->cmd_len, 0);
+      if (bytes_rx > 0) {
+        metrics_count_rx(PEER_CLIENT, bytes_rx);
+        c->cmd_len += bytes_rx;
+        continue;
+      }
+      if (bytes_rx < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+      }
+      if (bytes_rx < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes_rx < 0) {
+        perrno("recv error");
+        metrics_count_error(ERR_CLIENT_IO);
+      }
+
+      client_close(r, c);
+      return false;
+    }
+
+    case CLIENT_WRITING: {
+      ssize_t bytes_tx = send(c->ep.fd, c->out->data + c->out_sent,
+                              c->out->len - c->out_sent, MSG_NOSIGNAL);
+      if (bytes_tx < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+      }
+      if (bytes_tx < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes_tx < 0) {
+        perrno("send error");
+        metrics_count_error(ERR_CLIENT_IO);
+        client_close(r, c);
+        return false;
+      }
+
+      debug("sent %ld bytes", bytes_tx);
+      metrics_count_tx(PEER_CLIENT, bytes_tx);
+      c->out_sent += bytes_tx;
+
+      // Response sent, move on to the next command
+      if (c->out_sent == c->out->len) {
+        buffer_unref(c->out);
+        c->out = NULL;
+        c->state = CLIENT_READING;
+      }
+      continue;
+    }
+    }
+  }
+}
+
+// Length of the first command in the client's buffer, or 0 if it did not
+// arrive whole yet. Commands are 3 bytes, except batch commands, which last
+// until their '#'.
+static size_t client_frame_len(const client_conn *c) {
+  if (c->cmd_len < CMD_LEN) {
+    return 0;
+  }
+  if (c->cmd_buf[0] == BATCH_PREFIX) {
+    return batch_frame_len(c->cmd_buf, c->cmd_len);
+  }
+  return CMD_LEN;
+}
+
+// Handle the first command in the client's buffer, of `frame_len` bytes
+static void client_start_command(reactor *r, client_conn *c,
+                                 size_t frame_len) {
+  // We only want 3 bytes, in the form "xy#", where x and y are digits
+  char buf[CMD_LEN + 1];
+  memcpy(buf, c->cmd_buf, CMD_LEN);
+  buf[CMD_LEN] = '\0';
+
+  c->cmd_len -= frame_len;
+  memmove(c->cmd_buf, c->cmd_buf + frame_len, c->cmd_len);
+
+  info("cmd: %s", buf);
+  metrics_count_command();
+
+  // Batch commands are not implemented here, but they are skipped whole, so
+  // the commands after them are still understood
+  if (buf[0] == BATCH_PREFIX) {
+    metrics_count_error(ERR_NOT_IMPLEMENTED);
+    client_respond_message(r, c, make_error_message("Command not implemented"));
+    return;
+  }
+
+  int cmd = atoi(buf);
+
+  if (is_stats_command(buf)) {
+    size_t len;
+    char *text = metrics_render(&len);
+    client_respond(r, c, buffer_wrap(text, len));
+    return;
+  }
+
+  // Protocol v2 is not implemented here, so its handshake is rejected too
+  if (!is_valid_command(buf)) {
+    metrics_count_error(ERR_BAD_REQUEST);
+    client_respond_message(r, c, make_error_message("Command not implemented"));
+    return;
+  }
+
+  int dest = map_command(cmd);
+  if (dest < 0) {
+    metrics_count_error(ERR_NOT_IMPLEMENTED);
+    client_respond_message(r, c, make_error_message("Command not implemented"));
+  } else if (!admission_allow(&c->peer)) {
+    client_respond(r, c, busy_response().buf);
+  } else {
+    upstream_start(r, c, dest);
+  }
+}
+
+// Queue `response` to be sent to the client, which takes ownership of it
+static void client_respond(reactor *r, client_conn *c, buffer *response) {
+  c->out = response;
+  c->out_sent = 0;
+  c->state = CLIENT_WRITING;
+}
+
+// Queue a null-terminated message to be sent to the client
+static void client_respond_message(reactor *r, client_conn *c, char *message) {
+  client_respond(r, c, message_response(message).buf);
+}
+
+// Close a client connection together with its pending upstream request
+static void client_close(reactor *r, client_conn *c) {
+  debug("Closing connection");
+
+  if (c->up) {
+    upstream_close(r, c->up);
+  }
+
+  registry_remove(&CONNECTIONS, c->id);
+  metrics_connection_closed();
+  check(close(c->ep.fd), "close");
+  admission_close_connection();
+  if (c->out) {
+    buffer_unref(c->out);
+  }
+
+  retire(r, &c->ep);
+}
+
+// Start the request for destination `dest` on behalf of client `c`
+static void upstream_start(reactor *r, client_conn *c, int dest) {
+  uint64_t id;
+  char *host = config_destination(dest, &id);
+  if (host == NULL) {
+    client_respond_message(r, c,
+                           make_error_message("Command not implemented\n"));
+    return;
+  }
+
+  // Past MAX_INFLIGHT, the client is told the server is busy
+  if (!admission_begin_fetch()) {
+    free(host);
+    client_respond(r, c, busy_response().buf);
+    return;
+  }
+
+  upstream *up = malloc_s(sizeof(upstream));
+  memset(up, 0, sizeof(upstream));
+  up->ep.kind = EP_UPSTREAM;
+  up->ep.fd = -1;
+  up->state = UPSTREAM_RESOLVING;
+  up->owner = c;
+  up->host = host;
+  up->started = metrics_now();
+  up->phase_start = up->started;
+  up->deadline = request_deadline();
+  rxbuf_init(&up->rx);
+
+  c->up = up;
+  c->state = CLIENT_FETCHING;
+  timer_push(r, up);
+
+  // Only a lookup the cache cannot answer leaves the loop
+  struct addrinfo *res;
+  int status;
+  if (dns_cached(host, HTTP_SERVICE, AF_FAMILY, &res, &status)) {
+    upstream_connect(r, up, res, status);
+    return;
+  }
+
+  up->lookup = resolver_start(host, HTTP_SERVICE, AF_FAMILY, r->resolved_wr);
+  up->lookup->owner = up;
+}
+
+// Connect an upstream request to the first of the addresses `res` its host
+// resolved to, or fail it with the error `status` of `getaddrinfo` if there
+// are none. Takes ownership of `res`.
+static void upstream_connect(reactor *r, upstream *up, struct addrinfo *res,
+                             int status) {
+  metrics_observe(PHASE_DNS, up->phase_start);
+
+  // If no IP address was found, return error
+  if (res == NULL) {
+    error("getaddrinfo error: %s", gai_strerror(status));
+    upstream_fail(r, up,
+                  make_error_message("Could not find IP%s address for %s!\n",
+                                     IPV4 ? "v4" : "v6", up->host));
+    return;
+  }
+
+  up->state = UPSTREAM_CONNECTING;
+  up->phase_start = metrics_now();
+
+  int sockfd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+                      res->ai_protocol);
+  if (sockfd < 0) {
+    free_ip_addrinfo(res);
+    upstream_fail(r, up, make_error_message("Could not create socket!\n"));
+    return;
+  }
+
+  int connect_resp = connect(sockfd, res->ai_addr, res->ai_addrlen);
+  free_ip_addrinfo(res);
+
+  if (connect_resp < 0 && errno != EINPROGRESS) {
+    check(close(sockfd), "close");
+    upstream_fail(r, up,
+                  make_error_message("Could not connect to %s!\n", up->host));
+    return;
+  }
+
+  up->ep.fd = sockfd;
+  if (connect_resp == 0) {
+    up->state = UPSTREAM_SENDING;
+  }
+
+  struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = up};
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+    upstream_fail(r, up, make_error_message("Could not watch socket!\n"));
+    return;
+  }
+
+  // Connected right away, the request can be sent
+  if (up->state == UPSTREAM_SENDING) {
+    metrics_observe(PHASE_CONNECT, up->phase_start);
+    upstream_progress(r, up);
+  }
+}
+
+// Connect the upstream requests whose resolution finished. Requests that
+// were given up on in the meantime only release it.
+static void take_resolutions(reactor *r) {
+  resolution *lookup;
+
+  while (true) {
+    ssize_t bytes = read(r->resolved.fd, &lookup, sizeof(lookup));
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perrno("Could not read the resolver pipe");
+      }
+      return;
+    }
+
+    upstream *up = lookup->owner;
+    if (up) {
+      int status;
+      struct addrinfo *res = resolver_take(lookup, &status);
+      up->lookup = NULL;
+      resolver_release(lookup);
+      upstream_connect(r, up, res, status);
+    }
+
+    // The reference of the resolver thread came with it
+    resolver_release(lookup);
+  }
+}
+
+// Advance an upstream request for as long as that does not block
+static void upstream_progress(reactor *r, upstream *up) {
+  while (true) {
+    switch (up->state) {
+    case UPSTREAM_RESOLVING:
+      // Resumed by `take_resolutions`
+      return;
+
+    case UPSTREAM_CONNECTING: {
+      int err = 0;
+      socklen_t err_len = sizeof(err);
+      getsockopt(up->ep.fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+
+      if (err != 0) {
+        errno = err;
+        upstream_fail(r, up,
+                      make_error_message("Could not connect to %s!\n",
+                                         up->host));
+        return;
+      }
+
+      debug("Connection established");
+      metrics_observe(PHASE_CONNECT, up->phase_start);
+      up->state = UPSTREAM_SENDING;
+      continue;
+    }
+
+    case UPSTREAM_SENDING: {
+      size_t req_len = strlen(HTTP_REQUEST);
+      ssize_t bytes_tx = send(up->ep.fd, HTTP_REQUEST + up->req_sent,
+                              req_len - up->req_sent, MSG_NOSIGNAL);
+      if (bytes_tx < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                           errno == ENOTCONN)) {
+        return;
+      }
+      if (bytes_tx < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes_tx < 0) {
+        upstream_fail(r, up,
+                      make_error_message("Sending HTTP request failed!\n"));
+        return;
+      }
+
+      metrics_count_tx(PEER_UPSTREAM, bytes_tx);
+      up->req_sent += bytes_tx;
+      if (up->req_sent == req_len) {
+        up->state = UPSTREAM_RECEIVING;
+        up->phase_start = metrics_now();
+      }
+      continue;
+    }
+
+    case UPSTREAM_RECEIVING: {
+      ssize_t bytes_rx = rxbuf_recv(&up->rx, up->ep.fd, 0);
+      if (bytes_rx < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+      }
+      if (bytes_rx < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes_rx < 0) {
+        upstream_fail(r, up, make_error_message("Received empty response\n"));
+        return;
+      }
+
+      if (bytes_rx > 0) {
+        debug("received %ld bytes", bytes_rx);
+        metrics_count_rx(PEER_UPSTREAM, bytes_rx);
+
+        // The first bytes end the wait, the rest is the transfer
+        if (up->rx.len == (size_t)bytes_rx) {
+          metrics_observe(PHASE_FIRST_BYTE, up->phase_start);
+          up->phase_start = metrics_now();
+        }
+
+        continue;
+      }
+
+      // The remote has closed the connection, the response is complete
+      info("Remote has closed the connection on fd %d", up->ep.fd);
+      metrics_observe(PHASE_TRANSFER, up->phase_start);
+      metrics_observe(PHASE_TOTAL, up->started);
+      // Leave room for the newline added to the response
+      rxbuf_reserve(&up->rx, 1);
+      size_t bytes = up->rx.len;
+      char *buf = rxbuf_detach(&up->rx);
+
+      client_conn *c = up->owner;
+      http_response res = handle_http_response(up->host, buf, bytes);
+      upstream_close(r, up);
+
+      client_respond(r, c, res.buf);
+      client_progress(r, c);
+      return;
+    }
+    }
+  }
+}
+
+// Fail an upstream request, answering its client with `error_resp`
+static void upstream_fail(reactor *r, upstream *up, char *error_resp) {
+  perrno(error_resp);
+  metrics_count_error(up->state == UPSTREAM_RESOLVING    ? ERR_DNS
+                      : up->state == UPSTREAM_CONNECTING ? ERR_CONNECT
+                                                         : ERR_UPSTREAM);
+  upstream_abort(r, up, error_resp);
+}
+
+// Give up on an upstream request whose failure was already counted, answering
+// its client with `error_resp`
+static void upstream_abort(reactor *r, upstream *up, char *error_resp) {
+  metrics_observe(PHASE_TOTAL, up->started);
+
+  client_conn *c = up->owner;
+  upstream_close(r, up);
+
+  client_respond_message(r, c, error_resp);
+  client_progress(r, c);
+}
+
+// Close an upstream request and detach it from its client
+static void upstream_close(reactor *r, upstream *up) {
+  timer_remove(r, up);
+  if (up->lookup) {
+    // The resolution is let go, its result is ignored when it arrives
+    up->lookup->owner = NULL;
+    resolver_release(up->lookup);
+  } else if (up->ep.fd >= 0) {
+    check(close(up->ep.fd), "Could not close buffer");
+  }
+  rxbuf_free(&up->rx);
+  free(up->host);
+
+  up->owner->up = NULL;
+  retire(r, &up->ep);
+  admission_end_fetch();
+}
+
+// Add an upstream request to the end of the pending list. Every request gets
+// the same time from its start, so the list stays sorted by deadline.
+static void timer_push(reactor *r, upstream *up) {
+  up->prev = r->tail;
+  up->next = NULL;
+
+  if (r->tail) {
+    r->tail->next = up;
+  } else {
+    r->head = up;
+  }
+  r->tail = up;
+}
+
+// Remove an upstream request from the pending list, if it is in it
+static void timer_remove(reactor *r, upstream *up) {
+  if (up->prev) {
+    up->prev->next = up->next;
+  } else if (r->head == up) {
+    r->head = up->next;
+  }
+
+  if (up->next) {
+    up->next->prev = up->prev;
+  } else if (r->tail == up) {
+    r->tail = up->prev;
+  }
+
+  up->prev = up->next = NULL;
+}
+
+// Fail every upstream request whose deadline has passed
+static void expire_upstreams(reactor *r) {
+  uint64_t t = monotonic_ms();
+
+  while (r->head && r->head->deadline <= t) {
+    upstream *up = r->head;
+    upstream_abort(r, up, deadline_error(up->host));
+  }
+}
+
+// Mark an endpoint as closed, to be freed after the current batch of events
+static void retire(reactor *r, endpoint *ep) {
+  ep->closed = true;
+  ep->next_closed = r->closed;
+  r->closed = ep;
+}
+
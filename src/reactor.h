@@ -0,0 +1 @@
+int run_reactor(int);
@@ -0,0 +1,148 @@
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "registry.h"
+#include "shared.h"
+
+// Slots of a new registry, doubled whenever they are all taken
+#define REGISTRY_INITIAL_CAPACITY 64
+// End of the list of free slots
+#define NO_SLOT UINT32_MAX
+
+static void grow(conn_registry *);
+
+// Initialise an empty registry
+void registry_init(conn_registry *reg) {
+  pthread_mutex_init(&reg->lock, NULL);
+
+  // Deadlines are given on the monotonic clock
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&reg->empty, &attr);
+  pthread_condattr_destroy(&attr);
+
+  reg->slots = NULL;
+  reg->capacity = reg->count = 0;
+  reg->free_head = NO_SLOT;
+}
+
+// Register the connection `fd`, and return its handle
+conn_id registry_add(conn_registry *reg, int fd) {
+  pthread_mutex_lock(&reg->lock);
+
+  if (reg->free_head == NO_SLOT) {
+    grow(reg);
+  }
+
+  uint32_t index = reg->free_head;
+  conn_slot *slot = &reg->slots[index];
+  reg->free_head = slot->next_free;
+  slot->fd = fd;
+  reg->count++;
+
+  conn_id id = (conn_id)index << 32 | slot->generation;
+
+  pthread_mutex_unlock(&reg->lock);
+  return id;
+}
+
+// Remove the connection `id`, which must happen before its socket is closed,
+// so the number cannot be reused by another socket while it is registered.
+// Returns the socket, or -1 if `id` was already removed.
+int registry_remove(conn_registry *reg, conn_id id) {
+  uint32_t index = id >> 32, generation = id;
+  int fd = -1;
+
+  pthread_mutex_lock(&reg->lock);
+
+  conn_slot *slot = index < reg->capacity ? &reg->slots[index] : NULL;
+  if (slot && slot->generation == generation && slot->fd >= 0) {
+    fd = slot->fd;
+    slot->fd = -1;
+    slot->generation++;
+    slot->next_free = reg->free_head;
+    reg->free_head = index;
+
+    if (--reg->count == 0) {
+      pthread_cond_broadcast(&reg->empty);
+    }
+  }
+
+  pthread_mutex_unlock(&reg->lock);
+  return fd;
+}
+
+// Socket of the connection `id`, or -1 if it was removed
+int registry_fd(conn_registry *reg, conn_id id) {
+  uint32_t index = id >> 32, generation = id;
+  int fd = -1;
+
+  pthread_mutex_lock(&reg->lock);
+  if (index < reg->capacity && reg->slots[index].generation == generation) {
+    fd = reg->slots[index].fd;
+  }
+  pthread_mutex_unlock(&reg->lock);
+
+  return fd;
+}
+
+// Number of registered connections
+size_t registry_count(conn_registry *reg) {
+  pthread_mutex_lock(&reg->lock);
+  size_t count = reg->count;
+  pthread_mutex_unlock(&reg->lock);
+
+  return count;
+}
+
+// Shut down every registered connection in direction `how` (SHUT_RD, SHUT_WR
+// or SHUT_RDWR). Their sockets stay open, for their threads to close.
+void registry_shutdown_all(conn_registry *reg, int how) {
+  pthread_mutex_lock(&reg->lock);
+
+  for (uint32_t i = 0; i < reg->capacity; i++) {
+    if (reg->slots[i].fd >= 0) {
+      shutdown(reg->slots[i].fd, how);
+    }
+  }
+
+  pthread_mutex_unlock(&reg->lock);
+}
+
+// Wait until every connection was removed, or until `deadline` on the
+// monotonic clock. Returns whether the registry is empty.
+bool registry_wait_empty(conn_registry *reg, time_t deadline) {
+  struct timespec ts = {deadline, 0};
+
+  pthread_mutex_lock(&reg->lock);
+
+  while (reg->count > 0) {
+    if (pthread_cond_timedwait(&reg->empty, &reg->lock, &ts) != 0) {
+      break;
+    }
+  }
+  bool empty = reg->count == 0;
+
+  pthread_mutex_unlock(&reg->lock);
+  return empty;
+}
+
+// Double the number of slots, adding the new ones to the free list. Handles
+// hold indices rather than pointers, so moving the slots is safe.
+static void grow(conn_registry *reg) {
+  uint32_t old = reg->capacity;
+  uint32_t capacity = old ? 2 * old : REGISTRY_INITIAL_CAPACITY;
+
+  reg->slots = realloc_s(reg->slots, capacity * sizeof(conn_slot));
+
+  // Link the new slots in order, ahead of the (empty) free list
+  for (uint32_t i = old; i < capacity; i++) {
+    reg->slots[i].fd = -1;
+    reg->slots[i].generation = 0;
+    reg->slots[i].next_free = i + 1 < capacity ? i + 1 : reg->free_head;
+  }
+
+  reg->free_head = old;
+  reg->capacity = capacity;
+}
@@ -0,0 +1,43 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Handle of a registered connection: the slot it occupies in the upper half
+// and the generation of that slot in the lower half. A slot changes generation
+// whenever it is freed, so a stale handle never matches a newer connection.
+typedef uint64_t conn_id;
+
+typedef struct {
+  // Socket of the connection, or -1 if the slot is free
+  int fd;
+  uint32_t generation;
+  // Next free slot, if this one is free
+  uint32_t next_free;
+} conn_slot;
+
+// Table of open client connections, with O(1) registration and removal
+typedef struct {
+  pthread_mutex_t lock;
+  // Signalled whenever the last connection is removed
+  pthread_cond_t empty;
+  conn_slot *slots;
+  uint32_t capacity;
+  uint32_t count;
+  // First free slot, linked through `next_free`
+  uint32_t free_head;
+} conn_registry;
+
+void registry_init(conn_registry *);
+conn_id registry_add(conn_registry *, int);
+int registry_remove(conn_registry *, conn_id);
+int registry_fd(conn_registry *, conn_id);
+size_t registry_count(conn_registry *);
+void registry_shutdown_all(conn_registry *, int);
+bool registry_wait_empty(conn_registry *, time_t);
+
+#endif
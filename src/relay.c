@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "config.h"
+#include "metrics.h"
+#include "relay.h"
+#include "shared.h"
+
+// Size of the buffer receiving the headers. The body that arrives with them is
+// relayed from it too, everything after goes through pipes.
+#define RELAY_HEADER_LEN 8192
+// Most bytes moved from the remote per splice, the default capacity of a pipe
+#define RELAY_CHUNK 65536
+
+static bool STREAM = false;
+static pthread_once_t relay_once = PTHREAD_ONCE_INIT;
+
+static void relay_init(void);
+static bool splice_all(int, int, size_t);
+static bool relay_body(int, int, int, uint64_t);
+
+// Whether responses are streamed to clients as they arrive, which is enabled
+// by the env var STREAM=1
+bool relay_enabled(void) {
+  pthread_once(&relay_once, relay_init);
+  return STREAM;
+}
+
+// Request destination `dest` and stream the response to `client_fd` while it
+// arrives, saving its content to `{host}.html` at the same time.
+//
+// Only the headers are copied through userspace. The body is spliced from the
+// remote into a pipe, duplicated with tee into a second pipe, and spliced from
+// those into the client socket and the file, so memory use does not depend on
+// the size of the page.
+//
+// The whole response has to arrive within REQUEST_TIMEOUT_MS, like those of
+// `client`.
+void relay_response(int dest, int client_fd) {
+  debug("Starting relay...\n");
+  uint64_t deadline = request_deadline();
+
+  // Copy the hostname, so a reload cannot free it during the relay
+  uint64_t id;
+  char *host = config_destination(dest, &id);
+
+  // Short-circuit for unknown commands
+  if (host == NULL) {
+    char *error_resp = make_error_message("Command not implemented\n");
+    send_all(client_fd, error_resp, strlen(error_resp));
+    free(error_resp);
+    return;
+  }
+
+  char *error_resp = NULL;
+
+  int sockfd = connect_to_host(host, deadline, &error_resp);
+  if (sockfd < 0) {
+    send_all(client_fd, error_resp, strlen(error_resp));
+    free(error_resp);
+    free(host);
+    return;
+  }
+
+  // Send HTTP request
+  debug("Sending HTTP request '%s'...", HTTP_REQUEST);
+  check(send(sockfd, HTTP_REQUEST, strlen(HTTP_REQUEST), MSG_NOSIGNAL),
+        "Sending HTTP request failed!");
+
+  // Receive until the end of the headers
+  char head[RELAY_HEADER_LEN + 1];
+  size_t head_len = 0;
+  char *delimiter = NULL;
+
+  while (!delimiter && head_len < RELAY_HEADER_LEN) {
+    if (wait_until(sockfd, POLLIN, deadline) <= 0) {
+      perrno("Could not receive from remote");
+      break;
+    }
+
+    long bytes_rx =
+        recv(sockfd, head + head_len, RELAY_HEADER_LEN - head_len, 0);
+    if (bytes_rx <= 0) {
+      break;
+    }
+    metrics_count_rx(PEER_UPSTREAM, bytes_rx);
+
+    head_len += bytes_rx;
+    delimiter = memmem(head, head_len, "\r\n\r\n", 4);
+  }
+
+  // Whatever we got is passed on, there is just no content to save without
+  // the end of the headers
+  if (!delimiter) {
+    error("Could not save file because there was no HTML");
+    send_all(client_fd, head, head_len);
+    send_all(client_fd, "\n", 1);
+    check(close(sockfd), "Could not close buffer");
+    free(host);
+    return;
+  }
+
+  // Print headers
+  size_t headers_len = delimiter - head;
+  debug("\n%.*s\n", (int)headers_len, head);
+
+  // Save content to `{host}.html`
+  char *filename = malloc_s(strlen(host) + 6); // ".html\0"
+  sprintf(filename, "%s.html", host);
+  free(host);
+
+  // Written to a temporary file first, so a relay that fails midway does not
+  // leave a truncated page behind
+  char *temp_name;
+  int file_fd = open_temp_file(filename, &temp_name);
+
+  // The headers and the start of the body came in through `head`
+  size_t body_start = headers_len + 4;
+  send_all(client_fd, head, head_len);
+  metrics_count_tx(PEER_CLIENT, head_len);
+  bool saved = true;
+  if (file_fd >= 0 &&
+      write(file_fd, head + body_start, head_len - body_start) < 0) {
+    perrno("File writing");
+    saved = false;
+  }
+
+  saved = relay_body(sockfd, client_fd, file_fd, deadline) && saved;
+
+  // Newline, like the buffered responses
+  send_all(client_fd, "\n", 1);
+
+  if (file_fd >= 0 && finish_temp_file(file_fd, temp_name, filename, saved)) {
+    debug("Saved file to %s\n", filename);
+  }
+  free(filename);
+  check(close(sockfd), "Could not close buffer");
+}
+
+// Read the configuration from the environment
+static void relay_init(void) { STREAM = getenv("STREAM") != NULL; }
+
+// Move the rest of the body from `sockfd` to `client_fd` and `file_fd`, until
+// the remote closes the connection or `deadline` passes. Without a file, the
+// body only goes to the client. Return false if the relay stopped early.
+static bool relay_body(int sockfd, int client_fd, int file_fd,
+                       uint64_t deadline) {
+  int to_client[2], to_file[2];
+
+  if (pipe2(to_client, O_CLOEXEC) < 0) {
+    perrno("Could not create pipe");
+    return false;
+  }
+  if (pipe2(to_file, O_CLOEXEC) < 0) {
+    perrno("Could not create pipe");
+    close(to_client[0]);
+    close(to_client[1]);
+    return false;
+  }
+
+  bool ok = true;
+
+  while (ok) {
+    if (wait_until(sockfd, POLLIN, deadline) <= 0) {
+      perrno("Could not receive from remote");
+      ok = false;
+      break;
+    }
+
+    long bytes_rx = splice(sockfd, NULL, to_client[1], NULL, RELAY_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (bytes_rx < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_rx < 0) {
+      perrno("Could not receive from remote");
+      ok = false;
+      break;
+    }
+
+    // When we receive 0 bytes, the server has closed the connection
+    if (bytes_rx == 0) {
+      info("Remote has closed the connection on fd %d", sockfd);
+      break;
+    }
+
+    debug("received %ld bytes", bytes_rx);
+    metrics_count_rx(PEER_UPSTREAM, bytes_rx);
+
+    if (file_fd < 0) {
+      ok = splice_all(to_client[0], client_fd, bytes_rx);
+      metrics_count_tx(PEER_CLIENT, ok ? bytes_rx : 0);
+      continue;
+    }
+
+    // tee duplicates the pipe's pages without consuming them. The second pipe
+    // is empty, so it usually takes everything at once.
+    size_t left = bytes_rx;
+    while (ok && left > 0) {
+      long teed = tee(to_client[0], to_file[1], left, 0);
+      if (teed < 0 && errno == EINTR) {
+        continue;
+      }
+      if (teed <= 0) {
+        perrno("Could not duplicate the response");
+        ok = false;
+        break;
+      }
+
+      ok = splice_all(to_client[0], client_fd, teed) &&
+           splice_all(to_file[0], file_fd, teed);
+      metrics_count_tx(PEER_CLIENT, ok ? teed : 0);
+      left -= teed;
+    }
+  }
+
+  close(to_client[0]);
+  close(to_client[1]);
+  close(to_file[0]);
+  close(to_file[1]);
+
+  return ok;
+}
+
+// Move exactly `len` bytes from the pipe `pipe_fd` to `out_fd`
+static bool splice_all(int pipe_fd, int out_fd, size_t len) {
+  while (len > 0) {
+    long bytes_tx =
+        splice(pipe_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (bytes_tx < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_tx <= 0) {
+      perrno("Could not relay the response");
+      return false;
+    }
+
+    debug("sent %ld bytes", bytes_tx);
+    len -= bytes_tx;
+  }
+
+  return true;
+}
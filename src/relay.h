@@ -0,0 +1,9 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+
+bool relay_enabled(void);
+void relay_response(int, int);
+
+#endif
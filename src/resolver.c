@@ -0,0 +1,123 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "dns_cache.h"
+#include "resolver.h"
+#include "shared.h"
+
+static void *resolve(void *);
+
+// Start resolving the addresses of `family` of `host` through the DNS cache,
+// on a thread of its own. Once done, a pointer to the resolution is written
+// to `notify_fd`, unless it is -1, and the reference of the thread goes with
+// it, to be released by whoever reads it. The caller holds the other
+// reference.
+resolution *resolver_start(const char *host, const char *service, int family,
+                           int notify_fd) {
+  resolution *l = malloc_s(sizeof(resolution));
+  pthread_mutex_init(&l->lock, NULL);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&l->resolved, &attr);
+  pthread_condattr_destroy(&attr);
+
+  l->refs = 2;
+  l->host = malloc_s(strlen(host) + 1);
+  strcpy(l->host, host);
+  l->service = service;
+  l->family = family;
+  l->res = NULL;
+  l->status = 0;
+  l->done = false;
+  l->notify_fd = notify_fd;
+  l->owner = NULL;
+
+  pthread_t t;
+  if (pthread_create(&t, NULL, resolve, l) != 0) {
+    // Resolve it here instead
+    resolve(l);
+    return l;
+  }
+  pthread_detach(t);
+
+  return l;
+}
+
+// Wait for a resolution to be done, up to `deadline`, a time from
+// `monotonic_ms`. Returns whether it is.
+bool resolver_wait(resolution *l, uint64_t deadline) {
+  pthread_mutex_lock(&l->lock);
+  while (!l->done && monotonic_ms() < deadline) {
+    struct timespec ts = {deadline / 1000, deadline % 1000 * 1000000};
+    pthread_cond_timedwait(&l->resolved, &l->lock, &ts);
+  }
+  bool done = l->done;
+  pthread_mutex_unlock(&l->lock);
+
+  return done;
+}
+
+// Take the addresses a finished resolution found, which the caller has to
+// release with `free_ip_addrinfo`, or NULL with the error of `getaddrinfo` in
+// `status`
+struct addrinfo *resolver_take(resolution *l, int *status) {
+  pthread_mutex_lock(&l->lock);
+  struct addrinfo *res = l->res;
+  l->res = NULL;
+  *status = l->status;
+  pthread_mutex_unlock(&l->lock);
+
+  return res;
+}
+
+// Drop a reference to a resolution, freeing it with the last one
+void resolver_release(resolution *l) {
+  pthread_mutex_lock(&l->lock);
+  bool last = --l->refs == 0;
+  pthread_mutex_unlock(&l->lock);
+
+  if (!last) {
+    return;
+  }
+
+  if (l->res) {
+    free_ip_addrinfo(l->res);
+  }
+  pthread_mutex_destroy(&l->lock);
+  pthread_cond_destroy(&l->resolved);
+  free(l->host);
+  free(l);
+}
+
+// Resolve on the thread of a resolution, then hand it over
+static void *resolve(void *arg) {
+  resolution *l = arg;
+
+  int status;
+  struct addrinfo *res = dns_resolve(l->host, l->service, l->family, &status);
+
+  pthread_mutex_lock(&l->lock);
+  l->res = res;
+  l->status = status;
+  l->done = true;
+  pthread_cond_broadcast(&l->resolved);
+  pthread_mutex_unlock(&l->lock);
+
+  if (l->notify_fd < 0) {
+    resolver_release(l);
+    return NULL;
+  }
+
+  // Pointers are written whole, since they are smaller than PIPE_BUF
+  while (write(l->notify_fd, &l, sizeof(l)) < 0) {
+    if (errno != EINTR) {
+      perrno("Could not hand over the addresses of %s", l->host);
+      resolver_release(l);
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
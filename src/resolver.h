@@ -0,0 +1,34 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// A name resolution run on a thread of its own, so the caller does not block
+// on it. Freed once the caller and the thread released it.
+typedef struct {
+  pthread_mutex_t lock;
+  // Signalled once the resolution is done
+  pthread_cond_t resolved;
+  int refs;
+  char *host;
+  const char *service;
+  int family;
+  // Result, as returned by `dns_resolve`
+  struct addrinfo *res;
+  int status;
+  bool done;
+  // Pipe the resolution is written to once done, or -1
+  int notify_fd;
+  // Free for the caller to use, never touched by the thread
+  void *owner;
+} resolution;
+
+resolution *resolver_start(const char *, const char *, int, int);
+bool resolver_wait(resolution *, uint64_t);
+struct addrinfo *resolver_take(resolution *, int *);
+void resolver_release(resolution *);
+
+#endif
@@ -3,99 +3,248 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "admission.h"
+#include "cache.h"
 #include "client.h"
+#include "config.h"
+#include "encoding.h"
+#include "metrics.h"
+#include "pool.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "registry.h"
+#include "relay.h"
+#include "server.h"
 #include "shared.h"
-
-// Hold information about the active sockets
-typedef struct {
-  // Array of active socket descriptors
-  int *active_sockets;
-  // Number of active sockets
-  size_t socket_count;
-} resource_tracker;
-
-// Functions only used by the server
-void *handle_connection(void *);
-int get_listener_socket(void);
-void track_sock(resource_tracker *, int);
-void untrack_sock(resource_tracker *, int);
-void close_all_sockets(resource_tracker *);
-void int_handler(int);
+#include "snapshot.h"
+#include "writer.h"
 
 // Global variables
 const char PORT[] = "22034";
-const int ASSIGNED_COMMAND = 4;
-bool ALL_COMMANDS = false;
-bool LOCALHOST = false;
-resource_tracker tracker = {NULL, 0};
+conn_registry CONNECTIONS;
+int *LISTENERS = NULL;
+size_t LISTENER_COUNT = 0;
+atomic_bool DRAINING = false;
+thread_pool *POOL = NULL;
+thread_pool *FETCH_POOL = NULL;
+
+// Listening options, from the env vars REUSEPORT, LISTEN_IPV6 and BACKLOG
+static bool REUSEPORT = false;
+static bool LISTEN_IPV6 = false;
+static int BACKLOG = SOMAXCONN;
+// With THREAD_POOL=1, the epoll instance each listener's connections wait in
+// for commands
+static int *POLLERS = NULL;
+// Destinations of a batch command fetched at once, from BATCH_PARALLELISM
+static size_t BATCH_PARALLELISM = BATCH_DEFAULT_PARALLELISM;
+
+static void create_fetch_pool(void);
 
 // Main program, runs the server which accepts multiple connections and handles
 // them in parallel
 int main(int argc, char **argv) {
-  // Add signal handlers to gracefully close on exit
-  signal(SIGINT, int_handler);
-  signal(SIGTERM, int_handler);
-
-  printf("Starting IPv4 server...\n");
+  // SIGINT, SIGTERM and SIGHUP are handled by a thread of their own, so no
+  // code runs inside a signal handler. They have to be blocked before any
+  // other thread is created, because threads inherit the signal mask.
+  sigset_t signals;
+  handled_signals(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
-  // If env var ALL_COMMANDS=1 is present, enable all commands, instead of only
-  // ASSIGNED_COMMAND
-  ALL_COMMANDS = getenv("ALL_COMMANDS") != NULL;
+  registry_init(&CONNECTIONS);
 
-  // If env var LOCALHOST=1 is present, send a request to localhost instead of
-  // ASSIGNED_COMMAND
-  LOCALHOST = getenv("LOCALHOST") != NULL;
+  // Destinations and the options that can be reloaded with SIGHUP
+  config_init();
 
-  // Get a socket to listen for new connections
-  int sockfd = get_listener_socket();
-  if (sockfd < 0) {
-    perrno("Could not bind the listening socket");
+  pthread_t signal_thread;
+  if (pthread_create(&signal_thread, NULL, handle_signals, NULL) != 0) {
+    error("Could not start the signal handling thread");
     exit(1);
   }
+  pthread_detach(signal_thread);
+
+  // A client closing its connection early must not kill the server, the
+  // failed send is enough
+  signal(SIGPIPE, SIG_IGN);
+
+  REUSEPORT = getenv("REUSEPORT") != NULL;
+  LISTEN_IPV6 = getenv("LISTEN_IPV6") != NULL;
+  if (getenv("BACKLOG") != NULL && atoi(getenv("BACKLOG")) > 0) {
+    BACKLOG = atoi(getenv("BACKLOG"));
+  }
+  if (getenv("BATCH_PARALLELISM") != NULL &&
+      atoi(getenv("BATCH_PARALLELISM")) > 0) {
+    BATCH_PARALLELISM = atoi(getenv("BATCH_PARALLELISM"));
+  }
+
+  // One worker per core unless WORKERS says otherwise
+  size_t workers = pool_default_size();
+  if (getenv("WORKERS") != NULL && atoi(getenv("WORKERS")) > 0) {
+    workers = atoi(getenv("WORKERS"));
+  }
+
+  info("Starting %s server...", LISTEN_IPV6 ? "dual-stack IPv6" : "IPv4");
+
+  // Get the sockets to listen for new connections on: one, or with
+  // REUSEPORT=1 one per worker, sharing the port
+  LISTENER_COUNT = REUSEPORT ? workers : 1;
+  LISTENERS = malloc_s(LISTENER_COUNT * sizeof(int));
+  for (size_t i = 0; i < LISTENER_COUNT; i++) {
+    LISTENERS[i] = get_listener_socket(i);
+    if (LISTENERS[i] < 0) {
+      perrno("Could not bind the listening socket");
+      exit(1);
+    }
+  }
 
-  // Track the socket
-  track_sock(&tracker, sockfd);
+  // If env var METRICS_PORT is present, serve the metrics on that port
+  metrics_start_admin();
+
+  // If env var SNAPSHOT_FILE is present, warm the caches up from the previous
+  // run before serving, and keep saving them
+  snapshot_start();
+
+  // If env var THREAD_POOL=1 is present, hand connections to a fixed pool of
+  // workers. Sharded listeners each keep their connections on their worker.
+  if (getenv("THREAD_POOL") != NULL && getenv("EPOLL") == NULL) {
+    info("Using a pool of %zu workers", workers);
+    POOL = pool_create(workers, POOL_QUEUE_SIZE);
+    if (REUSEPORT) {
+      pool_pin_workers(POOL);
+    }
+
+    // Connections wait for commands in a poller of their listener, on its
+    // core, instead of holding a worker while idle
+    POLLERS = malloc_s(LISTENER_COUNT * sizeof(int));
+    for (size_t i = 0; i < LISTENER_COUNT; i++) {
+      POLLERS[i] = epoll_create1(EPOLL_CLOEXEC);
+      pthread_t t;
+      if (POLLERS[i] < 0 ||
+          pthread_create(&t, NULL, run_poller, (void *)(uintptr_t)i) != 0) {
+        perrno("Could not start the poller %zu", i);
+        exit(1);
+      }
+      if (REUSEPORT) {
+        pin_thread(t, i);
+      }
+      pthread_detach(t);
+    }
+  }
+
+  if (REUSEPORT) {
+    info("Accepting on %zu listeners, one per core", LISTENER_COUNT);
+    for (size_t i = 1; i < LISTENER_COUNT; i++) {
+      pthread_t t;
+      if (pthread_create(&t, NULL, run_shard, (void *)(uintptr_t)i) != 0) {
+        error("Could not start the accepting thread %zu", i);
+        exit(1);
+      }
+      pthread_detach(t);
+    }
+
+    run_shard((void *)(uintptr_t)0);
+  } else {
+    serve_listener(0);
+  }
+
+  return 0;
+}
+
+// Accept and serve the connections of listener `index`, on the core of the
+// same index, along with every thread started for them
+void *run_shard(void *arg) {
+  size_t index = (uintptr_t)arg;
+  pin_thread(pthread_self(), index);
+
+  serve_listener(index);
+  return NULL;
+}
+
+// Accept connections on listener `index` and serve them, until the server
+// exits. With env var EPOLL=1 they are multiplexed on the calling thread,
+// otherwise each is served by a thread of its own, or by the pool.
+void serve_listener(size_t index) {
+  int sockfd = LISTENERS[index];
+
+  if (getenv("EPOLL") != NULL) {
+    info("Using the epoll event loop");
+    exit(run_reactor(sockfd));
+  }
 
   // Get ready to accept a connection
   int client_fd;
   struct sockaddr_storage remote_addr;
-  socklen_t addr_size = sizeof(remote_addr);
+  socklen_t addr_size;
 
   while (true) {
     // Blocks until a connection is initiated
     debug("Accepting connection...");
-    client_fd =
-        check(accept(sockfd, (struct sockaddr *)&remote_addr, &addr_size),
-              "Could not accept connection");
+    addr_size = sizeof(remote_addr);
+    client_fd = accept(sockfd, (struct sockaddr *)&remote_addr, &addr_size);
+
+    if (client_fd < 0) {
+      // The listener was shut down to drain, the process exits once the
+      // connections are done. Returning would end it right away.
+      if (atomic_load(&DRAINING)) {
+        pthread_exit(NULL);
+      }
+
+      perrno("Could not accept connection");
+      continue;
+    }
+
+    // Past MAX_CONNECTIONS, new connections are told the server is busy and
+    // closed right away, without a thread or any memory of their own
+    if (!admission_open_connection()) {
+      admission_reject(client_fd);
+      continue;
+    }
 
-    // Add client_fd to tracker's active sockets
-    track_sock(&tracker, client_fd);
+    // Register the connection, so it can be drained on shutdown
+    conn_id id = registry_add(&CONNECTIONS, client_fd);
+    metrics_connection_opened();
 
-    // Get string representation of the client's IP
-    char remote_ipv4[INET_ADDRSTRLEN];
+    // Get string representation of the client's IP, of either family
+    char remote_ip[INET6_ADDRSTRLEN];
 
     if (!inet_ntop(remote_addr.ss_family,
-                   get_in_addr((struct sockaddr *)&remote_addr), remote_ipv4,
-                   INET_ADDRSTRLEN)) {
+                   get_in_addr((struct sockaddr *)&remote_addr), remote_ip,
+                   sizeof(remote_ip))) {
       error("Failed to get string representation of remote address");
     }
 
-    printf("New connection from %s on socket %d\n", remote_ipv4, client_fd);
+    info("New connection from %s on socket %d", remote_ip, client_fd);
+
+    // The pool serves the connection whenever commands arrive on it, and it
+    // waits in the poller of this listener in between
+    if (POOL) {
+      pooled_conn *pc = malloc_s(sizeof(pooled_conn));
+      pc->id = id;
+      pc->fd = client_fd;
+      pc->shard = index;
+      rxbuf_init(&pc->rb);
+      pc->s = (session){.v2 = false, .compression = false};
+      admission_peer(client_fd, &pc->s.peer);
+
+      watch_connection(pc, EPOLL_CTL_ADD);
+      continue;
+    }
 
     // Make a pthread to handle the connection in parallel with others
     pthread_t t;
-    // pthreads want the argument as void *, so we'll cast our fd. This will be
-    // freed in handle_connection
-    int *threadarg = malloc_s(sizeof(int));
-    *threadarg = client_fd;
+    // pthreads want the argument as void *, so we'll pass a pointer to the
+    // handle. This will be freed in handle_connection
+    conn_id *threadarg = malloc_s(sizeof(conn_id));
+    *threadarg = id;
     pthread_create(&t, NULL, handle_connection, threadarg);
 
     // Threads are on their own
@@ -104,73 +253,604 @@ int main(int argc, char **argv) {
     // isn't.
     pthread_detach(t);
   }
-
-  return 0;
 }
 
 // Handle connections initiated by clients. Can be used with pthreads.
-void *handle_connection(void *fd) {
+void *handle_connection(void *arg) {
   // Cast the argument to its proper type and free the memory
-  int client_fd = *(int *)fd;
-  free(fd);
+  conn_id id = *(conn_id *)arg;
+  free(arg);
+
+  serve_connection(id);
+
+  // Exit pthread
+  pthread_exit(0);
+  return NULL;
+}
 
+// Wait for commands on the connections of listener `index`, and queue each
+// connection that received some for the pool, on the worker pinned to the
+// same core with REUSEPORT=1. When every queue is full, the connection is
+// turned away rather than making the others wait.
+void *run_poller(void *arg) {
+  size_t index = (uintptr_t)arg;
+  struct epoll_event events[POLLER_EVENTS];
+
+  while (true) {
+    int n = epoll_wait(POLLERS[index], events, POLLER_EVENTS, -1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      perrno("Could not wait for commands");
+      exit(1);
+    }
+
+    for (int i = 0; i < n; i++) {
+      pooled_conn *pc = events[i].data.ptr;
+      bool queued =
+          REUSEPORT ? pool_try_submit_to(POOL, index, pool_connection_task, pc)
+                    : pool_try_submit(POOL, pool_connection_task, pc);
+
+      if (!queued) {
+        metrics_count_error(ERR_BUSY);
+        close_connection(pc->id, pc->fd, &pc->rb, true);
+        free(pc);
+      }
+    }
+  }
+}
+
+// Have the connection `pc` wait in its poller until commands arrive, adding
+// it with `op` EPOLL_CTL_ADD, or re-arming it with EPOLL_CTL_MOD. It is only
+// reported once, so a single worker serves it at a time, and it must not be
+// touched afterwards.
+void watch_connection(pooled_conn *pc, int op) {
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+                           .data.ptr = pc};
+
+  if (epoll_ctl(POLLERS[pc->shard], op, pc->fd, &ev) < 0) {
+    perrno("Could not watch socket %d", pc->fd);
+    close_connection(pc->id, pc->fd, &pc->rb, false);
+    free(pc);
+  }
+}
+
+// Serve the commands that arrived on a connection of the pool, then have it
+// wait for the next ones, or close it if the client disconnected
+void pool_connection_task(void *arg) {
+  pooled_conn *pc = arg;
+
+  if (serve_received(pc->fd, &pc->rb, &pc->s)) {
+    watch_connection(pc, EPOLL_CTL_MOD);
+    return;
+  }
+
+  close_connection(pc->id, pc->fd, &pc->rb, false);
+  free(pc);
+}
+
+// Serve commands on `client_fd` until the client disconnects, then close it.
+//
+// Commands are read into a buffer kept for the whole connection, so a single
+// `recv` picks up every command the client pipelined. Those are served
+// together, and their responses are sent back in order with one `writev`.
+void serve_connection(conn_id id) {
   debug("Connection accepted. Waiting for messages...");
 
-  char *buf = NULL, *response_buf = NULL;
+  int client_fd = registry_fd(&CONNECTIONS, id);
+
+  rx_buffer rb;
+  rxbuf_init(&rb);
+  // What the client negotiated so far
+  session s = {.v2 = false, .compression = false};
+  admission_peer(client_fd, &s.peer);
 
   // Keep connection open as long as the client is connected
-  while ((buf = recv_all(client_fd, 3)) && strlen(buf) != 0) {
-    // We only want 3 bytes, in the form "xy#", where x and y are digits
-    int cmd = atoi(buf);
-    printf("cmd: %s\n", buf);
-    free(buf); // Free buf after use
-
-    // If the server is configured to only respond to the assigned command, and
-    // the received command is not that, return "Command not implemented"
-    if (!ALL_COMMANDS && cmd != ASSIGNED_COMMAND) {
-      response_buf = make_error_message("Command not implemented");
-    } else {
-      // Use localhost (cmd 0) instead of ASSIGNED_COMMAND if LOCALHOST is true
-      if (LOCALHOST && cmd == ASSIGNED_COMMAND) {
-        cmd = 0;
-      }
-      // We receive allocated memory that we have to free
-      response_buf = client(cmd);
+  while (serve_received(client_fd, &rb, &s)) {
+  }
+
+  close_connection(id, client_fd, &rb, false);
+}
+
+// Receive what the client sent on `client_fd` with a single `recv` into `rb`,
+// and serve every complete command in it for the connection `s`. Returns
+// false once the client disconnected.
+bool serve_received(int client_fd, rx_buffer *rb, session *s) {
+  command batch[PIPELINE_MAX];
+
+  long bytes_rx = rxbuf_recv(rb, client_fd, PIPELINE_READ_LEN);
+  if (bytes_rx == 0) {
+    info("Remote has closed the connection on fd %d", client_fd);
+    return false;
+  }
+  if (bytes_rx < 0) {
+    perrno("Could not receive commands");
+    metrics_count_error(ERR_CLIENT_IO);
+    return false;
+  }
+
+  debug("received %ld bytes", bytes_rx);
+  metrics_count_rx(PEER_CLIENT, bytes_rx);
+
+  // We only want frames of 3 bytes, in the form "xy#", where x and y are
+  // digits, and batch commands up to their '#'. An incomplete frame is kept
+  // until the rest of it arrives.
+  size_t offset = 0;
+  bool incomplete = false;
+  while (!incomplete && rb->len - offset >= COMMAND_LEN) {
+    size_t n = 0;
+
+    for (; n < PIPELINE_MAX && rb->len - offset >= COMMAND_LEN &&
+           rb->data[offset] != BATCH_PREFIX;
+         n++) {
+      parse_command(&batch[n], rb->data + offset, s);
+      offset += COMMAND_LEN;
     }
 
-    // Send response
-    send_all(client_fd, response_buf, strlen(response_buf));
+    if (n > 0) {
+      serve_commands(client_fd, batch, n);
+    }
 
-    // Free dynamically allocated response_buf
-    free(response_buf);
+    // The commands before a batch command are answered first
+    if (rb->len - offset >= COMMAND_LEN && rb->data[offset] == BATCH_PREFIX) {
+      size_t len = batch_frame_len(rb->data + offset, rb->len - offset);
+      incomplete = len == 0;
+      if (!incomplete) {
+        serve_batch(client_fd, rb->data + offset, len, s);
+        offset += len;
+      }
+    }
   }
 
+  rxbuf_consume(rb, offset);
+  return true;
+}
+
+// Close the connection `id` on `client_fd`, whose commands were received into
+// `rb`, telling the client first that the server is too busy for it if
+// `busy`
+void close_connection(conn_id id, int client_fd, rx_buffer *rb, bool busy) {
   debug("Closing connection");
 
-  // Free buffer if recv_all returned non-NULL
-  if (buf) {
-    free(buf);
+  rxbuf_free(rb);
+
+  // Unregister the socket before closing it, so a drain never shuts down a
+  // socket that reused its number
+  registry_remove(&CONNECTIONS, id);
+  metrics_connection_closed();
+  if (busy) {
+    admission_reject(client_fd);
+  } else {
+    check(close(client_fd), "close");
   }
+  admission_close_connection();
+}
 
-  // Close buffer
-  check(close(client_fd), "close");
-  // Untrack socket
-  untrack_sock(&tracker, client_fd);
-  // Exit pthread
-  pthread_exit(0);
-  return NULL;
+// Parse the 3-byte command `frame` into `c`. The v2 handshake switches the
+// connection `s` to protocol v2 from that command on, and the compression
+// command has its compressed responses sent as they are from then on.
+void parse_command(command *c, const char *frame, session *s) {
+  info("cmd: %.*s", COMMAND_LEN, frame);
+  metrics_count_command();
+
+  c->dest = -1;
+  c->status = V2_OK;
+  c->flags = 0;
+  c->tag = 0;
+
+  if (is_v2_handshake(frame)) {
+    // Answered with an empty v2 response, which tells the client that the
+    // server understands v2. Servers that do not, reply in plain text.
+    s->v2 = true;
+    c->kind = CMD_HANDSHAKE;
+  } else if (is_compression_command(frame)) {
+    // Also answered with an empty response, after which the client gets the
+    // Content-Encoding the origin chose
+    s->compression = true;
+    c->kind = CMD_COMPRESSION;
+  } else if (is_stats_command(frame)) {
+    c->kind = CMD_STATS;
+  } else if (!is_valid_command(frame)) {
+    c->kind = CMD_REJECT;
+    c->status = V2_BAD_REQUEST;
+    metrics_count_error(ERR_BAD_REQUEST);
+  } else {
+    // Commands other than the assigned one get "Command not implemented",
+    // unless the server is configured to respond to all of them
+    c->dest = map_command(atoi(frame));
+    c->kind = c->dest < 0 ? CMD_REJECT : CMD_FETCH;
+    if (c->dest < 0) {
+      c->status = V2_NOT_IMPLEMENTED;
+      metrics_count_error(ERR_NOT_IMPLEMENTED);
+    } else if (!admission_allow(&s->peer)) {
+      // Clients over their rate limit are told right away
+      c->kind = CMD_BUSY;
+      c->status = V2_BUSY;
+    }
+  }
+
+  c->v2 = s->v2;
+  c->compression = s->compression;
 }
 
-// Return a listening socket or -1 in case of error
-int get_listener_socket(void) {
-  int listener, yes = 1, rv;
+// Serve `n` commands received together on `client_fd`, fetching their
+// responses concurrently and sending them in the order they were received
+void serve_commands(int client_fd, command *batch, size_t n) {
+  if (relay_enabled()) {
+    // Responses are sent while they arrive, so they have to come one by one.
+    // Protocol v2 needs the length up front, so those are buffered instead.
+    for (size_t i = 0; i < n; i++) {
+      if (batch[i].kind == CMD_FETCH && !batch[i].v2) {
+        // Past MAX_INFLIGHT, the client is told the server is busy instead
+        if (!admission_begin_fetch()) {
+          batch[i].kind = CMD_BUSY;
+        } else {
+          uint64_t start = metrics_now();
+          relay_response(batch[i].dest, client_fd);
+          admission_end_fetch();
+          metrics_observe(PHASE_TOTAL, start);
+          continue;
+        }
+      }
+
+      run_command(&batch[i]);
+      send_responses(client_fd, &batch[i], 1);
+    }
+    return;
+  }
+
+  // A single command is fetched right here, without involving the pool
+  void *args[PIPELINE_MAX];
+  for (size_t i = 0; i < n; i++) {
+    args[i] = &batch[i];
+  }
+  pool_run_all(n > 1 ? fetch_pool() : NULL, run_command, args, n);
+
+  send_responses(client_fd, batch, n);
+}
+
+// Serve the batch command `frame` of `len` bytes on `client_fd`, fetching the
+// destinations it names concurrently, at most BATCH_PARALLELISM at a time, so
+// a slow destination holds up only its own response.
+//
+// Protocol v2 responses are sent as soon as each is fetched, tagged with
+// their destination, and followed by an empty response flagged
+// V2_FLAG_BATCH_END. Protocol v1 has no room for a tag, so those are sent in
+// the order of their destinations instead, each as soon as it and the ones
+// before it are fetched.
+void serve_batch(int client_fd, const char *frame, size_t len, session *s) {
+  info("cmd: %.*s", (int)len, frame);
+  metrics_count_command();
+
+  bool selected[BATCH_DESTS], all;
+  if (!parse_batch_command(frame, len, selected, &all)) {
+    command c = {.kind = CMD_REJECT, .dest = -1, .v2 = s->v2,
+                 .status = V2_BAD_REQUEST};
+    metrics_count_error(ERR_BAD_REQUEST);
+    run_command(&c);
+    send_responses(client_fd, &c, 1);
+    return;
+  }
+
+  if (all) {
+    config_guard guard;
+    size_t dest_count = config_acquire(&guard)->dest_count;
+    config_release(&guard);
+
+    for (size_t i = 0; i < BATCH_DESTS; i++) {
+      selected[i] = i < dest_count;
+    }
+  }
+
+  batch_run run;
+  run.count = 0;
+  run.completed_count = 0;
+  pthread_mutex_init(&run.lock, NULL);
+  pthread_cond_init(&run.progress, NULL);
+
+  batch_task tasks[BATCH_DESTS];
+  for (int i = 0; i < BATCH_DESTS; i++) {
+    if (selected[i]) {
+      tasks[run.count] = (batch_task){&run, run.count};
+      batch_command(&run.commands[run.count++], i, s);
+    }
+  }
+
+  // Whether each command was fetched, and the next one to send, for v1
+  bool fetched[BATCH_DESTS] = {false};
+  size_t next = 0;
+
+  size_t started = 0, handled = 0;
+  pthread_mutex_lock(&run.lock);
+  while (handled < run.count) {
+    // Keep the pool fetching as many as allowed. When it has no free slot,
+    // the fetch runs right here instead of waiting for one.
+    while (started < run.count &&
+           started - run.completed_count < BATCH_PARALLELISM) {
+      pthread_mutex_unlock(&run.lock);
+      batch_task *task = &tasks[started++];
+      if (!pool_try_submit(fetch_pool(), run_batch_task, task)) {
+        run_batch_task(task);
+      }
+      pthread_mutex_lock(&run.lock);
+    }
+
+    while (run.completed_count == handled) {
+      pthread_cond_wait(&run.progress, &run.lock);
+    }
+    size_t completed = run.completed_count;
+    pthread_mutex_unlock(&run.lock);
+
+    for (; handled < completed; handled++) {
+      size_t i = run.completed[handled];
+      if (s->v2) {
+        send_responses(client_fd, &run.commands[i], 1);
+        continue;
+      }
+
+      fetched[i] = true;
+      for (; next < run.count && fetched[next]; next++) {
+        send_responses(client_fd, &run.commands[next], 1);
+      }
+    }
+
+    pthread_mutex_lock(&run.lock);
+  }
+  pthread_mutex_unlock(&run.lock);
+
+  pthread_mutex_destroy(&run.lock);
+  pthread_cond_destroy(&run.progress);
+
+  if (s->v2) {
+    command end = {.dest = -1, .v2 = true, .flags = V2_FLAG_BATCH_END};
+    end.response = message_response(make_error_message(""));
+    send_responses(client_fd, &end, 1);
+  }
+}
+
+// Set up `c` as the command of a batch for destination `index`, which is
+// rejected or turned away like the command "xy#" naming it would be
+void batch_command(command *c, int index, session *s) {
+  c->dest = map_command(index);
+  c->kind = c->dest < 0 ? CMD_REJECT : CMD_FETCH;
+  c->status = c->dest < 0 ? V2_NOT_IMPLEMENTED : V2_OK;
+  c->flags = 0;
+  c->tag = index;
+  c->v2 = s->v2;
+  c->compression = s->compression;
+
+  if (c->dest < 0) {
+    metrics_count_error(ERR_NOT_IMPLEMENTED);
+  } else if (!admission_allow(&s->peer)) {
+    c->kind = CMD_BUSY;
+    c->status = V2_BUSY;
+  }
+}
+
+// Fetch the response to a command of a batch, then tell the connection it can
+// be sent. A task of the fetch pool.
+void run_batch_task(void *arg) {
+  batch_task *task = arg;
+  batch_run *run = task->run;
+
+  run_command(&run->commands[task->index]);
+
+  pthread_mutex_lock(&run->lock);
+  run->completed[run->completed_count++] = task->index;
+  pthread_cond_signal(&run->progress);
+  pthread_mutex_unlock(&run->lock);
+}
+
+// Send the responses to `n` commands in order with a single `writev`, then
+// release them. Responses to v2 commands are preceded by their header.
+//
+// Compressed responses are sent as they are to clients that asked for them,
+// and decompressed on the way for the others.
+void send_responses(int client_fd, command *batch, size_t n) {
+  unsigned char headers[PIPELINE_MAX][V2_HEADER_LEN];
+  struct iovec iov[2 * PIPELINE_MAX];
+  size_t count = 0, total = 0, sent = 0;
+
+  // Send responses, straight from the buffers they were received into
+  for (size_t i = 0; i < n; i++) {
+    http_response *res = &batch[i].response;
+    buffer *buf = res->buf;
+    size_t len = buf->len;
+
+    // Content that cannot be decompressed is sent as it arrived
+    if (res->encoding != ENCODING_IDENTITY && !batch[i].compression &&
+        encoding_measure(res)) {
+      // Everything before it has to go first
+      sent += writev_all(client_fd, iov, count);
+      count = 0;
+
+      size_t expected;
+      sent += send_decompressed(client_fd, &batch[i], &expected);
+      total += expected;
+      continue;
+    }
+
+    if (res->encoding != ENCODING_IDENTITY && batch[i].compression) {
+      batch[i].flags |= V2_FLAG_COMPRESSED;
+      // Only known if a client that did not ask for compression needed it
+      if (res->plain_len > res->content_len) {
+        metrics_count_saved(PEER_CLIENT, res->plain_len - res->content_len);
+      }
+    }
+
+    if (batch[i].v2) {
+      len = v2_header(headers[i], batch[i].status, batch[i].flags,
+                      batch[i].tag, len);
+      iov[count++] = (struct iovec){headers[i], V2_HEADER_LEN};
+    }
+
+    iov[count++] = (struct iovec){buf->data, len};
+    total += (batch[i].v2 ? V2_HEADER_LEN : 0) + len;
+  }
+
+  sent += writev_all(client_fd, iov, count);
+  metrics_count_tx(PEER_CLIENT, sent);
+  if (sent < total) {
+    metrics_count_error(ERR_CLIENT_IO);
+  }
+
+  // Release the responses, which frees them unless the cache still holds them
+  for (size_t i = 0; i < n; i++) {
+    buffer_unref(batch[i].response.buf);
+  }
+}
+
+// Send the compressed response to `c` with its content decompressed, one chunk
+// at a time, so it is never held decompressed in memory. Returns the number of
+// bytes sent, and the number that should have been in `total`.
+size_t send_decompressed(int client_fd, command *c, size_t *total) {
+  http_response *res = &c->response;
+  size_t headers_len;
+  char *headers = encoding_plain_headers(res, &headers_len);
+
+  // The headers, the content and the newline that ends every response
+  unsigned char header[V2_HEADER_LEN];
+  size_t len = headers_len + res->plain_len + 1;
+  struct iovec iov[2];
+  size_t count = 0;
+
+  if (c->v2) {
+    len = v2_header(header, c->status, c->flags, c->tag, len);
+    iov[count++] = (struct iovec){header, V2_HEADER_LEN};
+  }
+  if (headers_len > len) {
+    headers_len = len;
+  }
+  iov[count++] = (struct iovec){headers, headers_len};
+  *total = (c->v2 ? V2_HEADER_LEN : 0) + len;
+
+  size_t sent = writev_all(client_fd, iov, count);
+  free(headers);
+  if (sent < (c->v2 ? V2_HEADER_LEN : 0) + headers_len) {
+    return sent;
+  }
+
+  // Room left for the content and the newline, less if it was truncated
+  size_t content = len - headers_len;
+  size_t content_sent = encoding_write_plain(client_fd, res, content);
+  sent += content_sent;
+  if (content_sent == res->plain_len && content > res->plain_len) {
+    send_all(client_fd, "\n", 1);
+    sent++;
+  }
+
+  return sent;
+}
+
+// Get the response to a command. Can be used as a task of the fetch pool.
+void run_command(void *arg) {
+  command *c = arg;
+  uint64_t start = metrics_now();
+
+  switch (c->kind) {
+  case CMD_HANDSHAKE:
+  case CMD_COMPRESSION:
+    c->response = message_response(make_error_message(""));
+    return;
+
+  case CMD_STATS: {
+    size_t len;
+    char *text = metrics_render(&len);
+    c->response = (http_response){buffer_wrap(text, len), 0, 0, 0};
+    return;
+  }
+
+  case CMD_REJECT:
+    c->response =
+        message_response(make_error_message("Command not implemented"));
+    return;
+
+  case CMD_BUSY:
+    c->response = busy_response();
+    return;
+
+  case CMD_FETCH:
+    break;
+  }
+
+  if (cache_enabled()) {
+    // Shared with the cache and with concurrent requests, no copy is made
+    bool hit;
+    c->response = cache_fetch(c->dest, &hit);
+    if (hit) {
+      c->flags |= V2_FLAG_CACHE_HIT;
+    }
+  } else {
+    // We receive allocated memory that we have to release
+    c->response = client(c->dest);
+  }
+
+  // Failures are reported with a message instead of an HTTP response
+  if (c->response.headers_len == 0) {
+    c->status =
+        is_busy_response(c->response) ? V2_BUSY : V2_UPSTREAM_ERROR;
+  }
+
+  metrics_observe(PHASE_TOTAL, start);
+}
+
+// Pool that fetches the responses to pipelined commands, created the first
+// time a client pipelines. It has `FETCH_WORKERS` threads, four per core by
+// default since they mostly wait on the network.
+thread_pool *fetch_pool(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, create_fetch_pool);
+  return FETCH_POOL;
+}
+
+// Create the pool of `fetch_pool`
+static void create_fetch_pool(void) {
+  size_t workers = 4 * pool_default_size();
+  if (getenv("FETCH_WORKERS") != NULL && atoi(getenv("FETCH_WORKERS")) > 0) {
+    workers = atoi(getenv("FETCH_WORKERS"));
+  }
+
+  debug("Using a pool of %zu workers for pipelined commands", workers);
+  FETCH_POOL = pool_create(workers, POOL_QUEUE_SIZE);
+}
+
+// Map a received command to the index of the destination the client should
+// request, or -1 if the server does not implement the command.
+int map_command(int cmd) {
+  config_guard guard;
+  const config *cfg = config_acquire(&guard);
+  int dest = cmd;
+
+  if (!cfg->all_commands && cmd != cfg->assigned_command) {
+    // If the server is configured to only respond to the assigned command,
+    // and the received command is not that, the command is not implemented
+    dest = -1;
+  } else if (cmd < 0 || (size_t)cmd >= cfg->dest_count) {
+    // There is nothing to request for commands past the last destination
+    dest = -1;
+  } else if (cfg->localhost && cmd == cfg->assigned_command) {
+    // Use localhost (cmd 0) instead of the assigned command if configured
+    dest = 0;
+  }
+
+  config_release(&guard);
+  return dest;
+}
+
+// Return listening socket `index` or -1 in case of error. With LISTEN_IPV6=1
+// it accepts IPv6 as well as IPv4 clients, and with REUSEPORT=1 every listener
+// binds the same port and the kernel spreads connections across them,
+// preferring the one whose index matches the core that received them.
+int get_listener_socket(size_t index) {
+  int listener, yes = 1, no = 0, rv;
 
   struct addrinfo hints, *ai, *p;
 
   // Zero-init hints
   memset(&hints, 0, sizeof hints);
-  // IPv4
-  hints.ai_family = AF_INET;
+  // IPv4, or IPv6 with IPv4 mapped into it
+  hints.ai_family = LISTEN_IPV6 ? AF_INET6 : AF_INET;
   // TCP socket
   hints.ai_socktype = SOCK_STREAM;
   // Fill in the address automatically and set the service literally
@@ -178,7 +858,7 @@ int get_listener_socket(void) {
 
   // Get address info (NULL -> localhost)
   if ((rv = getaddrinfo(NULL, PORT, &hints, &ai)) != 0) {
-    fprintf(stderr, "pollserver: %s\n", gai_strerror(rv));
+    error("pollserver: %s", gai_strerror(rv));
     exit(1);
   }
 
@@ -192,6 +872,18 @@ int get_listener_socket(void) {
     // Get the same port even after a restart of the server
     setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
+    if (LISTEN_IPV6) {
+      setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(int));
+    }
+
+    if (REUSEPORT) {
+      check(setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)),
+            "Could not share the listening port");
+      // Only a hint, so the listener works without it
+      int cpu = pool_cpu(index);
+      setsockopt(listener, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(int));
+    }
+
     // Bind to requested port
     if (bind(listener, p->ai_addr, p->ai_addrlen) < 0) {
       check(close(listener), "close");
@@ -209,49 +901,82 @@ int get_listener_socket(void) {
     return -1;
   }
 
-  // Listen
-  check(listen(listener, 10), "Could not start listening");
+  // Listen, with room for BACKLOG (default SOMAXCONN) connections that were
+  // not accepted yet
+  check(listen(listener, BACKLOG), "Could not start listening");
 
   return listener;
 }
 
-// Close all sockets in a resource_tracker struct
-void close_all_sockets(resource_tracker *tracker) {
-  for (size_t i = 0; i < tracker->socket_count; i++) {
-    check(close(tracker->active_sockets[i]), "close");
+// Set `signals` to the signals handled by `handle_signals`
+void handled_signals(sigset_t *signals) {
+  sigemptyset(signals);
+  sigaddset(signals, SIGINT);
+  sigaddset(signals, SIGTERM);
+  sigaddset(signals, SIGHUP);
+}
+
+// Wait for signals, and handle them outside of signal context. SIGHUP reloads
+// the configuration, SIGINT closes the server right away, and SIGTERM drains
+// it first.
+void *handle_signals(void *arg) {
+  sigset_t signals;
+  handled_signals(&signals);
+
+  int sig;
+  while (true) {
+    if (sigwait(&signals, &sig) != 0) {
+      continue;
+    }
+    if (sig != SIGHUP) {
+      break;
+    }
+
+    config_reload();
   }
 
-  free(tracker->active_sockets);
-  tracker->active_sockets = NULL;
-}
+  if (sig == SIGTERM) {
+    drain();
+  }
 
-// SIGINT handler
-void int_handler(int sig) {
-  close_all_sockets(&tracker);
-  printf("\nServer closed\n");
+  // Whatever is still open gets cut off; the sockets themselves are closed by
+  // the kernel on exit
+  registry_shutdown_all(&CONNECTIONS, SHUT_RDWR);
+  info("Server closed");
 
   exit(0);
 }
 
-// Track a socket inside a resource_tracker struct
-void track_sock(resource_tracker *tracker, int fd) {
-  tracker->active_sockets = realloc_s(
-      tracker->active_sockets, (tracker->socket_count + 1) * sizeof(int));
-  tracker->active_sockets[tracker->socket_count++] = fd;
-}
+// Stop accepting connections, and give the open ones up to DRAIN_TIMEOUT
+// seconds (default 10) to finish the commands they already sent
+void drain(void) {
+  time_t timeout = DRAIN_TIMEOUT;
+  if (getenv("DRAIN_TIMEOUT") != NULL) {
+    timeout = atoi(getenv("DRAIN_TIMEOUT"));
+  }
 
-// Remove a socket from a resource_tracker
-void untrack_sock(resource_tracker *tracker, int fd) {
-  // Loop through all the active sockets
-  for (size_t i = 0; i < tracker->socket_count; i++) {
-    if (tracker->active_sockets[i] != fd) {
-      continue;
-    }
+  info("Draining %zu connections for up to %ld seconds...",
+       registry_count(&CONNECTIONS), (long)timeout);
 
-    // If we found our socket, copy the last element over it and decrement the
-    // socket count, then exit the loop
-    tracker->active_sockets[i] =
-        tracker->active_sockets[--tracker->socket_count];
-    break;
+  atomic_store(&DRAINING, true);
+  for (size_t i = 0; i < LISTENER_COUNT; i++) {
+    shutdown(LISTENERS[i], SHUT_RDWR);
   }
+
+  // Commands that already arrived can still be read, after which clients see
+  // the end of the connection and their threads close it
+  registry_shutdown_all(&CONNECTIONS, SHUT_RD);
+
+  if (!registry_wait_empty(&CONNECTIONS, monotonic_time() + timeout)) {
+    error("%zu connections did not finish in time",
+          registry_count(&CONNECTIONS));
+  }
+
+  // Pages still queued for the disk are written before exiting
+  if (writer_enabled()) {
+    writer_flush();
+  }
+
+  // So the next run starts with warm caches
+  snapshot_save();
 }
@@ -0,0 +1,134 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "admission.h"
+#include "pool.h"
+#include "protocol.h"
+#include "registry.h"
+#include "shared.h"
+
+// Number of connections each worker of the pool can have queued
+#define POOL_QUEUE_SIZE 256
+// Most connections a poller hands to the pool per wakeup
+#define POLLER_EVENTS 64
+// Length of a command, in the form "xy#"
+#define COMMAND_LEN 3
+// Most commands served together when a client pipelines them
+#define PIPELINE_MAX 64
+// Most bytes of commands read at once from a client
+#define PIPELINE_READ_LEN (COMMAND_LEN * PIPELINE_MAX * 16)
+// Destinations of a batch command fetched at once by default
+#define BATCH_DEFAULT_PARALLELISM 8
+// Seconds connections get to finish when the server is asked to stop
+#define DRAIN_TIMEOUT 10
+
+// What a command asks for
+typedef enum {
+  // The page of a destination
+  CMD_FETCH,
+  // Nothing, because it is unknown or malformed
+  CMD_REJECT,
+  // Nothing, because the server is too busy for it
+  CMD_BUSY,
+  // Switching to protocol v2
+  CMD_HANDSHAKE,
+  // The metrics of the server
+  CMD_STATS,
+  // Taking compressed responses as they are
+  CMD_COMPRESSION,
+} command_kind;
+
+// What a client negotiated on its connection
+typedef struct {
+  // Whether it switched to protocol v2
+  bool v2;
+  // Whether it takes compressed responses without them being decompressed
+  bool compression;
+  // Where it connects from, for its rate limit
+  peer_addr peer;
+} session;
+
+// Command received from a client, and the response to it
+typedef struct {
+  command_kind kind;
+  int dest;
+  // Whether the response is sent with protocol v2, and its status, flags and
+  // tag
+  bool v2;
+  v2_status status;
+  unsigned char flags;
+  unsigned char tag;
+  // Whether a compressed response is sent as it is
+  bool compression;
+  http_response response;
+} command;
+
+// A connection served by the pool, with what it received and negotiated so
+// far, kept while it waits in a poller for its next commands
+typedef struct {
+  conn_id id;
+  int fd;
+  // Listener it was accepted on, whose poller it waits in
+  size_t shard;
+  rx_buffer rb;
+  session s;
+} pooled_conn;
+
+// A batch command being served: a command for each destination it names, and
+// the order in which the fetch pool completed them
+typedef struct {
+  command commands[BATCH_DESTS];
+  size_t count;
+  size_t completed[BATCH_DESTS];
+  size_t completed_count;
+  pthread_mutex_t lock;
+  pthread_cond_t progress;
+} batch_run;
+
+// A command of a batch, as a task of the fetch pool
+typedef struct {
+  batch_run *run;
+  size_t index;
+} batch_task;
+
+// Functions only used by the server
+void *run_shard(void *);
+void serve_listener(size_t);
+void *handle_connection(void *);
+void *run_poller(void *);
+void watch_connection(pooled_conn *, int);
+void pool_connection_task(void *);
+void serve_connection(conn_id);
+bool serve_received(int, rx_buffer *, session *);
+void close_connection(conn_id, int, rx_buffer *, bool);
+void parse_command(command *, const char *, session *);
+void serve_commands(int, command *, size_t);
+void serve_batch(int, const char *, size_t, session *);
+void batch_command(command *, int, session *);
+void run_batch_task(void *);
+void send_responses(int, command *, size_t);
+size_t send_decompressed(int, command *, size_t *);
+void run_command(void *);
+thread_pool *fetch_pool(void);
+int map_command(int);
+int get_listener_socket(size_t);
+void handled_signals(sigset_t *);
+void *handle_signals(void *);
+void drain(void);
+
+// Global variables
+extern const char PORT[];
+extern conn_registry CONNECTIONS;
+extern int *LISTENERS;
+extern size_t LISTENER_COUNT;
+extern atomic_bool DRAINING;
+extern thread_pool *POOL;
+extern thread_pool *FETCH_POOL;
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sha256.h"
+
+// Rotate `x` right by `n` bits
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Round constants: the fractional parts of the cube roots of the first 64
+// primes
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static void sha256_block(sha256_ctx *, const unsigned char *);
+
+// Start a hash
+void sha256_init(sha256_ctx *ctx) {
+  static const uint32_t H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                 0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx->state, H0, sizeof(H0));
+  ctx->len = 0;
+  ctx->block_len = 0;
+}
+
+// Add `len` bytes of `data` to the hash
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len) {
+  const unsigned char *p = data;
+  ctx->len += len;
+
+  // Complete the block left over by the previous call first
+  if (ctx->block_len > 0) {
+    size_t n = 64 - ctx->block_len < len ? 64 - ctx->block_len : len;
+    memcpy(ctx->block + ctx->block_len, p, n);
+    ctx->block_len += n;
+    p += n;
+    len -= n;
+
+    if (ctx->block_len < 64) {
+      return;
+    }
+    sha256_block(ctx, ctx->block);
+    ctx->block_len = 0;
+  }
+
+  // Whole blocks are hashed where they are, without copying them
+  for (; len >= 64; p += 64, len -= 64) {
+    sha256_block(ctx, p);
+  }
+
+  memcpy(ctx->block, p, len);
+  ctx->block_len = len;
+}
+
+// Finish the hash, putting the SHA256_LEN bytes of the digest in `digest`
+void sha256_final(sha256_ctx *ctx, unsigned char *digest) {
+  uint64_t bits = ctx->len * 8;
+
+  // Pad with a 1 bit, then zeros up to the 64-bit length at the end of a block
+  unsigned char pad[72] = {0x80};
+  size_t pad_len = (ctx->block_len < 56 ? 56 : 120) - ctx->block_len;
+  for (int i = 0; i < 8; i++) {
+    pad[pad_len + i] = bits >> (56 - 8 * i);
+  }
+  sha256_update(ctx, pad, pad_len + 8);
+
+  for (int i = 0; i < 8; i++) {
+    digest[4 * i] = ctx->state[i] >> 24;
+    digest[4 * i + 1] = ctx->state[i] >> 16;
+    digest[4 * i + 2] = ctx->state[i] >> 8;
+    digest[4 * i + 3] = ctx->state[i];
+  }
+}
+
+// Hash `len` bytes of `data`, putting the digest in hexadecimal in `hex`, which
+// must have room for SHA256_HEX_LEN + 1 characters
+void sha256_hex(const void *data, size_t len, char *hex) {
+  sha256_ctx ctx;
+  unsigned char digest[SHA256_LEN];
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, data, len);
+  sha256_final(&ctx, digest);
+
+  for (int i = 0; i < SHA256_LEN; i++) {
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+}
+
+// Mix a 64-byte block into the state
+static void sha256_block(sha256_ctx *ctx, const unsigned char *block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+           (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2],
+           d = ctx->state[3], e = ctx->state[4], f = ctx->state[5],
+           g = ctx->state[6], h = ctx->state[7];
+
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + K[i] + w[i];
+    uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+  ctx->state[4] += e;
+  ctx->state[5] += f;
+  ctx->state[6] += g;
+  ctx->state[7] += h;
+}
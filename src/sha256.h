@@ -0,0 +1,24 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Length of a digest, and of its hexadecimal form without the terminator
+#define SHA256_LEN 32
+#define SHA256_HEX_LEN (2 * SHA256_LEN)
+
+// State of a hash being computed
+typedef struct {
+  uint32_t state[8];
+  uint64_t len;
+  unsigned char block[64];
+  size_t block_len;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *);
+void sha256_update(sha256_ctx *, const void *, size_t);
+void sha256_final(sha256_ctx *, unsigned char *);
+void sha256_hex(const void *, size_t, char *);
+
+#endif
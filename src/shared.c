@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
+
 #include "shared.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sysexits.h>
-
-bool DEBUG = false, DEBUG_SET = false;
+#include <unistd.h>
 
 // Check result of a command, and return its return value if it did not error.
 // Works for commands that return values less than 0 on error.
@@ -49,76 +55,157 @@ void *get_in_addr(struct sockaddr *sa) {
   return &(((struct sockaddr_in6 *)sa)->sin6_addr);
 }
 
+// Initialise an empty receive buffer. Nothing is allocated until data comes.
+void rxbuf_init(rx_buffer *rb) {
+  rb->data = NULL;
+  rb->len = 0;
+  rb->cap = 0;
+}
+
+// Make room for at least `n` more bytes, plus a null terminator, growing the
+// buffer geometrically so appending stays cheap
+void rxbuf_reserve(rx_buffer *rb, size_t n) {
+  if (rb->cap - rb->len > n) {
+    return;
+  }
+
+  // Callers bound what they ask for, so this is a bug rather than bad input
+  if (n >= SIZE_MAX - rb->len) {
+    error("Cannot grow a buffer of %zu bytes by %zu more", rb->len, n);
+    abort();
+  }
+
+  size_t cap = rb->cap ? rb->cap : RXBUF_MIN_LEN;
+  while (cap - rb->len <= n && cap <= SIZE_MAX / 2) {
+    cap *= 2;
+  }
+  if (cap - rb->len <= n) {
+    cap = rb->len + n + 1;
+  }
+
+  rb->data = realloc_s(rb->data, cap);
+  rb->cap = cap;
+  debug("Extended buffer to size %zu", cap);
+}
+
+// Receive at most `limit` bytes (no limit if 0) from `sockfd` with a single
+// call, appending them to the buffer.
+//
+// The data lands in the free space of the buffer, and whatever does not fit
+// spills into a stack buffer that is appended afterwards. This reads big chunks
+// without allocating for the largest message up front.
+//
+// Returns the number of received bytes, 0 if the remote closed the connection,
+// or -1 on error.
+long rxbuf_recv(rx_buffer *rb, int sockfd, size_t limit) {
+  char spill[RXBUF_SPILL_LEN];
+
+  if (rb->cap - rb->len < 2) {
+    rxbuf_reserve(rb, RXBUF_MIN_LEN);
+  }
+
+  size_t tail = rb->cap - rb->len - 1;
+  if (limit != 0 && tail > limit) {
+    tail = limit;
+  }
+
+  size_t spill_len = sizeof(spill);
+  if (limit != 0) {
+    spill_len = limit > tail ? limit - tail : 0;
+    if (spill_len > sizeof(spill)) {
+      spill_len = sizeof(spill);
+    }
+  }
+
+  struct iovec iov[2] = {{rb->data + rb->len, tail}, {spill, spill_len}};
+  long bytes_rx = readv(sockfd, iov, spill_len ? 2 : 1);
+
+  if (bytes_rx <= 0) {
+    return bytes_rx;
+  }
+
+  if ((size_t)bytes_rx <= tail) {
+    rb->len += bytes_rx;
+  } else {
+    rb->len += tail;
+    rxbuf_reserve(rb, bytes_rx - tail);
+    memcpy(rb->data + rb->len, spill, bytes_rx - tail);
+    rb->len += bytes_rx - tail;
+  }
+
+  rb->data[rb->len] = '\0';
+
+  return bytes_rx;
+}
+
+// Drop the first `n` bytes of the buffer, keeping its capacity
+void rxbuf_consume(rx_buffer *rb, size_t n) {
+  if (n == 0) {
+    return;
+  }
+
+  memmove(rb->data, rb->data + n, rb->len - n);
+  rb->len -= n;
+
+  if (rb->data) {
+    rb->data[rb->len] = '\0';
+  }
+}
+
+// Hand the null-terminated data over to the caller, who has to free it, and
+// leave the buffer empty
+char *rxbuf_detach(rx_buffer *rb) {
+  if (rb->data == NULL) {
+    rxbuf_reserve(rb, 0);
+    rb->data[0] = '\0';
+  }
+
+  char *data = rb->data;
+  rxbuf_init(rb);
+
+  return data;
+}
+
+// Free the memory of the buffer
+void rxbuf_free(rx_buffer *rb) {
+  free(rb->data);
+  rxbuf_init(rb);
+}
+
 // Receive the entire message on `sockfd`, until the number of received bytes is
 // 0. Optionally limit the number of bytes to be received by setting `num_bytes`
-// to a non-zero value.
-char *recv_all(int sockfd, unsigned int num_bytes) {
-  // Await response (synchronously)
-  // Start with a small buffer size to demonstrate resilient behavior
-  size_t buf_len = 2, cursor = 0;
-  long bytes_rx = 0, total_rx = 0;
-
-  char *buf = malloc_s(sizeof(char) * buf_len);
+// to a non-zero value; no byte past the limit is read from the socket.
+//
+// Returns the null-terminated message with its length in `len`, which may be
+// binary and contain null bytes, or NULL on error.
+char *recv_all(int sockfd, unsigned int num_bytes, size_t *len) {
+  rx_buffer rb;
+  rxbuf_init(&rb);
+  long bytes_rx = 0;
 
   do {
     // We only want num_bytes, if non-zero
-    if (num_bytes != 0 && total_rx >= num_bytes) {
+    if (num_bytes != 0 && rb.len >= num_bytes) {
       break;
     }
 
-    // Write bytes into the next free location in the buffer
-    // Receive only as much as the amount of free space we have in the buffer
-    bytes_rx = recv(sockfd, buf + cursor, buf_len - total_rx, 0);
+    bytes_rx = rxbuf_recv(&rb, sockfd, num_bytes ? num_bytes - rb.len : 0);
 
     // Early return if we got an error
     if (bytes_rx < 0) {
       perrno("Received 0 bytes when calling recv");
-      free(buf);
+      rxbuf_free(&rb);
       return NULL;
     }
 
-    debug("received %d bytes", bytes_rx);
-
-    // When we receive 0 bytes, the server has closed the connection
-    if (bytes_rx == 0) {
-      break;
-    }
-
-    // Keep count of the bytes received
-    total_rx += bytes_rx;
-    // Continue reading where we left off
-    cursor += bytes_rx;
-
-    // If the buffer is full, double its size
-    if (total_rx == buf_len) {
-      buf = realloc_s(buf, buf_len * 2);
-      buf_len *= 2;
-      debug("Extended buffer to size %d", buf_len);
-    }
+    debug("received %ld bytes", bytes_rx);
   } while (bytes_rx > 0);
 
   if (bytes_rx == 0)
-    printf("Remote has closed the connection on fd %d\n", sockfd);
-
-  // Truncate if num_bytes is specified
-  if (num_bytes > 0 && total_rx > num_bytes) {
-    char *truncated_buf = malloc_s(num_bytes + 1);
-    memcpy(truncated_buf, buf, num_bytes);
+    info("Remote has closed the connection on fd %d", sockfd);
 
-    // Ensure null-termination
-    truncated_buf[num_bytes] = '\0';
-
-    free(buf);
-    buf = truncated_buf;
-    total_rx = num_bytes;
-  }
-
-  // Ensure null-termination
-  if (total_rx < buf_len) {
-    buf[total_rx] = '\0';
-  }
-
-  return buf;
+  *len = rb.len;
+  return rxbuf_detach(&rb);
 }
 
 // Send an entire message by repeatedly calling `send` as needed
@@ -140,128 +227,184 @@ void send_all(int sockfd, char *buf, unsigned int num_bytes) {
   }
 }
 
-// Split a buffer into two, `headers` (`container[0]`) and `content`
-// (`container[1]`), based on a HTTP ending (`\r\n\r\n`).
+// Send `count` buffers described by `iov` in order, with as few `writev` calls
+// as possible. `iov` is modified to track partial writes.
 //
-// `buf` is consumed and freed in the process, and it is up to the calling code
-// to free the resulting `char **` (`container`).
-//
-// If the response is empty, return NULL
-char **split_http_response(char *buf, long len) {
-  char **container = malloc_s(2 * sizeof(char *));
+// Returns the number of bytes sent, which is less than requested on error.
+size_t writev_all(int sockfd, struct iovec *iov, size_t count) {
+  size_t total_tx = 0;
 
-  char *del = "\r\n\r\n";
-  char *delimiter = strstr(buf, del);
+  while (count > 0) {
+    long bytes_tx = writev(sockfd, iov, count < IOV_MAX ? count : IOV_MAX);
 
-  // If we couldn't find the delimiter, then the response is empty
-  if (!delimiter) {
-    error("Empty response!");
-    free(container);
-    free(buf);
-    return NULL;
+    if (bytes_tx < 0 && errno == EINTR) {
+      continue;
+    }
+
+    // Log error and early return
+    if (bytes_tx < 0) {
+      perrno("writev error");
+      return total_tx;
+    }
+
+    debug("sent %ld bytes", bytes_tx);
+    total_tx += bytes_tx;
+
+    // Skip the buffers that were sent entirely, and the sent part of the next
+    while (count > 0 && (size_t)bytes_tx >= iov->iov_len) {
+      bytes_tx -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + bytes_tx;
+      iov->iov_len -= bytes_tx;
+    }
   }
 
-  // Allocate memory and copy headers
-  size_t headers_len = delimiter - buf;
-  container[0] = malloc_s(headers_len + 2);
-  memcpy(container[0], buf, headers_len);
-  // Newline, otherwise what we send leaks into the next request
-  container[0][headers_len] = '\n';
-  // Null-terminate headers
-  container[0][headers_len + 1] = '\0';
-
-  // Allocate memory and copy content
-  size_t content_len = len - (headers_len + strlen(del));
-  container[1] = malloc_s(content_len + 2);
-  memcpy(container[1], delimiter + strlen(del), content_len);
-  // Newline, otherwise what we send leaks into the next request
-  container[1][content_len] = '\n';
-  // Null-terminate headers
-  container[1][content_len + 1] = '\0';
-
-  // We're done using buf
-  free(buf);
-
-  return container;
+  return total_tx;
 }
 
-// Write `buffer` to a file called `file_name`.
-void save_file(char *buffer, unsigned int length, char *file_name) {
-  FILE *file = fopen(file_name, "w");
+// Find where the headers and the content of the HTTP response in the first
+// `len` bytes of `buf` are, based on a HTTP ending (`\r\n\r\n`). Nothing is
+// copied: the headers are the first `headers_len` bytes, and the content
+// starts at `content_offset` and runs to the end.
+//
+// If the response is empty, return false
+bool split_http_response(const char *buf, size_t len, size_t *headers_len,
+                         size_t *content_offset) {
+  const char *del = "\r\n\r\n";
+  const char *delimiter = memmem(buf, len, del, strlen(del));
 
-  if (!file) {
-    perrno("Could not open file for writing");
+  // If we couldn't find the delimiter, then the response is empty
+  if (!delimiter) {
+    error("Empty response!");
+    return false;
   }
 
-  size_t bytes_written = fwrite(buffer, sizeof(char), length, file);
+  *headers_len = delimiter - buf;
+  *content_offset = *headers_len + strlen(del);
 
-  if (bytes_written != length) {
-    perrno("File writing");
-  }
+  return true;
+}
 
-  debug("Saved file to %s\n", file_name);
+// Write `length` bytes of `buffer` to a file called `file_name`. The file is
+// replaced at once when complete, so it never holds a partial write. Returns
+// whether it was saved.
+bool save_file(const char *buffer, size_t length, const char *file_name) {
+  char *temp_name;
+  int fd = open_temp_file(file_name, &temp_name);
 
-  if (fclose(file) == EOF) {
-    perrno("Could not close and flush file");
+  if (fd < 0) {
+    return false;
   }
-}
 
-// Helper print functions
-// All of them exit the program with the exit code EX_IOERR (74) in case there
-// was an output error
+  bool ok = true;
+  while (length > 0) {
+    long bytes_written = write(fd, buffer, length);
 
-// Pretty print non-critical messages
-void debug(const char *restrict format, ...) {
-  if (!DEBUG_SET) {
-    if (getenv("DEBUG") != NULL) {
-      printf("Setting DEBUG to true\n");
-      DEBUG = true;
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perrno("File writing");
+      ok = false;
+      break;
     }
 
-    DEBUG_SET = true;
+    buffer += bytes_written;
+    length -= bytes_written;
   }
 
-  if (!DEBUG) {
-    return;
+  if (!finish_temp_file(fd, temp_name, file_name, ok)) {
+    return false;
   }
 
-  va_list vargs;
-  // Begin orange colored output
-  printf("\033[0;33m");
+  debug("Saved file to %s\n", file_name);
+  return true;
+}
+
+// Create a temporary file next to `file_name`, to be moved over it by
+// `finish_temp_file` once it is fully written. Returns its descriptor and sets
+// `temp_name`, or returns -1 if it could not be created.
+int open_temp_file(const char *file_name, char **temp_name) {
+  *temp_name = malloc_s(strlen(file_name) + 8); // ".XXXXXX\0"
+  sprintf(*temp_name, "%s.XXXXXX", file_name);
+
+  int fd = mkostemp(*temp_name, O_CLOEXEC);
 
-  va_start(vargs, format);
-  vprintf(format, vargs);
-  va_end(vargs);
+  if (fd < 0) {
+    perrno("Could not open file for writing");
+    free(*temp_name);
+    return -1;
+  }
 
-  // End orange colored output
-  printf("\033[0m\n");
+  // `mkstemp` only gives access to the owner, saved files are public
+  check(fchmod(fd, 0644), "Could not set file permissions");
+
+  return fd;
 }
 
-// Print error messages to stderr with the prefix `ERROR: `
-void error(const char *restrict format, ...) {
-  va_list vargs;
+// Close the temporary file `fd` opened by `open_temp_file`. If it was written
+// `ok`, atomically replace `file_name` with it, so readers never see a partly
+// written file; otherwise throw it away. Returns whether `file_name` was
+// replaced.
+bool finish_temp_file(int fd, char *temp_name, const char *file_name,
+                      bool ok) {
+  if (close(fd) < 0) {
+    perrno("Could not close and flush file");
+    ok = false;
+  }
 
-  fprintf(stderr, "ERROR: ");
+  if (ok && rename(temp_name, file_name) < 0) {
+    perrno("Could not replace %s", file_name);
+    ok = false;
+  }
 
-  va_start(vargs, format);
-  vfprintf(stderr, format, vargs);
-  va_end(vargs);
+  if (!ok) {
+    unlink(temp_name);
+  }
 
-  fprintf(stderr, "\n");
+  free(temp_name);
+  return ok;
 }
 
-// Print the desired message followed by the errno and its explanation on a
-// newline
-void perrno(const char *restrict format, ...) {
-  va_list vargs;
+// Seconds elapsed on a monotonic clock, which is not affected by changes to the
+// system time
+time_t monotonic_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
 
-  fprintf(stderr, "ERROR: ");
+// Milliseconds on a monotonic clock, the unit of request deadlines
+uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-  va_start(vargs, format);
-  vfprintf(stderr, format, vargs);
-  va_end(vargs);
+// Wait until `fd` is ready for `events`, or until `deadline`, a time from
+// `monotonic_ms`. Returns 1 once it is ready, 0 with errno set to ETIMEDOUT if
+// the deadline passed first, and -1 if polling failed.
+int wait_until(int fd, short events, uint64_t deadline) {
+  struct pollfd pfd = {.fd = fd, .events = events};
+
+  while (true) {
+    uint64_t now = monotonic_ms();
+    if (now >= deadline) {
+      errno = ETIMEDOUT;
+      return 0;
+    }
 
-  fprintf(stderr, "\nerrno %d: %s\n", errno, strerror(errno));
+    int ready = poll(&pfd, 1, deadline - now);
+    if (ready > 0) {
+      return 1;
+    }
+    if (ready < 0 && errno != EINTR) {
+      return -1;
+    }
+  }
 }
 
 // Create custom error messages to return
@@ -280,3 +423,47 @@ char *make_error_message(const char *format, ...) {
 
     return message;
 }
+
+// Wrap `len` bytes of allocated `data` in a buffer with one owner. The buffer
+// takes ownership of `data`.
+buffer *buffer_wrap(char *data, size_t len) {
+  buffer *buf = malloc_s(sizeof(buffer));
+  buf->data = data;
+  buf->len = len;
+  atomic_init(&buf->refs, 1);
+  buf->borrowed = false;
+
+  return buf;
+}
+
+// Wrap `len` bytes of `data` in a buffer with one owner, without taking
+// ownership of them. They must stay valid for as long as the buffer is used.
+buffer *buffer_borrow(const char *data, size_t len) {
+  buffer *buf = buffer_wrap((char *)data, len);
+  buf->borrowed = true;
+
+  return buf;
+}
+
+// Add an owner to a buffer, which has to release it with `buffer_unref`
+buffer *buffer_ref(buffer *buf) {
+  atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+  return buf;
+}
+
+// Release a buffer, freeing it if this was its last owner
+void buffer_unref(buffer *buf) {
+  if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+    if (!buf->borrowed) {
+      free(buf->data);
+    }
+    free(buf);
+  }
+}
+
+// Wrap an allocated error message in a response with no headers or content.
+// The response takes ownership of `message`.
+http_response message_response(char *message) {
+  http_response res = {buffer_wrap(message, strlen(message)), 0, 0, 0};
+  return res;
+}
@@ -1,19 +1,90 @@
+#ifndef SHARED_H
+#define SHARED_H
+
 #include <errno.h>
 #include <netinet/in.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "log.h"
+
+// Bytes shared by several owners without copying, freed when the last owner
+// releases them
+typedef struct {
+  char *data;
+  size_t len;
+  atomic_int refs;
+  // Whether `data` belongs to something that outlives the buffer, like a
+  // mapped snapshot, so only the buffer itself is freed
+  bool borrowed;
+} buffer;
+
+// Compression of the content of a response, from its Content-Encoding header
+typedef enum {
+  ENCODING_IDENTITY,
+  ENCODING_GZIP,
+  ENCODING_DEFLATE,
+} content_encoding;
+
+// Response to a command, held in a single buffer. The HTTP headers and content
+// are slices of that buffer rather than copies, and both are empty for error
+// messages.
+typedef struct {
+  buffer *buf;
+  size_t headers_len;
+  size_t content_offset;
+  size_t content_len;
+  // Compressed content is kept as it arrived, with its length once
+  // decompressed, which is 0 until `encoding_measure` finds it
+  content_encoding encoding;
+  size_t plain_len;
+} http_response;
+
+// Initial capacity of a receive buffer
+#define RXBUF_MIN_LEN 16384
+// Size of the stack buffer that receives whatever does not fit in a receive
+// buffer, so a single call can read a large chunk
+#define RXBUF_SPILL_LEN 65536
+
+// Growable buffer that data is received into. `data` is always null-terminated
+// but may contain null bytes, so `len` is its real length.
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} rx_buffer;
 
 int check(int, const char *);
 void *malloc_s(size_t);
 void *realloc_s(void *, size_t);
 void *get_in_addr(struct sockaddr *);
-char *recv_all(int, unsigned int);
+void rxbuf_init(rx_buffer *);
+void rxbuf_reserve(rx_buffer *, size_t);
+long rxbuf_recv(rx_buffer *, int, size_t);
+void rxbuf_consume(rx_buffer *, size_t);
+char *rxbuf_detach(rx_buffer *);
+void rxbuf_free(rx_buffer *);
+char *recv_all(int, unsigned int, size_t *);
 void send_all(int, char *, unsigned int);
-char **split_http_response(char *, long);
-void save_file(char *, unsigned int, char *);
-void debug(const char *restrict, ...);
-void error(const char *restrict, ...);
-void perrno(const char *restrict, ...);
+size_t writev_all(int, struct iovec *, size_t);
+bool split_http_response(const char *, size_t, size_t *, size_t *);
+bool save_file(const char *, size_t, const char *);
+int open_temp_file(const char *, char **);
+bool finish_temp_file(int, char *, const char *, bool);
+time_t monotonic_time(void);
+uint64_t monotonic_ms(void);
+int wait_until(int, short, uint64_t);
 char *make_error_message(const char *, ...);
+buffer *buffer_wrap(char *, size_t);
+buffer *buffer_borrow(const char *, size_t);
+buffer *buffer_ref(buffer *);
+void buffer_unref(buffer *);
+http_response message_response(char *);
+
+#endif
@@ -0,0 +1,364 @@
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "dns_cache.h"
+#include "shared.h"
+#include "snapshot.h"
+
+// Identifies snapshot files, and the version of their layout
+#define SNAPSHOT_MAGIC "IPSNAP\0"
+#define SNAPSHOT_VERSION 1
+// Longest host name a snapshot holds, with its terminator
+#define SNAPSHOT_HOST_LEN 256
+// Longest service name a snapshot holds, with its terminator
+#define SNAPSHOT_SERVICE_LEN 32
+// Seconds between two snapshots by default
+#define SNAPSHOT_DEFAULT_INTERVAL 60
+
+// A snapshot starts with this header, followed by the records of the
+// responses, then those of the addresses, then the bytes of the responses.
+// Numbers are in the byte order of the machine, as a snapshot is only read
+// back by the server that wrote it.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t responses;
+  uint32_t addresses;
+  uint32_t reserved;
+} snapshot_header;
+
+// A cached response, whose `len` bytes are at `offset` in the file, followed
+// by a null byte. Expiry times are wall-clock times, which survive a restart.
+typedef struct {
+  char host[SNAPSHOT_HOST_LEN];
+  int64_t expires;
+  uint64_t offset, len;
+  uint64_t headers_len, content_offset, content_len, plain_len;
+  uint32_t encoding;
+  uint32_t reserved;
+} snapshot_response;
+
+// A resolved address. Consecutive records of the same key form its list.
+typedef struct {
+  char host[SNAPSHOT_HOST_LEN];
+  char service[SNAPSHOT_SERVICE_LEN];
+  int64_t expires;
+  int32_t family;
+  int32_t ai_family, ai_socktype, ai_protocol;
+  uint32_t addrlen;
+  uint32_t reserved;
+  struct sockaddr_storage addr;
+} snapshot_address;
+
+static char *SNAPSHOT_FILE = NULL;
+static unsigned SNAPSHOT_INTERVAL = SNAPSHOT_DEFAULT_INTERVAL;
+static pthread_once_t snapshot_once = PTHREAD_ONCE_INIT;
+// Serializes the periodic snapshots and the one taken when draining
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void snapshot_init(void);
+static void snapshot_load(void);
+static size_t load_responses(const char *, size_t, const snapshot_header *);
+static void load_addresses(const char *, const snapshot_header *);
+static void *snapshotter(void *);
+
+// Whether the caches are saved to a snapshot, which is enabled by setting the
+// env var SNAPSHOT_FILE to its path
+bool snapshot_enabled(void) {
+  pthread_once(&snapshot_once, snapshot_init);
+  return SNAPSHOT_FILE != NULL;
+}
+
+// Load the snapshot left by the previous run, if any, and save a new one every
+// SNAPSHOT_INTERVAL seconds (default 60) from then on. Has to be called once
+// the destinations are configured, before serving.
+void snapshot_start(void) {
+  if (!snapshot_enabled()) {
+    return;
+  }
+
+  snapshot_load();
+
+  pthread_t t;
+  if (pthread_create(&t, NULL, snapshotter, NULL) != 0) {
+    error("Could not start the snapshot thread, saving only when draining");
+    return;
+  }
+  pthread_detach(t);
+}
+
+// Save the fresh responses of the cache and the resolved addresses to
+// SNAPSHOT_FILE, replacing it at once
+void snapshot_save(void) {
+  if (!snapshot_enabled()) {
+    return;
+  }
+
+  pthread_mutex_lock(&snapshot_lock);
+
+  cache_item *items;
+  size_t item_count = cache_export(&items);
+  dns_item *names;
+  size_t name_count = dns_export(&names);
+
+  // Names too long for a record are left out
+  snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, 0, 0};
+  for (size_t i = 0; i < item_count; i++) {
+    header.responses += strlen(items[i].host) < SNAPSHOT_HOST_LEN;
+  }
+  for (size_t i = 0; i < name_count; i++) {
+    if (strlen(names[i].host) < SNAPSHOT_HOST_LEN &&
+        strlen(names[i].service) < SNAPSHOT_SERVICE_LEN) {
+      for (struct addrinfo *p = names[i].res; p; p = p->ai_next) {
+        header.addresses++;
+      }
+    }
+  }
+
+  // Zeroed, so no stale memory ends up in the file
+  size_t responses_len = header.responses * sizeof(snapshot_response);
+  size_t addresses_len = header.addresses * sizeof(snapshot_address);
+  snapshot_response *responses = malloc_s(responses_len + 1);
+  snapshot_address *addresses = malloc_s(addresses_len + 1);
+  memset(responses, 0, responses_len);
+  memset(addresses, 0, addresses_len);
+
+  // The header, both tables, and every response with its null byte
+  struct iovec *iov =
+      malloc_s((3 + 2 * header.responses) * sizeof(struct iovec));
+  iov[0] = (struct iovec){&header, sizeof(header)};
+  iov[1] = (struct iovec){responses, responses_len};
+  iov[2] = (struct iovec){addresses, addresses_len};
+  size_t iov_count = 3;
+
+  time_t now = time(NULL);
+  uint64_t offset = sizeof(header) + responses_len + addresses_len;
+  snapshot_response *r = responses;
+
+  for (size_t i = 0; i < item_count; i++) {
+    const http_response *res = &items[i].response;
+    if (strlen(items[i].host) >= SNAPSHOT_HOST_LEN) {
+      continue;
+    }
+
+    strcpy(r->host, items[i].host);
+    r->expires = now + items[i].ttl;
+    r->offset = offset;
+    r->len = res->buf->len;
+    r->headers_len = res->headers_len;
+    r->content_offset = res->content_offset;
+    r->content_len = res->content_len;
+    r->plain_len = res->plain_len;
+    r->encoding = res->encoding;
+    r++;
+
+    iov[iov_count++] = (struct iovec){res->buf->data, res->buf->len};
+    iov[iov_count++] = (struct iovec){"", 1};
+    offset += res->buf->len + 1;
+  }
+
+  snapshot_address *a = addresses;
+  for (size_t i = 0; i < name_count; i++) {
+    if (strlen(names[i].host) >= SNAPSHOT_HOST_LEN ||
+        strlen(names[i].service) >= SNAPSHOT_SERVICE_LEN) {
+      continue;
+    }
+
+    for (struct addrinfo *p = names[i].res; p; p = p->ai_next, a++) {
+      strcpy(a->host, names[i].host);
+      strcpy(a->service, names[i].service);
+      a->expires = now + names[i].ttl;
+      a->family = names[i].family;
+      a->ai_family = p->ai_family;
+      a->ai_socktype = p->ai_socktype;
+      a->ai_protocol = p->ai_protocol;
+      a->addrlen = p->ai_addrlen;
+      memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+    }
+  }
+
+  char *temp_name;
+  int fd = open_temp_file(SNAPSHOT_FILE, &temp_name);
+  if (fd >= 0) {
+    bool ok = writev_all(fd, iov, iov_count) == offset;
+    if (finish_temp_file(fd, temp_name, SNAPSHOT_FILE, ok)) {
+      debug("Saved a snapshot of %u responses and %u addresses",
+            header.responses, header.addresses);
+    }
+  }
+
+  for (size_t i = 0; i < item_count; i++) {
+    free(items[i].host);
+    buffer_unref(items[i].response.buf);
+  }
+  for (size_t i = 0; i < name_count; i++) {
+    free(names[i].host);
+    free(names[i].service);
+    free_ip_addrinfo(names[i].res);
+  }
+  free(items);
+  free(names);
+  free(responses);
+  free(addresses);
+  free(iov);
+
+  pthread_mutex_unlock(&snapshot_lock);
+}
+
+// Read the configuration from the environment
+static void snapshot_init(void) {
+  SNAPSHOT_FILE = getenv("SNAPSHOT_FILE");
+
+  if (getenv("SNAPSHOT_INTERVAL") != NULL &&
+      atoi(getenv("SNAPSHOT_INTERVAL")) > 0) {
+    SNAPSHOT_INTERVAL = atoi(getenv("SNAPSHOT_INTERVAL"));
+  }
+}
+
+// Map the snapshot and put what is still fresh back into the caches. Cached
+// responses are served straight from the mapping, which is therefore never
+// unmapped once one of them was loaded. A later snapshot replaces the file
+// without changing the mapped one.
+static void snapshot_load(void) {
+  int fd = open(SNAPSHOT_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      perrno("Could not open snapshot %s", SNAPSHOT_FILE);
+    }
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_header)) {
+    error("Snapshot %s is too short, ignoring it", SNAPSHOT_FILE);
+    close(fd);
+    return;
+  }
+
+  size_t size = st.st_size;
+  const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perrno("Could not map snapshot %s", SNAPSHOT_FILE);
+    return;
+  }
+
+  const snapshot_header *header = (const snapshot_header *)map;
+  size_t tables = sizeof(snapshot_header) +
+                  (size_t)header->responses * sizeof(snapshot_response) +
+                  (size_t)header->addresses * sizeof(snapshot_address);
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION || tables > size) {
+    error("Snapshot %s is not valid, ignoring it", SNAPSHOT_FILE);
+    munmap((void *)map, size);
+    return;
+  }
+
+  size_t loaded = load_responses(map, size, header);
+  load_addresses(map, header);
+  info("Loaded %zu responses and %u addresses from snapshot %s", loaded,
+       header->addresses, SNAPSHOT_FILE);
+
+  if (loaded == 0) {
+    munmap((void *)map, size);
+  }
+}
+
+// Put the fresh responses of the snapshot `map` of `size` bytes into the
+// cache, without copying them. Returns how many were.
+static size_t load_responses(const char *map, size_t size,
+                             const snapshot_header *header) {
+  const snapshot_response *records =
+      (const snapshot_response *)(map + sizeof(snapshot_header));
+  time_t now = time(NULL);
+  size_t loaded = 0;
+
+  for (uint32_t i = 0; i < header->responses; i++) {
+    const snapshot_response *r = &records[i];
+    bool valid = memchr(r->host, '\0', SNAPSHOT_HOST_LEN) != NULL &&
+                 r->offset <= size && r->len < size - r->offset &&
+                 r->content_offset + r->content_len <= r->len &&
+                 r->headers_len <= r->content_offset &&
+                 r->encoding <= ENCODING_DEFLATE;
+    if (!valid) {
+      error("Response %u of the snapshot is not valid, skipping it", i);
+      continue;
+    }
+    if (r->expires <= now) {
+      continue;
+    }
+
+    http_response res = {buffer_borrow(map + r->offset, r->len),
+                         r->headers_len,
+                         r->content_offset,
+                         r->content_len,
+                         r->encoding,
+                         r->plain_len};
+    loaded += cache_import(r->host, res, r->expires - now);
+    buffer_unref(res.buf);
+  }
+
+  return loaded;
+}
+
+// Put the fresh addresses of the snapshot `map` into the DNS cache
+static void load_addresses(const char *map, const snapshot_header *header) {
+  const snapshot_address *records =
+      (const snapshot_address *)(map + sizeof(snapshot_header) +
+                                 header->responses *
+                                     sizeof(snapshot_response));
+  time_t now = time(NULL);
+
+  for (uint32_t i = 0; i < header->addresses;) {
+    const snapshot_address *first = &records[i];
+
+    // The addresses of a key are consecutive
+    uint32_t count = 1;
+    while (i + count < header->addresses &&
+           strncmp(records[i + count].host, first->host,
+                   SNAPSHOT_HOST_LEN) == 0 &&
+           strncmp(records[i + count].service, first->service,
+                   SNAPSHOT_SERVICE_LEN) == 0 &&
+           records[i + count].family == first->family) {
+      count++;
+    }
+
+    bool valid = memchr(first->host, '\0', SNAPSHOT_HOST_LEN) != NULL &&
+                 memchr(first->service, '\0', SNAPSHOT_SERVICE_LEN) != NULL;
+    struct addrinfo *list = malloc_s(count * sizeof(struct addrinfo));
+    memset(list, 0, count * sizeof(struct addrinfo));
+    for (uint32_t j = 0; valid && j < count; j++) {
+      const snapshot_address *a = &records[i + j];
+      valid = a->addrlen <= sizeof(a->addr);
+      list[j].ai_family = a->ai_family;
+      list[j].ai_socktype = a->ai_socktype;
+      list[j].ai_protocol = a->ai_protocol;
+      list[j].ai_addrlen = a->addrlen;
+      list[j].ai_addr = (struct sockaddr *)&a->addr;
+      list[j].ai_next = j + 1 < count ? &list[j + 1] : NULL;
+    }
+
+    if (valid && first->expires > now) {
+      dns_import(first->host, first->service, first->family, list,
+                 first->expires - now);
+    }
+
+    free(list);
+    i += count;
+  }
+}
+
+// Save a snapshot every SNAPSHOT_INTERVAL seconds
+static void *snapshotter(void *arg) {
+  while (true) {
+    sleep(SNAPSHOT_INTERVAL);
+    snapshot_save();
+  }
+
+  return NULL;
+}
@@ -0,0 +1,10 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+
+bool snapshot_enabled(void);
+void snapshot_start(void);
+void snapshot_save(void);
+
+#endif
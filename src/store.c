@@ -0,0 +1,458 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "encoding.h"
+#include "sha256.h"
+#include "shared.h"
+#include "store.h"
+
+// Versions of each page kept by default, and at most
+#define STORE_DEFAULT_VERSIONS 4
+#define STORE_MAX_VERSIONS 64
+// Bytes of a stored object read at a time to hash it
+#define STORE_READ_CHUNK 65536
+// Buckets of the table counting the versions that refer to each object
+#define STORE_REF_BUCKETS 1024
+
+// A version of a page: the object holding it, and the hash of the content it
+// was saved from, which differs from the object when that was decompressed
+typedef struct {
+  char object[SHA256_HEX_LEN + 1];
+  char source[SHA256_HEX_LEN + 1];
+} store_version;
+
+// Number of versions of all pages that refer to an object, in a chain of its
+// bucket
+typedef struct object_ref {
+  char object[SHA256_HEX_LEN + 1];
+  size_t count;
+  struct object_ref *next;
+} object_ref;
+
+static char *STORE_DIR = NULL;
+static int STORE_VERSIONS = STORE_DEFAULT_VERSIONS;
+static pthread_once_t store_once = PTHREAD_ONCE_INIT;
+// Held while pointer files and the reference counts change, and while an
+// object that lost its last reference is deleted. Objects are written without
+// it.
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static object_ref *object_refs[STORE_REF_BUCKETS];
+
+static void store_init(void);
+static char *store_path(const char *, const char *);
+static size_t read_versions(const char *, store_version *);
+static bool write_versions(const char *, const store_version *, size_t);
+static bool write_object(const char *, size_t, content_encoding, const char *,
+                         char *);
+static bool hash_file(int, char *);
+static bool link_page(const char *, const char *);
+static void collect(void);
+static bool mark(void);
+static size_t sweep(void);
+static object_ref **find_ref(const char *);
+static void ref_object(const char *);
+static void unref_object(const char *);
+
+// Whether pages are kept in the content-addressed store, which is enabled by
+// setting the env var STORE_DIR to its directory
+bool store_enabled(void) {
+  pthread_once(&store_once, store_init);
+  return STORE_DIR != NULL;
+}
+
+// Save `len` bytes of `data` as the latest version of `file_name`,
+// decompressing them first unless `enc` is identity, like `encoding_save`.
+//
+// Content is hashed with SHA-256 and stored once under its hash in
+// `{STORE_DIR}/objects`, so a page that did not change since the last save is
+// not written at all. `{STORE_DIR}/refs/{file_name}` lists the latest
+// STORE_VERSIONS (default 4) versions of the page, newest first, and
+// `file_name` is a symbolic link to the newest. The versions a save drops have
+// their objects deleted, unless another version still refers to them.
+//
+// Objects are written without holding `store_lock`, so pages are saved in
+// parallel, and only the pointer file is updated with it held.
+void store_save(const char *file_name, const char *data, size_t len,
+                content_encoding enc) {
+  pthread_once(&store_once, store_init);
+
+  char source[SHA256_HEX_LEN + 1];
+  sha256_hex(data, len, source);
+
+  char *refs = store_path("refs", file_name);
+  store_version versions[STORE_MAX_VERSIONS + 1];
+
+  pthread_mutex_lock(&store_lock);
+  size_t count = read_versions(refs, versions + 1);
+  pthread_mutex_unlock(&store_lock);
+
+  if (count > 0 && strcmp(versions[1].source, source) == 0) {
+    debug("%s did not change, not saving it", file_name);
+    free(refs);
+    return;
+  }
+
+  // An object is only deleted with the lock held, so one that still exists
+  // once it is taken stays until the pointer file refers to it. If another
+  // save dropped it in the meantime, it is written again.
+  store_version *latest = &versions[0];
+  strcpy(latest->source, source);
+  bool stored = false;
+  while (!stored) {
+    if (!write_object(data, len, enc, source, latest->object)) {
+      free(refs);
+      return;
+    }
+
+    char *path = store_path("objects", latest->object);
+    pthread_mutex_lock(&store_lock);
+    stored = access(path, F_OK) == 0;
+    if (!stored) {
+      pthread_mutex_unlock(&store_lock);
+    }
+    free(path);
+  }
+
+  // Another save of the page may have run since the versions were read
+  count = read_versions(refs, versions + 1);
+  if (count > 0 && strcmp(versions[1].object, latest->object) == 0) {
+    pthread_mutex_unlock(&store_lock);
+    free(refs);
+    return;
+  }
+
+  // A page that went back to an older version moves it to the front
+  size_t kept = 1;
+  for (size_t i = 1; i <= count; i++) {
+    if (strcmp(versions[i].object, latest->object) != 0) {
+      versions[kept++] = versions[i];
+    }
+  }
+  bool moved = kept == count;
+
+  size_t dropped = 0;
+  if (kept > (size_t)STORE_VERSIONS) {
+    dropped = kept - STORE_VERSIONS;
+    kept = STORE_VERSIONS;
+  }
+
+  if (write_versions(refs, versions, kept)) {
+    if (!moved) {
+      ref_object(latest->object);
+    }
+    for (size_t i = 0; i < dropped; i++) {
+      unref_object(versions[kept + i].object);
+    }
+
+    if (link_page(file_name, latest->object)) {
+      debug("Saved %s as %s", file_name, latest->object);
+    }
+  }
+
+  pthread_mutex_unlock(&store_lock);
+  free(refs);
+}
+
+// Read the configuration from the environment, and create the directories of
+// the store. Objects left behind by a previous run are collected.
+static void store_init(void) {
+  if (getenv("STORE_DIR") == NULL) {
+    return;
+  }
+
+  if (getenv("STORE_VERSIONS") != NULL) {
+    STORE_VERSIONS = atoi(getenv("STORE_VERSIONS"));
+    if (STORE_VERSIONS < 1 || STORE_VERSIONS > STORE_MAX_VERSIONS) {
+      error("STORE_VERSIONS must be between 1 and %d, using %d",
+            STORE_MAX_VERSIONS, STORE_DEFAULT_VERSIONS);
+      STORE_VERSIONS = STORE_DEFAULT_VERSIONS;
+    }
+  }
+
+  STORE_DIR = getenv("STORE_DIR");
+  char *objects = store_path("objects", NULL);
+  char *refs = store_path("refs", NULL);
+  bool ok = (mkdir(STORE_DIR, 0755) == 0 || errno == EEXIST) &&
+            (mkdir(objects, 0755) == 0 || errno == EEXIST) &&
+            (mkdir(refs, 0755) == 0 || errno == EEXIST);
+  free(objects);
+  free(refs);
+
+  if (!ok) {
+    perrno("Could not create the store in %s, saving pages directly",
+           STORE_DIR);
+    STORE_DIR = NULL;
+    return;
+  }
+
+  collect();
+}
+
+// Path of `name` in the directory `dir` of the store, or of `dir` itself if
+// `name` is NULL. Returns it allocated.
+static char *store_path(const char *dir, const char *name) {
+  char *path = malloc_s(strlen(STORE_DIR) + strlen(dir) +
+                        (name ? strlen(name) : 0) + 3);
+  if (name) {
+    sprintf(path, "%s/%s/%s", STORE_DIR, dir, name);
+  } else {
+    sprintf(path, "%s/%s", STORE_DIR, dir);
+  }
+
+  return path;
+}
+
+// Read the versions listed in the pointer file `refs` into `versions`, which
+// must have room for STORE_MAX_VERSIONS. Returns how many there are, 0 if the
+// file does not exist yet.
+static size_t read_versions(const char *refs, store_version *versions) {
+  FILE *f = fopen(refs, "r");
+  if (f == NULL) {
+    if (errno != ENOENT) {
+      perrno("Could not read %s", refs);
+    }
+    return 0;
+  }
+
+  size_t count = 0;
+  while (count < STORE_MAX_VERSIONS &&
+         fscanf(f, "%64s %64s", versions[count].object,
+                versions[count].source) == 2) {
+    count++;
+  }
+
+  fclose(f);
+  return count;
+}
+
+// Replace the pointer file `refs` with `count` versions, newest first, one per
+// line. Returns whether it was written.
+static bool write_versions(const char *refs, const store_version *versions,
+                           size_t count) {
+  // Two hashes, a space and a newline per version, and the terminator the
+  // last `snprintf` adds
+  char text[STORE_MAX_VERSIONS * (2 * SHA256_HEX_LEN + 2) + 1];
+  size_t len = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    len += snprintf(text + len, sizeof(text) - len, "%.*s %.*s\n",
+                    SHA256_HEX_LEN, versions[i].object, SHA256_HEX_LEN,
+                    versions[i].source);
+  }
+
+  return save_file(text, len, refs);
+}
+
+// Store `len` bytes of `data`, whose hash is `source`, decompressing them
+// first unless `enc` is identity. Puts the hash of the object in `object`.
+// Returns whether the object is stored, which it may already have been.
+static bool write_object(const char *data, size_t len, content_encoding enc,
+                         const char *source, char *object) {
+  if (enc == ENCODING_IDENTITY) {
+    strcpy(object, source);
+    char *path = store_path("objects", object);
+    bool ok = access(path, F_OK) == 0 || save_file(data, len, path);
+    free(path);
+    return ok;
+  }
+
+  // Decompressed content is only known once written, so it is hashed from
+  // the file, and the file thrown away if the object already exists
+  char *temp_path = store_path("objects", "new");
+  char *temp_name;
+  int fd = open_temp_file(temp_path, &temp_name);
+  free(temp_path);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool ok = encoding_inflate(fd, data, len, enc) && hash_file(fd, object);
+  if (!ok) {
+    finish_temp_file(fd, temp_name, NULL, false);
+    return false;
+  }
+
+  char *path = store_path("objects", object);
+  bool exists = access(path, F_OK) == 0;
+  ok = finish_temp_file(fd, temp_name, path, !exists) || exists;
+  free(path);
+
+  return ok;
+}
+
+// Hash the whole file `fd` into `hex`. Returns whether it could be read.
+static bool hash_file(int fd, char *hex) {
+  sha256_ctx ctx;
+  sha256_init(&ctx);
+
+  char *chunk = malloc_s(STORE_READ_CHUNK);
+  off_t offset = 0;
+  long bytes;
+  while ((bytes = pread(fd, chunk, STORE_READ_CHUNK, offset)) != 0) {
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      perrno("Could not read a stored object back");
+      free(chunk);
+      return false;
+    }
+
+    sha256_update(&ctx, chunk, bytes);
+    offset += bytes;
+  }
+  free(chunk);
+
+  unsigned char digest[SHA256_LEN];
+  sha256_final(&ctx, digest);
+  for (int i = 0; i < SHA256_LEN; i++) {
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+
+  return true;
+}
+
+// Point `file_name` at `object` with a symbolic link, replaced at once like a
+// saved file. Returns whether it was.
+static bool link_page(const char *file_name, const char *object) {
+  char *target = store_path("objects", object);
+  char *temp_name = malloc_s(strlen(file_name) + 6); // ".link\0"
+  sprintf(temp_name, "%s.link", file_name);
+
+  // Left behind if the server stopped halfway through
+  unlink(temp_name);
+
+  bool ok = true;
+  if (symlink(target, temp_name) < 0 || rename(temp_name, file_name) < 0) {
+    perrno("Could not point %s to %s", file_name, target);
+    unlink(temp_name);
+    ok = false;
+  }
+
+  free(temp_name);
+  free(target);
+  return ok;
+}
+
+// Count the versions that refer to each object, and sweep away the objects
+// none refers to, including files left half-written by a previous run. Only
+// run once, before any page is saved.
+static void collect(void) {
+  if (!mark()) {
+    return;
+  }
+
+  size_t swept = sweep();
+  debug("Collected %zu objects of the store", swept);
+}
+
+// Count the versions of every pointer file in the table of references.
+// Returns false if the pointer files cannot be listed.
+static bool mark(void) {
+  char *dir = store_path("refs", NULL);
+  DIR *refs = opendir(dir);
+  free(dir);
+  if (refs == NULL) {
+    perrno("Could not list the pages of the store");
+    return false;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(refs)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+
+    char *path = store_path("refs", entry->d_name);
+    store_version versions[STORE_MAX_VERSIONS];
+    size_t n = read_versions(path, versions);
+    free(path);
+
+    for (size_t i = 0; i < n; i++) {
+      ref_object(versions[i].object);
+    }
+  }
+
+  closedir(refs);
+  return true;
+}
+
+// Delete every object no version refers to. Returns how many were deleted.
+static size_t sweep(void) {
+  char *dir = store_path("objects", NULL);
+  DIR *objects = opendir(dir);
+  free(dir);
+  if (objects == NULL) {
+    perrno("Could not list the objects of the store");
+    return 0;
+  }
+
+  size_t swept = 0;
+  struct dirent *entry;
+  while ((entry = readdir(objects)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        *find_ref(entry->d_name) != NULL) {
+      continue;
+    }
+
+    if (unlinkat(dirfd(objects), entry->d_name, 0) < 0) {
+      perrno("Could not delete object %s", entry->d_name);
+    } else {
+      swept++;
+    }
+  }
+
+  closedir(objects);
+  return swept;
+}
+
+// Link pointing to the reference count of `object` in its bucket, to NULL if
+// no version refers to it. Objects are named by their hash, whose first
+// digits pick the bucket. The lock must be held.
+static object_ref **find_ref(const char *object) {
+  char prefix[9] = {0};
+  strncpy(prefix, object, 8);
+  object_ref **link = &object_refs[strtoul(prefix, NULL, 16) %
+                                   STORE_REF_BUCKETS];
+
+  while (*link != NULL && strcmp((*link)->object, object) != 0) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// Count one more version referring to `object`. The lock must be held.
+static void ref_object(const char *object) {
+  object_ref **link = find_ref(object);
+  if (*link == NULL) {
+    *link = malloc_s(sizeof(object_ref));
+    strcpy((*link)->object, object);
+    (*link)->count = 0;
+    (*link)->next = NULL;
+  }
+  (*link)->count++;
+}
+
+// Count one less version referring to `object`, and delete it once none
+// does. The lock must be held.
+static void unref_object(const char *object) {
+  object_ref **link = find_ref(object);
+  if (*link == NULL || --(*link)->count > 0) {
+    return;
+  }
+
+  object_ref *ref = *link;
+  *link = ref->next;
+  free(ref);
+
+  char *path = store_path("objects", object);
+  if (unlink(path) < 0) {
+    perrno("Could not delete object %s", object);
+  } else {
+    debug("Collected object %s", object);
+  }
+  free(path);
+}
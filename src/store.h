@@ -0,0 +1,12 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "shared.h"
+
+bool store_enabled(void);
+void store_save(const char *, const char *, size_t, content_encoding);
+
+#endif
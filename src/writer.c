@@ -0,0 +1,142 @@
+#include <pthread.h>
+
+#include "encoding.h"
+#include "writer.h"
+
+// Number of writes that can be queued before submitting blocks
+#define WRITER_QUEUE_LEN 64
+
+// A file to write: `len` bytes of `buf`, starting at `offset`, decompressed
+// first unless `encoding` is identity
+typedef struct {
+  char *file_name;
+  buffer *buf;
+  size_t offset, len;
+  content_encoding encoding;
+} write_job;
+
+static bool ASYNC_WRITES = false;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+
+// Circular queue of jobs, shared with the writer thread
+static write_job queue[WRITER_QUEUE_LEN];
+static size_t queue_head = 0, queue_count = 0;
+// Whether the writer thread is writing a batch it took from the queue
+static bool writing = false;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_idle = PTHREAD_COND_INITIALIZER;
+
+static void writer_init(void);
+static void *writer(void *);
+
+// Whether files are saved by a background thread, which is enabled by the env
+// var ASYNC_WRITES=1
+bool writer_enabled(void) {
+  pthread_once(&writer_once, writer_init);
+  return ASYNC_WRITES;
+}
+
+// Queue `len` bytes of `buf`, starting at `offset`, to be saved to `file_name`
+// by the writer thread, which decompresses them unless `enc` is identity. The
+// job takes ownership of `file_name` and a reference to `buf`, so the content
+// is not copied.
+//
+// Blocks while the queue is full, so requests slow down instead of piling up
+// content in memory when the disk cannot keep up.
+void writer_submit(char *file_name, buffer *buf, size_t offset, size_t len,
+                   content_encoding enc) {
+  pthread_once(&writer_once, writer_init);
+
+  write_job job = {file_name, buffer_ref(buf), offset, len, enc};
+
+  pthread_mutex_lock(&writer_lock);
+
+  while (queue_count == WRITER_QUEUE_LEN) {
+    debug("Write queue is full, waiting");
+    pthread_cond_wait(&queue_not_full, &writer_lock);
+  }
+
+  queue[(queue_head + queue_count) % WRITER_QUEUE_LEN] = job;
+  queue_count++;
+
+  pthread_cond_signal(&queue_not_empty);
+  pthread_mutex_unlock(&writer_lock);
+}
+
+// Wait until every queued file was written
+void writer_flush(void) {
+  pthread_mutex_lock(&writer_lock);
+
+  while (queue_count > 0 || writing) {
+    pthread_cond_wait(&writer_idle, &writer_lock);
+  }
+
+  pthread_mutex_unlock(&writer_lock);
+}
+
+// Read the configuration from the environment and start the writer thread
+static void writer_init(void) {
+  if (getenv("ASYNC_WRITES") == NULL) {
+    return;
+  }
+
+  pthread_t t;
+  if (pthread_create(&t, NULL, writer, NULL) != 0) {
+    error("Could not start the writer, saving files synchronously");
+    return;
+  }
+  pthread_detach(t);
+
+  ASYNC_WRITES = true;
+}
+
+// Take every queued job at once and write them. When the same file was queued
+// several times, only its latest content is written.
+static void *writer(void *arg) {
+  write_job batch[WRITER_QUEUE_LEN];
+
+  while (true) {
+    pthread_mutex_lock(&writer_lock);
+
+    while (queue_count == 0) {
+      pthread_cond_wait(&queue_not_empty, &writer_lock);
+    }
+
+    size_t count = queue_count;
+    for (size_t i = 0; i < count; i++) {
+      batch[i] = queue[(queue_head + i) % WRITER_QUEUE_LEN];
+    }
+    queue_head = (queue_head + count) % WRITER_QUEUE_LEN;
+    queue_count = 0;
+    writing = true;
+
+    pthread_cond_broadcast(&queue_not_full);
+    pthread_mutex_unlock(&writer_lock);
+
+    debug("Writing a batch of %zu files", count);
+
+    for (size_t i = 0; i < count; i++) {
+      bool superseded = false;
+      for (size_t j = i + 1; j < count && !superseded; j++) {
+        superseded = strcmp(batch[i].file_name, batch[j].file_name) == 0;
+      }
+
+      if (!superseded) {
+        encoding_save(batch[i].file_name, batch[i].buf->data + batch[i].offset,
+                      batch[i].len, batch[i].encoding);
+      }
+
+      free(batch[i].file_name);
+      buffer_unref(batch[i].buf);
+    }
+
+    pthread_mutex_lock(&writer_lock);
+    writing = false;
+    pthread_cond_broadcast(&writer_idle);
+    pthread_mutex_unlock(&writer_lock);
+  }
+
+  return NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "shared.h"
+
+bool writer_enabled(void);
+void writer_submit(char *, buffer *, size_t, size_t, content_encoding);
+void writer_flush(void);
+
+#endif